@@ -0,0 +1,1069 @@
+/*
+ *  AES-128 block encryption backends
+ *
+ *  Copyright (C) 2006-2015, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  The table based implementation is taken from mbed TLS (https://tls.mbed.org),
+ *  the bitsliced one from BearSSL (https://bearssl.org)
+ */
+/*
+ *  The AES block cipher was designed by Vincent Rijmen and Joan Daemen.
+ *
+ *  http://csrc.nist.gov/encryption/aes/rijndael/Rijndael.pdf
+ *  http://csrc.nist.gov/publications/fips/fips197/fips-197.pdf
+ */
+
+#include <string.h>
+
+#include "aes128.h"
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+
+/*
+ * 32-bit integer manipulation macros (little endian)
+ */
+#ifndef GET_UINT32_LE
+#define GET_UINT32_LE(n,b,i)                            \
+{                                                       \
+    (n) = ( (uint32_t) (b)[(i)    ]       )             \
+        | ( (uint32_t) (b)[(i) + 1] <<  8 )             \
+        | ( (uint32_t) (b)[(i) + 2] << 16 )             \
+        | ( (uint32_t) (b)[(i) + 3] << 24 );            \
+}
+#endif
+
+#ifndef PUT_UINT32_LE
+#define PUT_UINT32_LE(n,b,i)                                    \
+{                                                               \
+    (b)[(i)    ] = (unsigned char) ( ( (n)       ) & 0xFF );    \
+    (b)[(i) + 1] = (unsigned char) ( ( (n) >>  8 ) & 0xFF );    \
+    (b)[(i) + 2] = (unsigned char) ( ( (n) >> 16 ) & 0xFF );    \
+    (b)[(i) + 3] = (unsigned char) ( ( (n) >> 24 ) & 0xFF );    \
+}
+#endif
+
+#if (AES_BACKEND == AES_BACKEND_SOFTDEVICE)
+
+/*
+ * The ECB peripheral is owned by the SoftDevice. The key is loaded into the
+ * context once, so every block only has to copy the cleartext in.
+ */
+int aes128_setkey( aes128_ctx_t *ctx, const uint8_t key[16] )
+{
+    memcpy( ctx->ecb.key, key, 16 );
+    return( 0 );
+}
+
+int aes128_encrypt( aes128_ctx_t *ctx, const uint8_t input[16], uint8_t output[16] )
+{
+    int ret;
+
+    memcpy( ctx->ecb.cleartext, input, 16 );
+    ret = sd_ecb_block_encrypt( &ctx->ecb );
+    memcpy( output, ctx->ecb.ciphertext, 16 );
+
+    return( ret );
+}
+
+/*
+ * S132 v3 takes a whole batch of blocks in one SVC call. Older SoftDevices
+ * only have the single block call.
+ */
+int aes128_encrypt_blocks( aes128_ctx_t *ctx, const uint8_t *input, uint8_t *output, size_t n )
+{
+    int ret = 0;
+
+#if (NRF_SD_BLE_API_VERSION >= 3)
+    nrf_ecb_hal_data_block_t blocks[AES_ECB_MAX_BLOCKS];
+    size_t i, k;
+
+    while( n > 0 )
+    {
+        k = n > AES_ECB_MAX_BLOCKS ? AES_ECB_MAX_BLOCKS : n;
+
+        for( i = 0; i < k; i++ )
+        {
+            blocks[i].p_key        = (soc_ecb_key_t const *) ctx->ecb.key;
+            blocks[i].p_cleartext  = (soc_ecb_cleartext_t const *)( input + 16 * i );
+            blocks[i].p_ciphertext = (soc_ecb_ciphertext_t *)( output + 16 * i );
+        }
+
+        if( ( ret = sd_ecb_blocks_encrypt( (uint8_t) k, blocks ) ) != 0 )
+            return( ret );
+
+        input  += 16 * k;
+        output += 16 * k;
+        n      -= k;
+    }
+#else
+    for( ; n > 0; n--, input += 16, output += 16 )
+    {
+        if( ( ret = aes128_encrypt( ctx, input, output ) ) != 0 )
+            return( ret );
+    }
+#endif
+
+    return( ret );
+}
+
+#elif (AES_BACKEND == AES_BACKEND_BITSLICE)
+
+/*
+ * Constant-time bitsliced AES, after the aes_ct code of BearSSL
+ * (https://bearssl.org).
+ *
+ * Copyright (c) 2016 Thomas Pornin <pornin@bolet.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Two blocks are held in eight 32-bit words, word i carrying bit i of every
+ * byte of both blocks. The S-box is a circuit of 113 and/xor/xnor gates
+ * (Boyar and Peralta), so there are no table lookups and no data dependent
+ * timing. A pass over two blocks costs about the same as a pass over one.
+ */
+
+/*
+ * S-box on all 32 bytes of the bitsliced state at once
+ */
+static void aes_bs_sbox( uint32_t *q )
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint32_t y20, y21;
+    uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    /*
+     * Top linear transformation
+     */
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    /*
+     * Non-linear section
+     */
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    /*
+     * Bottom linear transformation
+     */
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/*
+ * Transpose between byte order and bitsliced order (an involution)
+ */
+#define AES_BS_SWAPN(cl, ch, s, x, y)                               \
+{                                                                   \
+    uint32_t a_ = (x), b_ = (y);                                    \
+    (x) = ( a_ & (uint32_t)(cl) ) | ( ( b_ & (uint32_t)(cl) ) << (s) ); \
+    (y) = ( ( a_ & (uint32_t)(ch) ) >> (s) ) | ( b_ & (uint32_t)(ch) ); \
+}
+
+#define AES_BS_SWAP2(x, y)  AES_BS_SWAPN( 0x55555555, 0xAAAAAAAA, 1, x, y )
+#define AES_BS_SWAP4(x, y)  AES_BS_SWAPN( 0x33333333, 0xCCCCCCCC, 2, x, y )
+#define AES_BS_SWAP8(x, y)  AES_BS_SWAPN( 0x0F0F0F0F, 0xF0F0F0F0, 4, x, y )
+
+static void aes_bs_ortho( uint32_t *q )
+{
+    AES_BS_SWAP2( q[0], q[1] );
+    AES_BS_SWAP2( q[2], q[3] );
+    AES_BS_SWAP2( q[4], q[5] );
+    AES_BS_SWAP2( q[6], q[7] );
+
+    AES_BS_SWAP4( q[0], q[2] );
+    AES_BS_SWAP4( q[1], q[3] );
+    AES_BS_SWAP4( q[4], q[6] );
+    AES_BS_SWAP4( q[5], q[7] );
+
+    AES_BS_SWAP8( q[0], q[4] );
+    AES_BS_SWAP8( q[1], q[5] );
+    AES_BS_SWAP8( q[2], q[6] );
+    AES_BS_SWAP8( q[3], q[7] );
+}
+
+static void aes_bs_shift_rows( uint32_t *q )
+{
+    int i;
+    uint32_t x;
+
+    for( i = 0; i < 8; i++ )
+    {
+        x = q[i];
+        q[i] = ( x & 0x000000FF )
+             | ( ( x & 0x0000FC00 ) >> 2 ) | ( ( x & 0x00000300 ) << 6 )
+             | ( ( x & 0x00F00000 ) >> 4 ) | ( ( x & 0x000F0000 ) << 4 )
+             | ( ( x & 0xC0000000 ) >> 6 ) | ( ( x & 0x3F000000 ) << 2 );
+    }
+}
+
+#define AES_BS_ROTR8(x)     ( ( (x) >>  8 ) | ( (x) << 24 ) )
+#define AES_BS_ROTR16(x)    ( ( (x) >> 16 ) | ( (x) << 16 ) )
+
+static void aes_bs_mix_columns( uint32_t *q )
+{
+    uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+    uint32_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+    q0 = q[0]; r0 = AES_BS_ROTR8( q0 );
+    q1 = q[1]; r1 = AES_BS_ROTR8( q1 );
+    q2 = q[2]; r2 = AES_BS_ROTR8( q2 );
+    q3 = q[3]; r3 = AES_BS_ROTR8( q3 );
+    q4 = q[4]; r4 = AES_BS_ROTR8( q4 );
+    q5 = q[5]; r5 = AES_BS_ROTR8( q5 );
+    q6 = q[6]; r6 = AES_BS_ROTR8( q6 );
+    q7 = q[7]; r7 = AES_BS_ROTR8( q7 );
+
+    q[0] = q7 ^ r7 ^ r0 ^ AES_BS_ROTR16( q0 ^ r0 );
+    q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ AES_BS_ROTR16( q1 ^ r1 );
+    q[2] = q1 ^ r1 ^ r2 ^ AES_BS_ROTR16( q2 ^ r2 );
+    q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ AES_BS_ROTR16( q3 ^ r3 );
+    q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ AES_BS_ROTR16( q4 ^ r4 );
+    q[5] = q4 ^ r4 ^ r5 ^ AES_BS_ROTR16( q5 ^ r5 );
+    q[6] = q5 ^ r5 ^ r6 ^ AES_BS_ROTR16( q6 ^ r6 );
+    q[7] = q6 ^ r6 ^ r7 ^ AES_BS_ROTR16( q7 ^ r7 );
+}
+
+static void aes_bs_add_round_key( uint32_t *q, const uint32_t *sk )
+{
+    int i;
+
+    for( i = 0; i < 8; i++ )
+        q[i] ^= sk[i];
+}
+
+static uint32_t aes_bs_sub_word( uint32_t x )
+{
+    uint32_t q[8];
+    int i;
+
+    for( i = 0; i < 8; i++ )
+        q[i] = x;
+
+    aes_bs_ortho( q );
+    aes_bs_sbox( q );
+    aes_bs_ortho( q );
+
+    return( q[0] );
+}
+
+static const unsigned char RCON[10] =
+{
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+};
+
+/*
+ * The context keeps the 44-word compressed schedule, one bitsliced copy per
+ * round key with the lanes of the two blocks interleaved. It is widened to
+ * 88 words on the stack for each call.
+ */
+int aes128_setkey( aes128_ctx_t *ctx, const uint8_t key[16] )
+{
+    uint32_t skey[88];
+    uint32_t tmp = 0;
+    int i, j;
+
+    for( i = 0; i < 4; i++ )
+    {
+        GET_UINT32_LE( tmp, key, i << 2 );
+        skey[( i << 1 )    ] = tmp;
+        skey[( i << 1 ) + 1] = tmp;
+    }
+
+    for( i = 4; i < 44; i++ )
+    {
+        if( ( i & 3 ) == 0 )
+        {
+            tmp = ( tmp << 24 ) | ( tmp >> 8 );
+            tmp = aes_bs_sub_word( tmp ) ^ RCON[( i >> 2 ) - 1];
+        }
+        tmp ^= skey[( i - 4 ) << 1];
+        skey[( i << 1 )    ] = tmp;
+        skey[( i << 1 ) + 1] = tmp;
+    }
+
+    for( i = 0; i < 44; i += 4 )
+        aes_bs_ortho( skey + ( i << 1 ) );
+
+    for( i = 0, j = 0; i < 44; i++, j += 2 )
+        ctx->rk[i] = ( skey[j] & 0x55555555 ) | ( skey[j + 1] & 0xAAAAAAAA );
+
+    mbedtls_zeroize( skey, sizeof( skey ) );
+
+    return( 0 );
+}
+
+static void aes_bs_skey_expand( uint32_t *skey, const uint32_t *comp )
+{
+    int i, j;
+    uint32_t x, y;
+
+    for( i = 0, j = 0; i < 44; i++, j += 2 )
+    {
+        x = comp[i] & 0x55555555;
+        y = comp[i] & 0xAAAAAAAA;
+        skey[j    ] = x | ( x << 1 );
+        skey[j + 1] = y | ( y >> 1 );
+    }
+}
+
+/*
+ * Two blocks through the ten rounds. in2 / out2 may be NULL for a single
+ * block, the second lane then just runs on zeros.
+ */
+static void aes_bs_encrypt2( const uint32_t *skey,
+                             const uint8_t in1[16], const uint8_t in2[16],
+                             uint8_t out1[16], uint8_t out2[16] )
+{
+    uint32_t q[8];
+    int i;
+
+    GET_UINT32_LE( q[0], in1,  0 );
+    GET_UINT32_LE( q[2], in1,  4 );
+    GET_UINT32_LE( q[4], in1,  8 );
+    GET_UINT32_LE( q[6], in1, 12 );
+
+    if( in2 != NULL )
+    {
+        GET_UINT32_LE( q[1], in2,  0 );
+        GET_UINT32_LE( q[3], in2,  4 );
+        GET_UINT32_LE( q[5], in2,  8 );
+        GET_UINT32_LE( q[7], in2, 12 );
+    }
+    else
+    {
+        q[1] = q[3] = q[5] = q[7] = 0;
+    }
+
+    aes_bs_ortho( q );
+
+    aes_bs_add_round_key( q, skey );
+
+    for( i = 1; i < 10; i++ )
+    {
+        aes_bs_sbox( q );
+        aes_bs_shift_rows( q );
+        aes_bs_mix_columns( q );
+        aes_bs_add_round_key( q, skey + ( i << 3 ) );
+    }
+
+    aes_bs_sbox( q );
+    aes_bs_shift_rows( q );
+    aes_bs_add_round_key( q, skey + 80 );
+
+    aes_bs_ortho( q );
+
+    PUT_UINT32_LE( q[0], out1,  0 );
+    PUT_UINT32_LE( q[2], out1,  4 );
+    PUT_UINT32_LE( q[4], out1,  8 );
+    PUT_UINT32_LE( q[6], out1, 12 );
+
+    if( out2 != NULL )
+    {
+        PUT_UINT32_LE( q[1], out2,  0 );
+        PUT_UINT32_LE( q[3], out2,  4 );
+        PUT_UINT32_LE( q[5], out2,  8 );
+        PUT_UINT32_LE( q[7], out2, 12 );
+    }
+
+    mbedtls_zeroize( q, sizeof( q ) );
+}
+
+int aes128_encrypt( aes128_ctx_t *ctx, const uint8_t input[16], uint8_t output[16] )
+{
+    uint32_t skey[88];
+
+    aes_bs_skey_expand( skey, ctx->rk );
+    aes_bs_encrypt2( skey, input, NULL, output, NULL );
+    mbedtls_zeroize( skey, sizeof( skey ) );
+
+    return( 0 );
+}
+
+/*
+ * Blocks go through in pairs, the key schedule is widened once per call.
+ */
+int aes128_encrypt_blocks( aes128_ctx_t *ctx, const uint8_t *input, uint8_t *output, size_t n )
+{
+    uint32_t skey[88];
+
+    aes_bs_skey_expand( skey, ctx->rk );
+
+    for( ; n >= 2; n -= 2, input += 32, output += 32 )
+        aes_bs_encrypt2( skey, input, input + 16, output, output + 16 );
+
+    if( n > 0 )
+        aes_bs_encrypt2( skey, input, NULL, output, NULL );
+
+    mbedtls_zeroize( skey, sizeof( skey ) );
+
+    return( 0 );
+}
+
+#else /* AES_BACKEND_SOFTWARE || AES_BACKEND_HOST */
+
+/*
+ * Forward S-box
+ */
+static const unsigned char FSb[256] =
+{
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5,
+    0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0,
+    0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC,
+    0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A,
+    0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0,
+    0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B,
+    0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85,
+    0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5,
+    0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17,
+    0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88,
+    0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C,
+    0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9,
+    0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6,
+    0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E,
+    0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94,
+    0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68,
+    0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+/*
+ * Forward table
+ */
+#define FT \
+\
+    V(A5,63,63,C6), V(84,7C,7C,F8), V(99,77,77,EE), V(8D,7B,7B,F6), \
+    V(0D,F2,F2,FF), V(BD,6B,6B,D6), V(B1,6F,6F,DE), V(54,C5,C5,91), \
+    V(50,30,30,60), V(03,01,01,02), V(A9,67,67,CE), V(7D,2B,2B,56), \
+    V(19,FE,FE,E7), V(62,D7,D7,B5), V(E6,AB,AB,4D), V(9A,76,76,EC), \
+    V(45,CA,CA,8F), V(9D,82,82,1F), V(40,C9,C9,89), V(87,7D,7D,FA), \
+    V(15,FA,FA,EF), V(EB,59,59,B2), V(C9,47,47,8E), V(0B,F0,F0,FB), \
+    V(EC,AD,AD,41), V(67,D4,D4,B3), V(FD,A2,A2,5F), V(EA,AF,AF,45), \
+    V(BF,9C,9C,23), V(F7,A4,A4,53), V(96,72,72,E4), V(5B,C0,C0,9B), \
+    V(C2,B7,B7,75), V(1C,FD,FD,E1), V(AE,93,93,3D), V(6A,26,26,4C), \
+    V(5A,36,36,6C), V(41,3F,3F,7E), V(02,F7,F7,F5), V(4F,CC,CC,83), \
+    V(5C,34,34,68), V(F4,A5,A5,51), V(34,E5,E5,D1), V(08,F1,F1,F9), \
+    V(93,71,71,E2), V(73,D8,D8,AB), V(53,31,31,62), V(3F,15,15,2A), \
+    V(0C,04,04,08), V(52,C7,C7,95), V(65,23,23,46), V(5E,C3,C3,9D), \
+    V(28,18,18,30), V(A1,96,96,37), V(0F,05,05,0A), V(B5,9A,9A,2F), \
+    V(09,07,07,0E), V(36,12,12,24), V(9B,80,80,1B), V(3D,E2,E2,DF), \
+    V(26,EB,EB,CD), V(69,27,27,4E), V(CD,B2,B2,7F), V(9F,75,75,EA), \
+    V(1B,09,09,12), V(9E,83,83,1D), V(74,2C,2C,58), V(2E,1A,1A,34), \
+    V(2D,1B,1B,36), V(B2,6E,6E,DC), V(EE,5A,5A,B4), V(FB,A0,A0,5B), \
+    V(F6,52,52,A4), V(4D,3B,3B,76), V(61,D6,D6,B7), V(CE,B3,B3,7D), \
+    V(7B,29,29,52), V(3E,E3,E3,DD), V(71,2F,2F,5E), V(97,84,84,13), \
+    V(F5,53,53,A6), V(68,D1,D1,B9), V(00,00,00,00), V(2C,ED,ED,C1), \
+    V(60,20,20,40), V(1F,FC,FC,E3), V(C8,B1,B1,79), V(ED,5B,5B,B6), \
+    V(BE,6A,6A,D4), V(46,CB,CB,8D), V(D9,BE,BE,67), V(4B,39,39,72), \
+    V(DE,4A,4A,94), V(D4,4C,4C,98), V(E8,58,58,B0), V(4A,CF,CF,85), \
+    V(6B,D0,D0,BB), V(2A,EF,EF,C5), V(E5,AA,AA,4F), V(16,FB,FB,ED), \
+    V(C5,43,43,86), V(D7,4D,4D,9A), V(55,33,33,66), V(94,85,85,11), \
+    V(CF,45,45,8A), V(10,F9,F9,E9), V(06,02,02,04), V(81,7F,7F,FE), \
+    V(F0,50,50,A0), V(44,3C,3C,78), V(BA,9F,9F,25), V(E3,A8,A8,4B), \
+    V(F3,51,51,A2), V(FE,A3,A3,5D), V(C0,40,40,80), V(8A,8F,8F,05), \
+    V(AD,92,92,3F), V(BC,9D,9D,21), V(48,38,38,70), V(04,F5,F5,F1), \
+    V(DF,BC,BC,63), V(C1,B6,B6,77), V(75,DA,DA,AF), V(63,21,21,42), \
+    V(30,10,10,20), V(1A,FF,FF,E5), V(0E,F3,F3,FD), V(6D,D2,D2,BF), \
+    V(4C,CD,CD,81), V(14,0C,0C,18), V(35,13,13,26), V(2F,EC,EC,C3), \
+    V(E1,5F,5F,BE), V(A2,97,97,35), V(CC,44,44,88), V(39,17,17,2E), \
+    V(57,C4,C4,93), V(F2,A7,A7,55), V(82,7E,7E,FC), V(47,3D,3D,7A), \
+    V(AC,64,64,C8), V(E7,5D,5D,BA), V(2B,19,19,32), V(95,73,73,E6), \
+    V(A0,60,60,C0), V(98,81,81,19), V(D1,4F,4F,9E), V(7F,DC,DC,A3), \
+    V(66,22,22,44), V(7E,2A,2A,54), V(AB,90,90,3B), V(83,88,88,0B), \
+    V(CA,46,46,8C), V(29,EE,EE,C7), V(D3,B8,B8,6B), V(3C,14,14,28), \
+    V(79,DE,DE,A7), V(E2,5E,5E,BC), V(1D,0B,0B,16), V(76,DB,DB,AD), \
+    V(3B,E0,E0,DB), V(56,32,32,64), V(4E,3A,3A,74), V(1E,0A,0A,14), \
+    V(DB,49,49,92), V(0A,06,06,0C), V(6C,24,24,48), V(E4,5C,5C,B8), \
+    V(5D,C2,C2,9F), V(6E,D3,D3,BD), V(EF,AC,AC,43), V(A6,62,62,C4), \
+    V(A8,91,91,39), V(A4,95,95,31), V(37,E4,E4,D3), V(8B,79,79,F2), \
+    V(32,E7,E7,D5), V(43,C8,C8,8B), V(59,37,37,6E), V(B7,6D,6D,DA), \
+    V(8C,8D,8D,01), V(64,D5,D5,B1), V(D2,4E,4E,9C), V(E0,A9,A9,49), \
+    V(B4,6C,6C,D8), V(FA,56,56,AC), V(07,F4,F4,F3), V(25,EA,EA,CF), \
+    V(AF,65,65,CA), V(8E,7A,7A,F4), V(E9,AE,AE,47), V(18,08,08,10), \
+    V(D5,BA,BA,6F), V(88,78,78,F0), V(6F,25,25,4A), V(72,2E,2E,5C), \
+    V(24,1C,1C,38), V(F1,A6,A6,57), V(C7,B4,B4,73), V(51,C6,C6,97), \
+    V(23,E8,E8,CB), V(7C,DD,DD,A1), V(9C,74,74,E8), V(21,1F,1F,3E), \
+    V(DD,4B,4B,96), V(DC,BD,BD,61), V(86,8B,8B,0D), V(85,8A,8A,0F), \
+    V(90,70,70,E0), V(42,3E,3E,7C), V(C4,B5,B5,71), V(AA,66,66,CC), \
+    V(D8,48,48,90), V(05,03,03,06), V(01,F6,F6,F7), V(12,0E,0E,1C), \
+    V(A3,61,61,C2), V(5F,35,35,6A), V(F9,57,57,AE), V(D0,B9,B9,69), \
+    V(91,86,86,17), V(58,C1,C1,99), V(27,1D,1D,3A), V(B9,9E,9E,27), \
+    V(38,E1,E1,D9), V(13,F8,F8,EB), V(B3,98,98,2B), V(33,11,11,22), \
+    V(BB,69,69,D2), V(70,D9,D9,A9), V(89,8E,8E,07), V(A7,94,94,33), \
+    V(B6,9B,9B,2D), V(22,1E,1E,3C), V(92,87,87,15), V(20,E9,E9,C9), \
+    V(49,CE,CE,87), V(FF,55,55,AA), V(78,28,28,50), V(7A,DF,DF,A5), \
+    V(8F,8C,8C,03), V(F8,A1,A1,59), V(80,89,89,09), V(17,0D,0D,1A), \
+    V(DA,BF,BF,65), V(31,E6,E6,D7), V(C6,42,42,84), V(B8,68,68,D0), \
+    V(C3,41,41,82), V(B0,99,99,29), V(77,2D,2D,5A), V(11,0F,0F,1E), \
+    V(CB,B0,B0,7B), V(FC,54,54,A8), V(D6,BB,BB,6D), V(3A,16,16,2C)
+
+#define V(a,b,c,d) 0x##a##b##c##d
+static const uint32_t FT0[256] = { FT };
+#undef V
+
+#if !defined(AES_FEWER_TABLES)
+
+#define V(a,b,c,d) 0x##b##c##d##a
+static const uint32_t FT1[256] = { FT };
+#undef V
+
+#define V(a,b,c,d) 0x##c##d##a##b
+static const uint32_t FT2[256] = { FT };
+#undef V
+
+#define V(a,b,c,d) 0x##d##a##b##c
+static const uint32_t FT3[256] = { FT };
+#undef V
+
+#define AES_FT0(idx) FT0[idx]
+#define AES_FT1(idx) FT1[idx]
+#define AES_FT2(idx) FT2[idx]
+#define AES_FT3(idx) FT3[idx]
+
+#else /* AES_FEWER_TABLES */
+
+#define ROTL8(x)  ( (uint32_t)( ( x ) <<  8 ) + (uint32_t)( ( x ) >> 24 ) )
+#define ROTL16(x) ( (uint32_t)( ( x ) << 16 ) + (uint32_t)( ( x ) >> 16 ) )
+#define ROTL24(x) ( (uint32_t)( ( x ) << 24 ) + (uint32_t)( ( x ) >>  8 ) )
+
+#define AES_FT0(idx) FT0[idx]
+#define AES_FT1(idx) ROTL8(  FT0[idx] )
+#define AES_FT2(idx) ROTL16( FT0[idx] )
+#define AES_FT3(idx) ROTL24( FT0[idx] )
+
+#endif /* AES_FEWER_TABLES */
+
+#undef FT
+
+/*
+ * Round constants
+ */
+static const uint32_t RCON[10] =
+{
+    0x00000001, 0x00000002, 0x00000004, 0x00000008,
+    0x00000010, 0x00000020, 0x00000040, 0x00000080,
+    0x0000001B, 0x00000036
+};
+
+/*
+ * AES-128 key schedule (encryption only)
+ */
+int aes128_setkey( aes128_ctx_t *ctx, const uint8_t key[16] )
+{
+    unsigned int i;
+    uint32_t *RK = ctx->rk;
+
+    for( i = 0; i < 4; i++ )
+    {
+        GET_UINT32_LE( RK[i], key, i << 2 );
+    }
+
+    for( i = 0; i < 10; i++, RK += 4 )
+    {
+        RK[4]  = RK[0] ^ RCON[i] ^
+        ( (uint32_t) FSb[ ( RK[3] >>  8 ) & 0xFF ]       ) ^
+        ( (uint32_t) FSb[ ( RK[3] >> 16 ) & 0xFF ] <<  8 ) ^
+        ( (uint32_t) FSb[ ( RK[3] >> 24 ) & 0xFF ] << 16 ) ^
+        ( (uint32_t) FSb[ ( RK[3]       ) & 0xFF ] << 24 );
+
+        RK[5]  = RK[1] ^ RK[4];
+        RK[6]  = RK[2] ^ RK[5];
+        RK[7]  = RK[3] ^ RK[6];
+    }
+
+    return( 0 );
+}
+
+#define AES_FROUND(RK,X0,X1,X2,X3,Y0,Y1,Y2,Y3)                 \
+{                                                               \
+    X0 = (RK)[0] ^ AES_FT0( ( Y0       ) & 0xFF ) ^             \
+                   AES_FT1( ( Y1 >>  8 ) & 0xFF ) ^             \
+                   AES_FT2( ( Y2 >> 16 ) & 0xFF ) ^             \
+                   AES_FT3( ( Y3 >> 24 ) & 0xFF );              \
+                                                                \
+    X1 = (RK)[1] ^ AES_FT0( ( Y1       ) & 0xFF ) ^             \
+                   AES_FT1( ( Y2 >>  8 ) & 0xFF ) ^             \
+                   AES_FT2( ( Y3 >> 16 ) & 0xFF ) ^             \
+                   AES_FT3( ( Y0 >> 24 ) & 0xFF );              \
+                                                                \
+    X2 = (RK)[2] ^ AES_FT0( ( Y2       ) & 0xFF ) ^             \
+                   AES_FT1( ( Y3 >>  8 ) & 0xFF ) ^             \
+                   AES_FT2( ( Y0 >> 16 ) & 0xFF ) ^             \
+                   AES_FT3( ( Y1 >> 24 ) & 0xFF );              \
+                                                                \
+    X3 = (RK)[3] ^ AES_FT0( ( Y3       ) & 0xFF ) ^             \
+                   AES_FT1( ( Y0 >>  8 ) & 0xFF ) ^             \
+                   AES_FT2( ( Y1 >> 16 ) & 0xFF ) ^             \
+                   AES_FT3( ( Y2 >> 24 ) & 0xFF );              \
+}
+
+#define AES_FLAST(K,X0,Y0,Y1,Y2,Y3)                             \
+{                                                               \
+    X0 = (K) ^                                                  \
+            ( (uint32_t) FSb[ ( Y0       ) & 0xFF ]       ) ^   \
+            ( (uint32_t) FSb[ ( Y1 >>  8 ) & 0xFF ] <<  8 ) ^   \
+            ( (uint32_t) FSb[ ( Y2 >> 16 ) & 0xFF ] << 16 ) ^   \
+            ( (uint32_t) FSb[ ( Y3 >> 24 ) & 0xFF ] << 24 );    \
+}
+
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+/*
+ * Hardware AES on the host. setkey() lays out rk as the raw round keys, 16
+ * bytes per round, which is the operand format of AESENC and AESE as well.
+ * The instructions are probed once at run time, the tables stay as fallback.
+ */
+static int aes_hw = -1;
+
+#if defined(AES_HW_AESNI)
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+static int aes_hw_probe( void )
+{
+    unsigned int a, b, c, d;
+
+    if( __get_cpuid( 1, &a, &b, &c, &d ) == 0 )
+        return( 0 );
+
+    return( ( c & 0x02000000 ) != 0 );   /* CPUID.1:ECX.AES[bit 25] */
+}
+
+#define AESNI_ROUNDS(S, K)                                      \
+{                                                               \
+    S = _mm_xor_si128( S, K[0] );                               \
+    for( r = 1; r < 10; r++ )                                   \
+        S = _mm_aesenc_si128( S, K[r] );                        \
+    S = _mm_aesenclast_si128( S, K[10] );                       \
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_hw_encrypt_blocks( const uint32_t *rk, const uint8_t *input,
+                                   uint8_t *output, size_t n )
+{
+    int r;
+    __m128i k[11];
+    __m128i s0, s1, s2, s3;
+
+    for( r = 0; r < 11; r++ )
+        k[r] = _mm_loadu_si128( (const __m128i *)( rk + 4 * r ) );
+
+    /* Four independent blocks keep the AES unit busy */
+    for( ; n >= 4; n -= 4, input += 64, output += 64 )
+    {
+        s0 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)( input      ) ), k[0] );
+        s1 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)( input + 16 ) ), k[0] );
+        s2 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)( input + 32 ) ), k[0] );
+        s3 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *)( input + 48 ) ), k[0] );
+
+        for( r = 1; r < 10; r++ )
+        {
+            s0 = _mm_aesenc_si128( s0, k[r] );
+            s1 = _mm_aesenc_si128( s1, k[r] );
+            s2 = _mm_aesenc_si128( s2, k[r] );
+            s3 = _mm_aesenc_si128( s3, k[r] );
+        }
+
+        _mm_storeu_si128( (__m128i *)( output      ), _mm_aesenclast_si128( s0, k[10] ) );
+        _mm_storeu_si128( (__m128i *)( output + 16 ), _mm_aesenclast_si128( s1, k[10] ) );
+        _mm_storeu_si128( (__m128i *)( output + 32 ), _mm_aesenclast_si128( s2, k[10] ) );
+        _mm_storeu_si128( (__m128i *)( output + 48 ), _mm_aesenclast_si128( s3, k[10] ) );
+    }
+
+    for( ; n > 0; n--, input += 16, output += 16 )
+    {
+        s0 = _mm_loadu_si128( (const __m128i *) input );
+        AESNI_ROUNDS( s0, k );
+        _mm_storeu_si128( (__m128i *) output, s0 );
+    }
+}
+
+#else /* AES_HW_ARMV8 */
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+static int aes_hw_probe( void )
+{
+#if defined(__linux__) && defined(__aarch64__)
+    return( ( getauxval( AT_HWCAP ) & ( 1 << 3 ) ) != 0 );   /* HWCAP_AES */
+#elif defined(__linux__)
+    return( ( getauxval( AT_HWCAP2 ) & ( 1 << 0 ) ) != 0 );  /* HWCAP2_AES */
+#else
+    return( 1 );    /* built for a CPU with the extension */
+#endif
+}
+
+static void aes_hw_encrypt_blocks( const uint32_t *rk, const uint8_t *input,
+                                   uint8_t *output, size_t n )
+{
+    int r;
+    uint8x16_t k[11];
+    uint8x16_t s0, s1;
+
+    for( r = 0; r < 11; r++ )
+        k[r] = vld1q_u8( (const uint8_t *)( rk + 4 * r ) );
+
+    /* AESE is AddRoundKey + SubBytes + ShiftRows, AESMC is MixColumns */
+    for( ; n >= 2; n -= 2, input += 32, output += 32 )
+    {
+        s0 = vld1q_u8( input );
+        s1 = vld1q_u8( input + 16 );
+
+        for( r = 0; r < 9; r++ )
+        {
+            s0 = vaesmcq_u8( vaeseq_u8( s0, k[r] ) );
+            s1 = vaesmcq_u8( vaeseq_u8( s1, k[r] ) );
+        }
+
+        vst1q_u8( output,      veorq_u8( vaeseq_u8( s0, k[9] ), k[10] ) );
+        vst1q_u8( output + 16, veorq_u8( vaeseq_u8( s1, k[9] ), k[10] ) );
+    }
+
+    for( ; n > 0; n--, input += 16, output += 16 )
+    {
+        s0 = vld1q_u8( input );
+
+        for( r = 0; r < 9; r++ )
+            s0 = vaesmcq_u8( vaeseq_u8( s0, k[r] ) );
+
+        vst1q_u8( output, veorq_u8( vaeseq_u8( s0, k[9] ), k[10] ) );
+    }
+}
+#endif /* AES_HW_AESNI */
+
+static int aes_hw_enabled( void )
+{
+    if( aes_hw < 0 )
+        aes_hw = aes_hw_probe();
+
+    return( aes_hw );
+}
+
+int aes128_hw_select( int enable )
+{
+    aes_hw = enable ? aes_hw_probe() : 0;
+
+    return( aes_hw );
+}
+
+#endif /* AES_HW_AESNI || AES_HW_ARMV8 */
+
+/*
+ * AES-128-ECB block encryption
+ */
+int aes128_encrypt( aes128_ctx_t *ctx, const uint8_t input[16], uint8_t output[16] )
+{
+    int i;
+    const uint32_t *RK = ctx->rk;
+    uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
+
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+    if( aes_hw_enabled() )
+    {
+        aes_hw_encrypt_blocks( ctx->rk, input, output, 1 );
+        return( 0 );
+    }
+#endif
+
+    GET_UINT32_LE( X0, input,  0 ); X0 ^= RK[0];
+    GET_UINT32_LE( X1, input,  4 ); X1 ^= RK[1];
+    GET_UINT32_LE( X2, input,  8 ); X2 ^= RK[2];
+    GET_UINT32_LE( X3, input, 12 ); X3 ^= RK[3];
+
+    for( i = 4; i > 0; i-- )
+    {
+        AES_FROUND( RK + 4, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+        AES_FROUND( RK + 8, X0, X1, X2, X3, Y0, Y1, Y2, Y3 );
+        RK += 8;
+    }
+
+    AES_FROUND( RK + 4, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+
+    AES_FLAST( RK[ 8], X0, Y0, Y1, Y2, Y3 );
+    AES_FLAST( RK[ 9], X1, Y1, Y2, Y3, Y0 );
+    AES_FLAST( RK[10], X2, Y2, Y3, Y0, Y1 );
+    AES_FLAST( RK[11], X3, Y3, Y0, Y1, Y2 );
+
+    PUT_UINT32_LE( X0, output,  0 );
+    PUT_UINT32_LE( X1, output,  4 );
+    PUT_UINT32_LE( X2, output,  8 );
+    PUT_UINT32_LE( X3, output, 12 );
+
+    return( 0 );
+}
+
+#if defined(AES_INTERLEAVE)
+/*
+ * Two independent blocks through the same rounds. The table lookups of one
+ * block fill the load latency of the other.
+ */
+static void aes128_encrypt2( const aes128_ctx_t *ctx, const uint8_t input[32], uint8_t output[32] )
+{
+    int i;
+    const uint32_t *RK = ctx->rk;
+    uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
+    uint32_t U0, U1, U2, U3, V0, V1, V2, V3;
+
+    GET_UINT32_LE( X0, input,  0 ); X0 ^= RK[0];
+    GET_UINT32_LE( X1, input,  4 ); X1 ^= RK[1];
+    GET_UINT32_LE( X2, input,  8 ); X2 ^= RK[2];
+    GET_UINT32_LE( X3, input, 12 ); X3 ^= RK[3];
+    GET_UINT32_LE( U0, input, 16 ); U0 ^= RK[0];
+    GET_UINT32_LE( U1, input, 20 ); U1 ^= RK[1];
+    GET_UINT32_LE( U2, input, 24 ); U2 ^= RK[2];
+    GET_UINT32_LE( U3, input, 28 ); U3 ^= RK[3];
+
+    for( i = 4; i > 0; i-- )
+    {
+        AES_FROUND( RK + 4, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+        AES_FROUND( RK + 4, V0, V1, V2, V3, U0, U1, U2, U3 );
+        AES_FROUND( RK + 8, X0, X1, X2, X3, Y0, Y1, Y2, Y3 );
+        AES_FROUND( RK + 8, U0, U1, U2, U3, V0, V1, V2, V3 );
+        RK += 8;
+    }
+
+    AES_FROUND( RK + 4, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+    AES_FROUND( RK + 4, V0, V1, V2, V3, U0, U1, U2, U3 );
+
+    AES_FLAST( RK[ 8], X0, Y0, Y1, Y2, Y3 );
+    AES_FLAST( RK[ 9], X1, Y1, Y2, Y3, Y0 );
+    AES_FLAST( RK[10], X2, Y2, Y3, Y0, Y1 );
+    AES_FLAST( RK[11], X3, Y3, Y0, Y1, Y2 );
+    AES_FLAST( RK[ 8], U0, V0, V1, V2, V3 );
+    AES_FLAST( RK[ 9], U1, V1, V2, V3, V0 );
+    AES_FLAST( RK[10], U2, V2, V3, V0, V1 );
+    AES_FLAST( RK[11], U3, V3, V0, V1, V2 );
+
+    PUT_UINT32_LE( X0, output,  0 );
+    PUT_UINT32_LE( X1, output,  4 );
+    PUT_UINT32_LE( X2, output,  8 );
+    PUT_UINT32_LE( X3, output, 12 );
+    PUT_UINT32_LE( U0, output, 16 );
+    PUT_UINT32_LE( U1, output, 20 );
+    PUT_UINT32_LE( U2, output, 24 );
+    PUT_UINT32_LE( U3, output, 28 );
+}
+#endif /* AES_INTERLEAVE */
+
+/*
+ * AES-128-ECB encryption of independent blocks
+ */
+int aes128_encrypt_blocks( aes128_ctx_t *ctx, const uint8_t *input, uint8_t *output, size_t n )
+{
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+    if( aes_hw_enabled() )
+    {
+        aes_hw_encrypt_blocks( ctx->rk, input, output, n );
+        return( 0 );
+    }
+#endif
+
+#if defined(AES_INTERLEAVE)
+    for( ; n >= 2; n -= 2, input += 32, output += 32 )
+        aes128_encrypt2( ctx, input, output );
+#endif
+
+    for( ; n > 0; n--, input += 16, output += 16 )
+        aes128_encrypt( ctx, input, output );
+
+    return( 0 );
+}
+
+#endif /* AES_BACKEND */
+
+void aes128_free( aes128_ctx_t *ctx )
+{
+    if( ctx == NULL )
+        return;
+
+    mbedtls_zeroize( ctx, sizeof( aes128_ctx_t ) );
+}
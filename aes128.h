@@ -0,0 +1,166 @@
+/**
+ * \file aes128.h
+ *
+ * \brief AES-128 block encryption with a selectable backend
+ *
+ *  Copyright (C) 2006-2015, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef AES128_H
+#define AES128_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Backend selection
+ *
+ * AES_BACKEND_SOFTDEVICE   ECB peripheral through sd_ecb_block_encrypt()
+ * AES_BACKEND_SOFTWARE     table based software AES on the MCU
+ * AES_BACKEND_HOST         table based software AES for host builds
+ * AES_BACKEND_BITSLICE     constant-time bitsliced software AES, two blocks
+ *                          per pass; meant for the Cortex-M0 nRF51, where it
+ *                          keeps CCM off the SoftDevice ECB. Select it with
+ *                          AES_BACKEND=3 in the project defines.
+ */
+#define AES_BACKEND_SOFTDEVICE  0
+#define AES_BACKEND_SOFTWARE    1
+#define AES_BACKEND_HOST        2
+#define AES_BACKEND_BITSLICE    3
+
+#ifndef AES_BACKEND
+#if defined(SOFTDEVICE_PRESENT)
+#define AES_BACKEND AES_BACKEND_SOFTDEVICE
+#else
+#define AES_BACKEND AES_BACKEND_HOST
+#endif
+#endif
+
+/* One 1 KB table instead of four on the MCU, rotations are cheap there. */
+#if (AES_BACKEND == AES_BACKEND_SOFTWARE) && !defined(AES_FEWER_TABLES)
+#define AES_FEWER_TABLES
+#endif
+
+/* Two blocks in flight per round on hosts with registers to spare. */
+#if (AES_BACKEND == AES_BACKEND_HOST) && !defined(AES_INTERLEAVE)
+#define AES_INTERLEAVE
+#endif
+
+/*
+ * AES instructions of the host CPU, used when present at run time:
+ * AES-NI on x86 (GCC / Clang), the ARMv8 Crypto Extensions when the compiler
+ * targets them. Define AES_NO_HW to build the tables only.
+ */
+#if (AES_BACKEND == AES_BACKEND_HOST) && !defined(AES_NO_HW)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_HW_AESNI
+#elif (defined(__aarch64__) || defined(__arm__)) && \
+      (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define AES_HW_ARMV8
+#endif
+#endif
+
+/* Blocks handed to the SoftDevice per sd_ecb_blocks_encrypt() call */
+#ifndef AES_ECB_MAX_BLOCKS
+#define AES_ECB_MAX_BLOCKS      4
+#endif
+
+#if (AES_BACKEND == AES_BACKEND_SOFTDEVICE)
+#include "nrf_soc.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          AES-128 encryption context
+ *
+ *                 Holds the expanded key, so a key is scheduled once and then
+ *                 used for any number of blocks.
+ */
+typedef struct
+{
+#if (AES_BACKEND == AES_BACKEND_SOFTDEVICE)
+    nrf_ecb_hal_data_t ecb;     /*!<  key preloaded ECB request       */
+#elif (AES_BACKEND == AES_BACKEND_BITSLICE)
+    uint32_t rk[44];            /*!<  compressed bitsliced round keys  */
+#else
+    uint32_t rk[44];            /*!<  round keys, little endian words  */
+#endif
+}
+aes128_ctx_t;
+
+/**
+ * \brief          AES-128 key schedule (encryption only)
+ *
+ * \param ctx      AES context to be initialized
+ * \param key      16 bytes encryption key
+ *
+ * \return         0 if successful
+ */
+int aes128_setkey( aes128_ctx_t *ctx, const uint8_t key[16] );
+
+/**
+ * \brief          AES-128 ECB encryption of one block
+ *
+ * \param ctx      AES context set up by aes128_setkey()
+ * \param input    16-byte input block
+ * \param output   16-byte output block (may be the same as input)
+ *
+ * \return         0 if successful, SoftDevice error code otherwise
+ */
+int aes128_encrypt( aes128_ctx_t *ctx, const uint8_t input[16], uint8_t output[16] );
+
+/**
+ * \brief          AES-128 ECB encryption of independent blocks
+ *
+ *                 Saves the per call dispatch cost when several blocks are
+ *                 known up front, e.g. a run of CTR keystream blocks.
+ *
+ * \param ctx      AES context set up by aes128_setkey()
+ * \param input    n consecutive 16-byte input blocks
+ * \param output   n consecutive 16-byte output blocks (may be the same as
+ *                 input)
+ * \param n        number of blocks
+ *
+ * \return         0 if successful, SoftDevice error code otherwise
+ */
+int aes128_encrypt_blocks( aes128_ctx_t *ctx, const uint8_t *input, uint8_t *output, size_t n );
+
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+/**
+ * \brief          Select hardware or table AES on the host
+ *
+ * \param enable   0 forces the table code, otherwise the AES instructions
+ *                 are used if the CPU has them
+ *
+ * \return         1 if the AES instructions are now in use, 0 otherwise
+ */
+int aes128_hw_select( int enable );
+#endif
+
+/**
+ * \brief          Clear AES context (key material included)
+ *
+ * \param ctx      AES context to be cleared
+ */
+void aes128_free( aes128_ctx_t *ctx );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AES128_H */
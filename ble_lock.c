@@ -356,7 +356,7 @@ uint8_t get_lock_opcode(uint8_t *p_opcode)
 	if(memcmp(data, lock_operation, sizeof(data)) == 0)
 		return 2;
 
-	uint8_t errno = mi_session_decrypt(lock_operation, 7, data);
+	uint8_t errno = mi_session_decrypt(lock_srv.conn_handle, lock_operation, 7, data);
 
 	if (errno != 0) {
 		NRF_LOG_INFO("Lock Opcode decrypt error %d\n", errno);
@@ -382,7 +382,11 @@ uint32_t send_lock_stat(uint8_t status)
         return NRF_ERROR_INVALID_STATE;
     }
 	
-	mi_session_encrypt(&status, sizeof(status), value);
+	errno = mi_session_encrypt(lock_srv.conn_handle, &status, sizeof(status), value);
+	if (errno != 0) {
+		NRF_LOG_INFO("Lock stat encrypt error %d\n", errno);
+		return errno == 2 ? NRF_ERROR_BUSY : NRF_ERROR_INVALID_STATE;
+	}
 
     hvx_params.handle = lock_srv.state_handles.value_handle;
     hvx_params.p_data = value;
@@ -410,7 +414,11 @@ uint32_t send_lock_log(uint8_t* log, uint8_t len)
         return NRF_ERROR_INVALID_STATE;
     }
 	
-	mi_session_encrypt(log, len, value);
+	errno = mi_session_encrypt(lock_srv.conn_handle, log, len, value);
+	if (errno != 0) {
+		NRF_LOG_INFO("Lock log encrypt error %d\n", errno);
+		return errno == 2 ? NRF_ERROR_BUSY : NRF_ERROR_INVALID_STATE;
+	}
 
     hvx_params.handle = lock_srv.log_handles.value_handle;
     hvx_params.p_data = value;
@@ -16,6 +16,7 @@
 #include "mi_secure.h"
 #include "mi_crypto.h"
 #include "mi_config.h"
+#include "mi_metrics.h"
 
 #define NRF_LOG_MODULE_NAME "BLEM"
 #include "nrf_log.h"
@@ -28,6 +29,7 @@
 #define BLE_UUID_MI_CTRLP  0x0010                      /**< The UUID of the Control Point Characteristic. */
 #define BLE_UUID_MI_FXFER  0x0015                      /**< The UUID of the Fast xfer Characteristic. */
 #define BLE_UUID_MI_SECURE 0x0016                      /**< The UUID of the Secure Characteristic. */
+#define BLE_UUID_MI_DIAG   0x0017                      /**< The UUID of the Diagnostics Characteristic. */
 
 #define PUBKEY_BYTE 255
 #define FRAME_CTRL  0
@@ -91,7 +93,7 @@ static void on_disconnect(ble_evt_t * p_ble_evt)
     mi_srv.conn_handle = BLE_CONN_HANDLE_INVALID;
 
 	set_mi_authorization(UNAUTHORIZATION);
-	mi_crypto_uninit();
+	mi_crypto_uninit(p_ble_evt->evt.gap_evt.conn_handle);
 
 	NRF_LOG_RAW_INFO(NRF_LOG_COLOR_CODE_CYAN"Disconnect reason %X.\n",
 	                 p_ble_evt->evt.gap_evt.params.disconnected.reason);
@@ -421,8 +423,11 @@ static void rxfer_rx_decode(reliable_xfer_t *pxfer, uint8_t *pdata, uint8_t len)
 	reliable_xfer_frame_t      *pframe = (void*)pdata;
 	int8_t                    data_len = len - sizeof(pframe->sn);
 
-	if (data_len > 0)
+	if (data_len > 0) {
 		memcpy(pxfer->pdata + (pframe->sn - 1) * 18, pframe->data, data_len);
+		if (pxfer->rx_hook != NULL)
+			pxfer->rx_hook(pframe->sn, pframe->data, data_len);
+	}
 	else
 		NRF_LOG_ERROR("rxd data len error. \n");
 }
@@ -572,8 +577,13 @@ void ble_mi_on_ble_evt(ble_evt_t * p_ble_evt)
 
         case BLE_GATTS_EVT_WRITE:
             on_write(p_ble_evt);
+            mi_scheduler_wake(MI_SCHD_WAKE_RX);
             break;
 
+		case BLE_EVT_TX_COMPLETE:
+			mi_scheduler_wake(MI_SCHD_WAKE_TX);
+			break;
+
 		case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
 			break;		
 
@@ -588,6 +598,11 @@ void ble_mi_on_ble_evt(ble_evt_t * p_ble_evt)
     }
 }
 
+uint16_t ble_mi_conn_handle(void)
+{
+	return mi_srv.conn_handle;
+}
+
 uint32_t ble_mi_init(const ble_mi_init_t * p_mi_s_init)
 {
     uint32_t      err_code;
@@ -631,6 +646,15 @@ uint32_t ble_mi_init(const ble_mi_init_t * p_mi_s_init)
 	err_code = char_add(BLE_UUID_MI_SECURE, NULL, 20, char_props, &mi_srv.secure_handles);
 	APP_ERROR_CHECK(err_code);
 
+#if MI_METRICS_DIAG
+    // Add the Diagnostics Characteristic, the handshake timing of mi_metrics.h.
+	char_props = (ble_gatt_char_props_t){0};
+	char_props.read                  = 1;
+	err_code = char_add(BLE_UUID_MI_DIAG, (uint8_t *)mi_metrics_get(), sizeof(mi_metrics_t),
+	                    char_props, &mi_srv.diag_handles);
+	APP_ERROR_CHECK(err_code);
+#endif
+
 //	// Add the Fast xfer Characteristic.
 //	char_props = (ble_gatt_char_props_t){0};
 //	char_props.write_wo_resp         = 1;
@@ -114,6 +114,17 @@ typedef enum {
 	RXFER_ERROR = 0xFF
 } rxfer_stat_t;
 
+/**@brief Reliable transfer receive hook.
+ *
+ * @details Called for every data frame right after its payload has been stored,
+ *          so the receiver can consume the message while it is still arriving.
+ *
+ * @param[in] sn       frame serial number, starts from 1.
+ * @param[in] pdata    frame payload.
+ * @param[in] len      payload bytes.
+ */
+typedef void (*rxfer_rx_hook_t)(uint16_t sn, const uint8_t *pdata, uint8_t len);
+
 typedef struct {
 	uint16_t    max_tx_num;
 	uint16_t        tx_num;
@@ -126,6 +137,7 @@ typedef struct {
 	uint8_t         *pdata;
 	uint8_t     last_bytes;
 	rxfer_stat_t     state;
+	rxfer_rx_hook_t rx_hook;
 } reliable_xfer_t;
 
 /**@brief Xiaomi Service event handler type. */
@@ -154,6 +166,7 @@ typedef struct {
 	ble_gatts_char_handles_t ctrl_point_handles;      /**< Handles related to the characteristic (as provided by the SoftDevice). */
 	ble_gatts_char_handles_t secure_handles;
 	ble_gatts_char_handles_t fast_xfer_handles;              
+	ble_gatts_char_handles_t diag_handles;            /**< Handles of the Diagnostics Characteristic, read only, with MI_METRICS_DIAG. */
               
 	uint16_t                 conn_handle;             /**< Handle of the current connection (as provided by the SoftDevice). BLE_CONN_HANDLE_INVALID if not in a connection. */
 	bool                     is_notification_enabled; /**< Variable to indicate if the peer has enabled notification of the RX characteristic.*/
@@ -180,6 +193,12 @@ uint32_t ble_mi_init(const ble_mi_init_t * p_mi_s_init);
  */
 void ble_mi_on_ble_evt(ble_evt_t * p_ble_evt);
 
+/**@brief Function for getting the connection the Xiaomi Service talks to.
+ *
+ * @return  its handle, BLE_CONN_HANDLE_INVALID if not in a connection.
+ */
+uint16_t ble_mi_conn_handle(void);
+
 /**@brief Function for sending Auth status to the peer.
  *
  * @details This function sends the input status as an AUTH characteristic notification to the
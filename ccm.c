@@ -32,33 +32,38 @@
 
 #include <string.h>
 #include <stdio.h>
-#include "nrf_soc.h"
 
+#if defined(M_TEST)
 #define NRF_LOG_MODULE_NAME "CCM"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
+#endif
 
 #include "ccm.h"
 
-#define CCM_ENCRYPT 0
-#define CCM_DECRYPT 1
-
-static int aes_ecb_encrypt(const uint8_t* pKey, uint8_t* input, uint8_t* output)
-{
-	int ret;
-	nrf_ecb_hal_data_t ecb_data;
-	memcpy(ecb_data.key, pKey, 16);
-	memcpy(ecb_data.cleartext, input, 16);
-	ret = sd_ecb_block_encrypt(&ecb_data);
-	memcpy(output, ecb_data.ciphertext, 16);
-	return ret;
-}
+#define CCM_ENCRYPT MBEDTLS_CCM_ENCRYPT
+#define CCM_DECRYPT MBEDTLS_CCM_DECRYPT
 
 /* Implementation that should never be optimized out by the compiler */
 static void mbedtls_zeroize( void *v, size_t n ) {
     volatile unsigned char *p = v; while( n-- ) *p++ = 0;
 }
 
+void mbedtls_ccm_init( mbedtls_ccm_context *ctx )
+{
+    memset( ctx, 0, sizeof( mbedtls_ccm_context ) );
+}
+
+int mbedtls_ccm_setkey( mbedtls_ccm_context *ctx, const unsigned char *key )
+{
+    return( aes128_setkey( &ctx->aes, key ) );
+}
+
+void mbedtls_ccm_free( mbedtls_ccm_context *ctx )
+{
+    aes128_free( &ctx->aes );
+}
+
 /*
  * Macros for common operations.
  * Results in smaller compiled code than static inline functions.
@@ -72,40 +77,155 @@ static void mbedtls_zeroize( void *v, size_t n ) {
     for( i = 0; i < 16; i++ )                                               \
         y[i] ^= b[i];                                                       \
                                                                             \
-    if( ( ret = aes_ecb_encrypt( key, y, y) ) != 0 )                        \
+    if( ( ret = aes128_encrypt( &ctx->aes, y, y ) ) != 0 )                  \
         return( ret );
 
 /*
- * Encrypt or decrypt a partial block with CTR
- * Warning: using b for temporary storage! src and dst must not be b!
- * This avoids allocating one more 16 bytes buffer while allowing src == dst.
+ * Update the CBC-MAC state in y with up to 16 bytes of data, zero padded.
+ * XORing the data straight into y avoids staging it in b.
  */
-#define CTR_CRYPT( dst, src, len  )                                            \
-    if( ( ret = aes_ecb_encrypt( key, ctr, b) ) != 0 )                         \
-        return( ret );                                                         \
-                                                                               \
-    for( i = 0; i < len; i++ )                                                 \
-        dst[i] = src[i] ^ b[i];
+#define UPDATE_CBC_MAC_DATA( data, len )                                    \
+    for( i = 0; i < len; i++ )                                              \
+        y[i] ^= data[i];                                                    \
+                                                                            \
+    if( ( ret = aes128_encrypt( &ctx->aes, y, y ) ) != 0 )                  \
+        return( ret );
+
+/*
+ * Number of CTR keystream blocks computed per aes128_encrypt_blocks() call.
+ * 4 covers S_0 plus a 48-byte message in one go and saves SoftDevice ECB
+ * calls, but it was slower on the host from 64 B up and has no device
+ * number yet, so it is 1 unless the project defines set it.
+ */
+#ifndef CCM_ECB_BATCH
+#define CCM_ECB_BATCH 1
+#endif
+
+/*
+ * Fill ks with the keystream of n consecutive counter blocks starting at ctr,
+ * and advance ctr past them.
+ */
+static int ccm_ctr_keystream( mbedtls_ccm_context *ctx, unsigned char ctr[16],
+                              unsigned char q, unsigned char ks[][16], size_t n )
+{
+    size_t k;
+    unsigned char i;
+
+    for( k = 0; k < n; k++ )
+    {
+        memcpy( ks[k], ctr, 16 );
+
+        for( i = 0; i < q; i++ )
+            if( ++ctr[15-i] != 0 )
+                break;
+    }
+
+    return( aes128_encrypt_blocks( &ctx->aes, ks[0], ks[0], n ) );
+}
+
+/*
+ * Segment lists
+ *
+ * A block that lies within one segment is used in place. Only the blocks
+ * straddling two segments are gathered into, or scattered from, a block on
+ * the stack.
+ */
+typedef struct
+{
+    const mbedtls_ccm_iovec *v;
+    size_t cnt;
+    size_t off;
+}
+ccm_iov_iter;
+
+static size_t ccm_iov_total( const mbedtls_ccm_iovec *v, size_t cnt )
+{
+    size_t total = 0;
+
+    while( cnt-- > 0 )
+        total += v++->len;
+
+    return( total );
+}
+
+static void ccm_iov_skip( ccm_iov_iter *it )
+{
+    while( it->cnt > 0 && it->off == it->v->len )
+    {
+        it->v++;
+        it->cnt--;
+        it->off = 0;
+    }
+}
+
+/* The next len bytes in place, or NULL (cursor unchanged) if they straddle */
+static unsigned char *ccm_iov_span( ccm_iov_iter *it, size_t len )
+{
+    unsigned char *p;
+
+    ccm_iov_skip( it );
+
+    if( it->cnt == 0 || it->v->len - it->off < len )
+        return( NULL );
+
+    p = (unsigned char *) it->v->base + it->off;
+    it->off += len;
+
+    return( p );
+}
+
+/* Copy the next len bytes into buf (gather) or from buf (scatter) */
+static void ccm_iov_copy( ccm_iov_iter *it, unsigned char *buf, size_t len, int gather )
+{
+    unsigned char *p;
+    size_t n;
+
+    while( len > 0 )
+    {
+        ccm_iov_skip( it );
+
+        n = it->v->len - it->off;
+        if( n > len )
+            n = len;
+
+        p = (unsigned char *) it->v->base + it->off;
+        if( gather )
+            memcpy( buf, p, n );
+        else
+            memcpy( p, buf, n );
+
+        it->off += n;
+        buf += n;
+        len -= n;
+    }
+}
 
 /*
  * Authenticated encryption or decryption
  */
-static int ccm_auth_crypt( int mode, const unsigned char *key,
+static int ccm_auth_crypt( mbedtls_ccm_context *ctx, int mode,
                            const unsigned char *iv, size_t iv_len,
                            const unsigned char *add, size_t add_len,
-                           const unsigned char *input, size_t length,
-                           unsigned char *output,
-                           unsigned char *tag, size_t tag_len )
+                           const mbedtls_ccm_iovec *in, size_t in_cnt,
+                           const mbedtls_ccm_iovec *out, size_t out_cnt,
+                           size_t length,
+                           unsigned char *tag, size_t tag_len,
+                           const unsigned char *pre_ks )
 {
     int ret;
     unsigned char i;
     unsigned char q;
-    size_t len_left, olen;
+    size_t len_left, blocks_left, k, n;
     unsigned char b[16];
     unsigned char y[16];
     unsigned char ctr[16];
+    unsigned char s0[16];
+    unsigned char ks[CCM_ECB_BATCH][16];
+    unsigned char blk_in[16], blk_out[16];
+    const unsigned char *s0_p, *ks_p;
     const unsigned char *src;
     unsigned char *dst;
+    ccm_iov_iter in_it, out_it;
 
     /*
      * Check length requirements: SP800-38C A.1
@@ -192,16 +312,46 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
      * Prepare counter block for encryption:
      * 0        .. 0        flags
      * 1        .. iv_len   nonce (aka iv)
-     * iv_len+1 .. 15       counter (initially 1)
+     * iv_len+1 .. 15       counter (0 for the tag, then from 1)
      *
      * With flags as (bits):
      * 7 .. 3   0
      * 2 .. 0   q - 1
+     *
+     * The keystream does not depend on the data, so it is computed in
+     * batches of CCM_ECB_BATCH blocks. Only the CBC-MAC chain is serial.
+     * A caller that precomputed S_0 .. S_m passes them in pre_ks.
      */
     ctr[0] = q - 1;
     memcpy( ctr + 1, iv, iv_len );
     memset( ctr + 1 + iv_len, 0, q );
-    ctr[15] = 1;
+
+    blocks_left = 1 + ( length + 15 ) / 16;
+    k = n = 0;
+
+    if( pre_ks != NULL )
+    {
+        s0_p = pre_ks;
+    }
+    else
+    {
+        n = blocks_left > CCM_ECB_BATCH ? CCM_ECB_BATCH : blocks_left;
+        if( ( ret = ccm_ctr_keystream( ctx, ctr, q, ks, n ) ) != 0 )
+            return( ret );
+        blocks_left -= n;
+
+        /* S_0 only has to move out of ks if the batch gets refilled */
+        if( blocks_left > 0 )
+        {
+            memcpy( s0, ks[0], 16 );
+            s0_p = s0;
+        }
+        else
+        {
+            s0_p = ks[0];
+        }
+        k = 1;
+    }
 
     /*
      * Authenticate and {en,de}crypt the message.
@@ -209,51 +359,64 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
      * The only difference between encryption and decryption is
      * the respective order of authentication and {en,de}cryption.
      */
+    in_it.v  = in;  in_it.cnt  = in_cnt;  in_it.off  = 0;
+    out_it.v = out; out_it.cnt = out_cnt; out_it.off = 0;
     len_left = length;
-    src = input;
-    dst = output;
 
     while( len_left > 0 )
     {
         size_t use_len = len_left > 16 ? 16 : len_left;
 
+        if( pre_ks != NULL )
+        {
+            ks_p = pre_ks + 16 * ( 1 + ( length - len_left ) / 16 );
+        }
+        else
+        {
+            if( k == n )
+            {
+                n = blocks_left > CCM_ECB_BATCH ? CCM_ECB_BATCH : blocks_left;
+                if( ( ret = ccm_ctr_keystream( ctx, ctr, q, ks, n ) ) != 0 )
+                    return( ret );
+                blocks_left -= n;
+                k = 0;
+            }
+            ks_p = ks[k++];
+        }
+
+        if( ( src = ccm_iov_span( &in_it, use_len ) ) == NULL )
+        {
+            ccm_iov_copy( &in_it, blk_in, use_len, 1 );
+            src = blk_in;
+        }
+
+        if( ( dst = ccm_iov_span( &out_it, use_len ) ) == NULL )
+            dst = blk_out;
+
         if( mode == CCM_ENCRYPT )
         {
-            memset( b, 0, 16 );
-            memcpy( b, src, use_len );
-            UPDATE_CBC_MAC;
+            UPDATE_CBC_MAC_DATA( src, use_len );
         }
 
-        CTR_CRYPT( dst, src, use_len );
+        for( i = 0; i < use_len; i++ )
+            dst[i] = src[i] ^ ks_p[i];
 
         if( mode == CCM_DECRYPT )
         {
-            memset( b, 0, 16 );
-            memcpy( b, dst, use_len );
-            UPDATE_CBC_MAC;
+            UPDATE_CBC_MAC_DATA( dst, use_len );
         }
 
-        dst += use_len;
-        src += use_len;
-        len_left -= use_len;
+        if( dst == blk_out )
+            ccm_iov_copy( &out_it, blk_out, use_len, 0 );
 
-        /*
-         * Increment counter.
-         * No need to check for overflow thanks to the length check above.
-         */
-        for( i = 0; i < q; i++ )
-            if( ++ctr[15-i] != 0 )
-                break;
+        len_left -= use_len;
     }
 
     /*
-     * Authentication: reset counter and crypt/mask internal tag
+     * Authentication: mask the internal tag with S_0
      */
-    for( i = 0; i < q; i++ )
-        ctr[15-i] = 0;
-
-    CTR_CRYPT( y, y, 16 );
-    memcpy( tag, y, tag_len );
+    for( i = 0; i < tag_len; i++ )
+        tag[i] = y[i] ^ s0_p[i];
 
     return( 0 );
 }
@@ -261,35 +424,120 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
 /*
  * Authenticated encryption
  */
-int aes_ccm_encrypt_and_tag( const unsigned char *key, 
+int mbedtls_ccm_encrypt_and_tag( mbedtls_ccm_context *ctx,
                          const unsigned char *iv, size_t iv_len,
                          const unsigned char *add, size_t add_len,
                          const unsigned char *input, size_t length,
                          unsigned char *output,
                          unsigned char *tag, size_t tag_len )
 {
-    return( ccm_auth_crypt( CCM_ENCRYPT, key, iv, iv_len,
-                            add, add_len, input, length, output, tag, tag_len ) );
+    mbedtls_ccm_iovec in = { (void *) input, length };
+    mbedtls_ccm_iovec out = { output, length };
+
+    return( ccm_auth_crypt( ctx, CCM_ENCRYPT, iv, iv_len, add, add_len,
+                            &in, 1, &out, 1, length, tag, tag_len, NULL ) );
+}
+
+/*
+ * Authenticated encryption of a scattered message
+ */
+int mbedtls_ccm_encrypt_and_tag_iov( mbedtls_ccm_context *ctx,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const mbedtls_ccm_iovec *in, size_t in_cnt,
+                         const mbedtls_ccm_iovec *out, size_t out_cnt,
+                         unsigned char *tag, size_t tag_len )
+{
+    size_t length = ccm_iov_total( in, in_cnt );
+
+    if( ccm_iov_total( out, out_cnt ) != length )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    return( ccm_auth_crypt( ctx, CCM_ENCRYPT, iv, iv_len, add, add_len,
+                            in, in_cnt, out, out_cnt, length, tag, tag_len,
+                            NULL ) );
+}
+
+/*
+ * CTR keystream S_0 .. S_{n-1} of a nonce
+ */
+int mbedtls_ccm_keystream( mbedtls_ccm_context *ctx,
+                           const unsigned char *iv, size_t iv_len,
+                           unsigned char *ks, size_t n )
+{
+    unsigned char q;
+    unsigned char ctr[16];
+
+    if( iv_len < 7 || iv_len > 13 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    q = 16 - 1 - (unsigned char) iv_len;
+
+    ctr[0] = q - 1;
+    memcpy( ctr + 1, iv, iv_len );
+    memset( ctr + 1 + iv_len, 0, q );
+
+    return( ccm_ctr_keystream( ctx, ctr, q, (unsigned char (*)[16]) ks, n ) );
+}
+
+/*
+ * Authenticated encryption with a precomputed keystream
+ */
+int mbedtls_ccm_encrypt_and_tag_ks( mbedtls_ccm_context *ctx,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const unsigned char *input, size_t length,
+                         unsigned char *output,
+                         unsigned char *tag, size_t tag_len,
+                         const unsigned char *ks )
+{
+    mbedtls_ccm_iovec in = { (void *) input, length };
+    mbedtls_ccm_iovec out = { output, length };
+
+    return( ccm_auth_crypt( ctx, CCM_ENCRYPT, iv, iv_len, add, add_len,
+                            &in, 1, &out, 1, length, tag, tag_len, ks ) );
 }
 
 /*
  * Authenticated decryption
  */
-int aes_ccm_auth_decrypt( const unsigned char *key, 
+int mbedtls_ccm_auth_decrypt( mbedtls_ccm_context *ctx,
                       const unsigned char *iv, size_t iv_len,
                       const unsigned char *add, size_t add_len,
                       const unsigned char *input, size_t length,
                       unsigned char *output,
                       const unsigned char *tag, size_t tag_len )
+{
+    mbedtls_ccm_iovec in = { (void *) input, length };
+    mbedtls_ccm_iovec out = { output, length };
+
+    return( mbedtls_ccm_auth_decrypt_iov( ctx, iv, iv_len, add, add_len,
+                                          &in, 1, &out, 1, tag, tag_len ) );
+}
+
+/*
+ * Authenticated decryption of a scattered message
+ */
+int mbedtls_ccm_auth_decrypt_iov( mbedtls_ccm_context *ctx,
+                      const unsigned char *iv, size_t iv_len,
+                      const unsigned char *add, size_t add_len,
+                      const mbedtls_ccm_iovec *in, size_t in_cnt,
+                      const mbedtls_ccm_iovec *out, size_t out_cnt,
+                      const unsigned char *tag, size_t tag_len )
 {
     int ret;
     unsigned char check_tag[16];
     unsigned char i;
     int diff;
+    size_t length = ccm_iov_total( in, in_cnt );
 
-    if( ( ret = ccm_auth_crypt( CCM_DECRYPT, key,
+    if( ccm_iov_total( out, out_cnt ) != length )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    if( ( ret = ccm_auth_crypt( ctx, CCM_DECRYPT,
                                 iv, iv_len, add, add_len,
-                                input, length, output, check_tag, tag_len ) ) != 0 )
+                                in, in_cnt, out, out_cnt, length,
+                                check_tag, tag_len, NULL ) ) != 0 )
     {
         return( ret );
     }
@@ -300,13 +548,242 @@ int aes_ccm_auth_decrypt( const unsigned char *key,
 
     if( diff != 0 )
     {
-        mbedtls_zeroize( output, length );
+        for( ; out_cnt > 0; out_cnt--, out++ )
+            mbedtls_zeroize( out->base, out->len );
         return( MBEDTLS_ERR_CCM_AUTH_FAILED );
     }
 
     return( 0 );
 }
 
+/*
+ * Streaming interface
+ *
+ * Data is XORed into the CBC-MAC state y as it comes, which leaves the zero
+ * padding implicit: y is encrypted whenever a block is complete, and once
+ * more for a trailing partial block at the end of each section.
+ */
+static int ccm_mac_byte( mbedtls_ccm_stream *stream, size_t pos, unsigned char c )
+{
+    stream->y[pos & 0x0F] ^= c;
+
+    if( ( pos & 0x0F ) == 0x0F )
+        return( aes128_encrypt( &stream->ctx->aes, stream->y, stream->y ) );
+
+    return( 0 );
+}
+
+static int ccm_mac_pad( mbedtls_ccm_stream *stream, size_t pos )
+{
+    if( ( pos & 0x0F ) != 0 )
+        return( aes128_encrypt( &stream->ctx->aes, stream->y, stream->y ) );
+
+    return( 0 );
+}
+
+int mbedtls_ccm_starts( mbedtls_ccm_stream *stream, mbedtls_ccm_context *ctx,
+                        int mode, const unsigned char *iv, size_t iv_len,
+                        size_t add_len, size_t length, size_t tag_len )
+{
+    unsigned char i;
+    unsigned char q;
+    size_t len_left;
+
+    if( tag_len < 4 || tag_len > 16 || tag_len % 2 != 0 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    if( iv_len < 7 || iv_len > 13 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    if( add_len > 0xFF00 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    q = 16 - 1 - (unsigned char) iv_len;
+
+    stream->ctx      = ctx;
+    stream->mode     = (unsigned char) mode;
+    stream->q        = q;
+    stream->tag_len  = (unsigned char) tag_len;
+    stream->add_len  = add_len;
+    stream->add_done = 0;
+    stream->length   = length;
+    stream->done     = 0;
+
+    /* B_0, see ccm_auth_crypt() */
+    stream->y[0] = 0;
+    stream->y[0] |= ( add_len > 0 ) << 6;
+    stream->y[0] |= ( ( tag_len - 2 ) / 2 ) << 3;
+    stream->y[0] |= q - 1;
+
+    memcpy( stream->y + 1, iv, iv_len );
+
+    for( i = 0, len_left = length; i < q; i++, len_left >>= 8 )
+        stream->y[15-i] = (unsigned char)( len_left & 0xFF );
+
+    if( len_left > 0 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    /* A_1 */
+    stream->ctr[0] = q - 1;
+    memcpy( stream->ctr + 1, iv, iv_len );
+    memset( stream->ctr + 1 + iv_len, 0, q );
+    stream->ctr[15] = 1;
+
+    if( aes128_encrypt( &ctx->aes, stream->y, stream->y ) != 0 )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    /* The 2-byte length prefix of the additional data */
+    if( add_len > 0 )
+    {
+        stream->y[0] ^= (unsigned char)( ( add_len >> 8 ) & 0xFF );
+        stream->y[1] ^= (unsigned char)( ( add_len      ) & 0xFF );
+    }
+
+    return( 0 );
+}
+
+int mbedtls_ccm_update_ad( mbedtls_ccm_stream *stream,
+                           const unsigned char *add, size_t add_len )
+{
+    int ret;
+    size_t i;
+
+    if( add_len > stream->add_len - stream->add_done )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    for( i = 0; i < add_len; i++ )
+    {
+        if( ( ret = ccm_mac_byte( stream, 2 + stream->add_done++, add[i] ) ) != 0 )
+            return( ret );
+    }
+
+    if( add_len > 0 && stream->add_done == stream->add_len )
+        return( ccm_mac_pad( stream, 2 + stream->add_done ) );
+
+    return( 0 );
+}
+
+int mbedtls_ccm_update( mbedtls_ccm_stream *stream,
+                        const unsigned char *input, size_t len,
+                        unsigned char *output )
+{
+    int ret;
+    size_t i;
+    unsigned char j, c;
+
+    if( stream->add_done != stream->add_len ||
+        len > stream->length - stream->done )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    for( i = 0; i < len; i++ )
+    {
+        size_t pos = stream->done++;
+
+        if( ( pos & 0x0F ) == 0 )
+        {
+            if( ( ret = aes128_encrypt( &stream->ctx->aes, stream->ctr, stream->s ) ) != 0 )
+                return( ret );
+
+            for( j = 0; j < stream->q; j++ )
+                if( ++stream->ctr[15-j] != 0 )
+                    break;
+        }
+
+        c = input[i];
+        output[i] = c ^ stream->s[pos & 0x0F];
+
+        if( stream->mode == CCM_DECRYPT )
+            c = output[i];
+
+        if( ( ret = ccm_mac_byte( stream, pos, c ) ) != 0 )
+            return( ret );
+    }
+
+    return( 0 );
+}
+
+int mbedtls_ccm_finish( mbedtls_ccm_stream *stream, unsigned char *tag )
+{
+    int ret;
+    unsigned char i;
+    int diff;
+
+    if( stream->add_done != stream->add_len || stream->done != stream->length )
+        return( MBEDTLS_ERR_CCM_BAD_INPUT );
+
+    if( ( ret = ccm_mac_pad( stream, stream->done ) ) != 0 )
+        return( ret );
+
+    /* A_0 */
+    for( i = 0; i < stream->q; i++ )
+        stream->ctr[15-i] = 0;
+
+    if( ( ret = aes128_encrypt( &stream->ctx->aes, stream->ctr, stream->s ) ) != 0 )
+        return( ret );
+
+    if( stream->mode == CCM_ENCRYPT )
+    {
+        for( i = 0; i < stream->tag_len; i++ )
+            tag[i] = stream->y[i] ^ stream->s[i];
+
+        ret = 0;
+    }
+    else
+    {
+        /* Check tag in "constant-time" */
+        for( diff = 0, i = 0; i < stream->tag_len; i++ )
+            diff |= tag[i] ^ stream->y[i] ^ stream->s[i];
+
+        ret = diff != 0 ? MBEDTLS_ERR_CCM_AUTH_FAILED : 0;
+    }
+
+    mbedtls_zeroize( stream->y, sizeof( stream->y ) );
+    mbedtls_zeroize( stream->s, sizeof( stream->s ) );
+
+    return( ret );
+}
+
+/*
+ * One-shot helpers, the key is scheduled for this call only
+ */
+int aes_ccm_encrypt_and_tag( const unsigned char *key, 
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const unsigned char *input, size_t length,
+                         unsigned char *output,
+                         unsigned char *tag, size_t tag_len )
+{
+    int ret;
+    mbedtls_ccm_context ctx;
+
+    mbedtls_ccm_init( &ctx );
+    if( ( ret = mbedtls_ccm_setkey( &ctx, key ) ) == 0 )
+        ret = mbedtls_ccm_encrypt_and_tag( &ctx, iv, iv_len, add, add_len,
+                                           input, length, output, tag, tag_len );
+    mbedtls_ccm_free( &ctx );
+
+    return( ret );
+}
+
+int aes_ccm_auth_decrypt( const unsigned char *key, 
+                      const unsigned char *iv, size_t iv_len,
+                      const unsigned char *add, size_t add_len,
+                      const unsigned char *input, size_t length,
+                      unsigned char *output,
+                      const unsigned char *tag, size_t tag_len )
+{
+    int ret;
+    mbedtls_ccm_context ctx;
+
+    mbedtls_ccm_init( &ctx );
+    if( ( ret = mbedtls_ccm_setkey( &ctx, key ) ) == 0 )
+        ret = mbedtls_ccm_auth_decrypt( &ctx, iv, iv_len, add, add_len,
+                                        input, length, output, tag, tag_len );
+    mbedtls_ccm_free( &ctx );
+
+    return( ret );
+}
+
 #ifdef M_TEST
 static uint8_t k[16] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
 			0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
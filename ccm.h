@@ -23,13 +23,203 @@
 #ifndef MBEDTLS_CCM_H
 #define MBEDTLS_CCM_H
 
+#include <stddef.h>
+#include "aes128.h"
+
 #define MBEDTLS_ERR_CCM_BAD_INPUT      -0x000D /**< Bad input parameters to function. */
 #define MBEDTLS_ERR_CCM_AUTH_FAILED    -0x000F /**< Authenticated decryption failed. */
 
+#define MBEDTLS_CCM_ENCRYPT 0
+#define MBEDTLS_CCM_DECRYPT 1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * \brief          CCM context structure
+ */
+typedef struct {
+    aes128_ctx_t aes;           /*!< scheduled AES-128 key  */
+}
+mbedtls_ccm_context;
+
+/**
+ * \brief          One segment of a scattered buffer (as struct iovec)
+ */
+typedef struct {
+    void *base;                 /*!< start of the segment               */
+    size_t len;                 /*!< length of the segment in bytes     */
+}
+mbedtls_ccm_iovec;
+
+/**
+ * \brief          CCM streaming operation
+ *
+ *                 State of one message processed piece by piece. It refers to
+ *                 a keyed mbedtls_ccm_context, which must outlive it.
+ */
+typedef struct {
+    mbedtls_ccm_context *ctx;   /*!< keyed CCM context                  */
+    unsigned char y[16];        /*!< CBC-MAC state                      */
+    unsigned char ctr[16];      /*!< counter block of the next keystream */
+    unsigned char s[16];        /*!< current keystream block            */
+    size_t add_len;             /*!< total additional data length       */
+    size_t add_done;            /*!< additional data processed so far   */
+    size_t length;              /*!< total payload length               */
+    size_t done;                /*!< payload processed so far           */
+    unsigned char q;            /*!< length of the length field         */
+    unsigned char tag_len;      /*!< tag length                         */
+    unsigned char mode;         /*!< MBEDTLS_CCM_ENCRYPT or _DECRYPT     */
+}
+mbedtls_ccm_stream;
+
+/**
+ * \brief           Initialize CCM context (just makes references valid)
+ *                  Makes the context ready for mbedtls_ccm_setkey() or
+ *                  mbedtls_ccm_free().
+ *
+ * \param ctx       CCM context to initialize
+ */
+void mbedtls_ccm_init( mbedtls_ccm_context *ctx );
+
+/**
+ * \brief           CCM initialization (encryption and decryption)
+ *
+ * \param ctx       CCM context to be initialized
+ * \param key       encryption key, must be 16 bytes
+ *
+ * \return          0 if successful, or a cipher specific error code
+ */
+int mbedtls_ccm_setkey( mbedtls_ccm_context *ctx, const unsigned char *key );
+
+/**
+ * \brief           Free a CCM context and underlying cipher sub-context
+ *
+ * \param ctx       CCM context to free
+ */
+void mbedtls_ccm_free( mbedtls_ccm_context *ctx );
+
+/**
+ * \brief           CCM buffer encryption with a cached key schedule
+ *
+ * \param ctx       CCM context set up by mbedtls_ccm_setkey()
+ *
+ * \note            The other parameters are those of aes_ccm_encrypt_and_tag().
+ *
+ * \return          0 if successful
+ */
+int mbedtls_ccm_encrypt_and_tag( mbedtls_ccm_context *ctx,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const unsigned char *input, size_t length,
+                         unsigned char *output,
+                         unsigned char *tag, size_t tag_len );
+
+/**
+ * \brief           CTR keystream of a nonce
+ *
+ *                  Computes S_0 .. S_{n-1}, the blocks a message under this
+ *                  nonce is encrypted with, ahead of time.
+ *
+ * \param ctx       CCM context set up by mbedtls_ccm_setkey()
+ * \param iv        nonce (initialization vector)
+ * \param iv_len    length of IV in bytes, 7 to 13
+ * \param ks        buffer for n keystream blocks, 16 * n bytes
+ * \param n         number of blocks, 1 + ceil(length / 16) covers a message
+ *                  of length bytes
+ *
+ * \return          0 if successful
+ */
+int mbedtls_ccm_keystream( mbedtls_ccm_context *ctx,
+                           const unsigned char *iv, size_t iv_len,
+                           unsigned char *ks, size_t n );
+
+/**
+ * \brief           CCM buffer encryption with a precomputed keystream
+ *
+ * \param ks        S_0 .. S_m from mbedtls_ccm_keystream() for this iv,
+ *                  m = ceil(length / 16)
+ *
+ * \note            Only the CBC-MAC is computed, the encryption is a XOR.
+ *                  A keystream must never be used for two messages.
+ *
+ * \note            The other parameters are those of
+ *                  mbedtls_ccm_encrypt_and_tag().
+ *
+ * \return          0 if successful
+ */
+int mbedtls_ccm_encrypt_and_tag_ks( mbedtls_ccm_context *ctx,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const unsigned char *input, size_t length,
+                         unsigned char *output,
+                         unsigned char *tag, size_t tag_len,
+                         const unsigned char *ks );
+
+/**
+ * \brief           CCM buffer authenticated decryption with a cached key
+ *                  schedule
+ *
+ * \param ctx       CCM context set up by mbedtls_ccm_setkey()
+ *
+ * \note            The other parameters are those of aes_ccm_auth_decrypt().
+ *
+ * \return         0 if successful and authenticated,
+ *                 MBEDTLS_ERR_CCM_AUTH_FAILED if tag does not match
+ */
+int mbedtls_ccm_auth_decrypt( mbedtls_ccm_context *ctx,
+                      const unsigned char *iv, size_t iv_len,
+                      const unsigned char *add, size_t add_len,
+                      const unsigned char *input, size_t length,
+                      unsigned char *output,
+                      const unsigned char *tag, size_t tag_len );
+
+/**
+ * \brief           CCM encryption of a scattered message
+ *
+ *                  The payload is read from the in segments and written to
+ *                  the out segments, e.g. a header and a payload straight
+ *                  into a notification or advertising buffer, without
+ *                  staging them in one contiguous copy first.
+ *
+ * \param ctx       CCM context set up by mbedtls_ccm_setkey()
+ * \param in        input segments, in_cnt of them
+ * \param out       output segments, out_cnt of them; both lists must add
+ *                  up to the same length. A segment may be encrypted in
+ *                  place, other overlaps of input and output are not
+ *                  allowed.
+ * \param tag       buffer for the tag, may point into the final frame
+ *
+ * \note            The other parameters are those of
+ *                  aes_ccm_encrypt_and_tag().
+ *
+ * \return          0 if successful
+ */
+int mbedtls_ccm_encrypt_and_tag_iov( mbedtls_ccm_context *ctx,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const mbedtls_ccm_iovec *in, size_t in_cnt,
+                         const mbedtls_ccm_iovec *out, size_t out_cnt,
+                         unsigned char *tag, size_t tag_len );
+
+/**
+ * \brief           CCM authenticated decryption of a scattered message
+ *
+ * \note            The parameters are those of
+ *                  mbedtls_ccm_encrypt_and_tag_iov(). On a tag mismatch
+ *                  all output segments are cleared.
+ *
+ * \return         0 if successful and authenticated,
+ *                 MBEDTLS_ERR_CCM_AUTH_FAILED if tag does not match
+ */
+int mbedtls_ccm_auth_decrypt_iov( mbedtls_ccm_context *ctx,
+                      const unsigned char *iv, size_t iv_len,
+                      const unsigned char *add, size_t add_len,
+                      const mbedtls_ccm_iovec *in, size_t in_cnt,
+                      const mbedtls_ccm_iovec *out, size_t out_cnt,
+                      const unsigned char *tag, size_t tag_len );
+
 /**
  * \brief           CCM buffer encryption
  *
@@ -48,6 +238,9 @@ extern "C" {
  * \param tag_len   length of the tag to generate in bytes
  *                  must be 4, 6, 8, 10, 14 or 16
  *
+ * \note            One-shot helper: the key is scheduled on every call. Use
+ *                  mbedtls_ccm_encrypt_and_tag() when the key is reused.
+ *
  * \note            The tag is written to a separate buffer. To get the tag
  *                  concatenated with the output as in the CCM spec, use
  *                  tag = output + length and make sure the output buffer is
@@ -86,6 +279,73 @@ int aes_ccm_auth_decrypt( const unsigned char *key,
                       unsigned char *output,
                       const unsigned char *tag, size_t tag_len );
 
+/**
+ * \brief           Start a streaming CCM operation
+ *
+ * \param stream    streaming operation to set up
+ * \param ctx       CCM context set up by mbedtls_ccm_setkey()
+ * \param mode      MBEDTLS_CCM_ENCRYPT or MBEDTLS_CCM_DECRYPT
+ * \param iv        nonce (initialization vector), 7 to 13 bytes
+ * \param iv_len    length of IV in bytes
+ * \param add_len   total length of additional data in bytes
+ * \param length    total length of the payload in bytes
+ * \param tag_len   length of the tag in bytes, 4, 6, 8, 10, 14 or 16
+ *
+ * \note            CCM authenticates the lengths first, so they have to be
+ *                  known before any data is passed in.
+ *
+ * \return          0 if successful, MBEDTLS_ERR_CCM_BAD_INPUT otherwise
+ */
+int mbedtls_ccm_starts( mbedtls_ccm_stream *stream, mbedtls_ccm_context *ctx,
+                        int mode, const unsigned char *iv, size_t iv_len,
+                        size_t add_len, size_t length, size_t tag_len );
+
+/**
+ * \brief           Feed additional data to a streaming CCM operation
+ *
+ * \param stream    streaming operation
+ * \param add       additional data
+ * \param add_len   length of this piece, may be any size
+ *
+ * \note            All additional data must be fed before the payload.
+ *
+ * \return          0 if successful, MBEDTLS_ERR_CCM_BAD_INPUT if more data
+ *                  than announced is fed
+ */
+int mbedtls_ccm_update_ad( mbedtls_ccm_stream *stream,
+                           const unsigned char *add, size_t add_len );
+
+/**
+ * \brief           Encrypt or decrypt a piece of the payload
+ *
+ * \param stream    streaming operation
+ * \param input     buffer holding this piece of the payload
+ * \param len       length of this piece, may be any size
+ * \param output    buffer for the processed piece, may be equal to input
+ *
+ * \note            In decrypt mode the output is not authenticated until
+ *                  mbedtls_ccm_finish() returns 0.
+ *
+ * \return          0 if successful, MBEDTLS_ERR_CCM_BAD_INPUT if more data
+ *                  than announced is fed
+ */
+int mbedtls_ccm_update( mbedtls_ccm_stream *stream,
+                        const unsigned char *input, size_t len,
+                        unsigned char *output );
+
+/**
+ * \brief           Finish a streaming CCM operation
+ *
+ * \param stream    streaming operation
+ * \param tag       encrypt: buffer for the generated tag
+ *                  decrypt: tag to check
+ *
+ * \return          0 if successful (and authenticated),
+ *                  MBEDTLS_ERR_CCM_AUTH_FAILED if the tag does not match,
+ *                  MBEDTLS_ERR_CCM_BAD_INPUT if not all data was fed
+ */
+int mbedtls_ccm_finish( mbedtls_ccm_stream *stream, unsigned char *tag );
+
 #ifdef __cplusplus
 }
 #endif
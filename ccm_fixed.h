@@ -0,0 +1,242 @@
+/**
+ * \file ccm_fixed.h
+ *
+ * \brief CCM specialized for fixed message shapes
+ *
+ *  The generic mbedtls_ccm_encrypt_and_tag() works out the flags, the length
+ *  field and the additional data blocks of every message at run time. The
+ *  protocol only uses a few message shapes, so each one gets its own pair of
+ *  functions with the nonce length, additional data length, message length
+ *  and tag length fixed at compile time:
+ *
+ *      CCM_FIXED_DEFINE( lock_stat, 12, 0, 1, 4 )
+ *
+ *  defines lock_stat_template(), lock_stat_encrypt() and
+ *  lock_stat_auth_decrypt(). The B_0 and A_0 blocks are kept in a
+ *  mbedtls_ccm_fixed template. Build it once per key and nonce prefix, then
+ *  only patch the nonce bytes that change (usually a counter) with
+ *  mbedtls_ccm_fixed_nonce() before each message.
+ *
+ *  The output is the same as with the generic functions.
+ */
+#ifndef MBEDTLS_CCM_FIXED_H
+#define MBEDTLS_CCM_FIXED_H
+
+#include <string.h>
+#include "ccm.h"
+
+/* The shape constants only fold away if the core is inlined, even at -O0 */
+#if defined(__CC_ARM)
+#define CCM_FIXED_INLINE    static __forceinline
+#elif defined(__GNUC__)
+#define CCM_FIXED_INLINE    static inline __attribute__((always_inline))
+#else
+#define CCM_FIXED_INLINE    static inline
+#endif
+
+/* Number of CTR blocks (A_0 .. A_m) of a len byte message */
+#define CCM_FIXED_BLOCKS( len )     ( 1 + ( (len) + 15 ) / 16 )
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          B_0 and A_0 of one message shape and nonce
+ */
+typedef struct {
+    unsigned char b0[16];       /*!< flags, nonce, message length       */
+    unsigned char a0[16];       /*!< flags, nonce, counter 0            */
+}
+mbedtls_ccm_fixed;
+
+/**
+ * \brief           Patch part of the nonce in a template
+ *
+ * \param t         template set up by a <name>_template() function
+ * \param off       offset of the bytes within the nonce
+ * \param p         new nonce bytes
+ * \param len       number of bytes
+ */
+CCM_FIXED_INLINE void mbedtls_ccm_fixed_nonce( mbedtls_ccm_fixed *t, size_t off,
+                                               const void *p, size_t len )
+{
+    memcpy( t->b0 + 1 + off, p, len );
+    memcpy( t->a0 + 1 + off, p, len );
+}
+
+CCM_FIXED_INLINE void ccm_fixed_template( mbedtls_ccm_fixed *t,
+                                          const unsigned char *iv, size_t iv_len,
+                                          size_t add_len, size_t length, size_t tag_len )
+{
+    unsigned char q = 16 - 1 - (unsigned char) iv_len;
+
+    /* See ccm_auth_crypt() in ccm.c for the layout */
+    memset( t, 0, sizeof( *t ) );
+
+    t->b0[0]  = ( add_len > 0 ) << 6;
+    t->b0[0] |= ( ( tag_len - 2 ) / 2 ) << 3;
+    t->b0[0] |= q - 1;
+    t->b0[14] = (unsigned char)( length >> 8 );
+    t->b0[15] = (unsigned char)( length      );
+
+    t->a0[0]  = q - 1;
+
+    mbedtls_ccm_fixed_nonce( t, 0, iv, iv_len );
+}
+
+/*
+ * All the CTR blocks go to the AES backend in one batch first. The CBC-MAC
+ * chain then runs over the message in place: the plaintext is input for
+ * encryption and output for decryption, so input may equal output.
+ */
+CCM_FIXED_INLINE int ccm_fixed_crypt( mbedtls_ccm_context *ctx,
+                                      const mbedtls_ccm_fixed *t, int mode,
+                                      const unsigned char *add, size_t add_len,
+                                      const unsigned char *input, size_t length,
+                                      unsigned char *output,
+                                      unsigned char *tag, size_t tag_len,
+                                      unsigned char ks[][16] )
+{
+    int ret;
+    size_t i, k, use_len;
+    unsigned char y[16];
+
+    for( k = 0; k < CCM_FIXED_BLOCKS( length ); k++ )
+    {
+        memcpy( ks[k], t->a0, 16 );
+        ks[k][15] = (unsigned char) k;
+    }
+
+    if( ( ret = aes128_encrypt_blocks( &ctx->aes, ks[0], ks[0],
+                                       CCM_FIXED_BLOCKS( length ) ) ) != 0 )
+        return( ret );
+
+    if( ( ret = aes128_encrypt( &ctx->aes, t->b0, y ) ) != 0 )
+        return( ret );
+
+    if( add_len > 0 )
+    {
+        y[0] ^= (unsigned char)( add_len >> 8 );
+        y[1] ^= (unsigned char)( add_len      );
+        for( i = 0; i < add_len; i++ )
+            y[2 + i] ^= add[i];
+
+        if( ( ret = aes128_encrypt( &ctx->aes, y, y ) ) != 0 )
+            return( ret );
+    }
+
+    for( k = 1; length > 0; k++, input += use_len, output += use_len, length -= use_len )
+    {
+        use_len = length > 16 ? 16 : length;
+
+        for( i = 0; i < use_len; i++ )
+        {
+            unsigned char c = input[i];
+
+            output[i] = c ^ ks[k][i];
+            y[i] ^= mode == MBEDTLS_CCM_ENCRYPT ? c : output[i];
+        }
+
+        if( ( ret = aes128_encrypt( &ctx->aes, y, y ) ) != 0 )
+            return( ret );
+    }
+
+    for( i = 0; i < tag_len; i++ )
+        tag[i] = y[i] ^ ks[0][i];
+
+    return( 0 );
+}
+
+CCM_FIXED_INLINE int ccm_fixed_check( unsigned char *output, size_t length,
+                                      const unsigned char *tag,
+                                      const unsigned char *check_tag, size_t tag_len )
+{
+    volatile unsigned char *p = output;
+    unsigned char diff;
+    size_t i;
+
+    /* Check tag in "constant-time" */
+    for( diff = 0, i = 0; i < tag_len; i++ )
+        diff |= tag[i] ^ check_tag[i];
+
+    if( diff == 0 )
+        return( 0 );
+
+    while( length-- )
+        *p++ = 0;
+
+    return( MBEDTLS_ERR_CCM_AUTH_FAILED );
+}
+
+/**
+ * \brief           Define the functions of one message shape
+ *
+ *                  The additional data must fit in the first block, and the
+ *                  message must be at most 4080 bytes. A shape that breaks
+ *                  these rules fails to compile.
+ *
+ * \param name      prefix of the generated functions
+ * \param IV_LEN    nonce length, 7 .. 13
+ * \param ADD_LEN   additional data length, 0 .. 14
+ * \param LEN       message length in bytes
+ * \param TAG_LEN   tag length, 4 .. 16, even
+ *
+ * Defines:
+ *  void name##_template( mbedtls_ccm_fixed *t, const void *iv )
+ *  int  name##_encrypt( ctx, t, add, input, output, tag )
+ *  int  name##_auth_decrypt( ctx, t, add, input, output, tag )
+ *
+ * Both return 0 or an AES backend error, the decryption also
+ * MBEDTLS_ERR_CCM_AUTH_FAILED (and a zeroed output).
+ */
+#define CCM_FIXED_DEFINE( name, IV_LEN, ADD_LEN, LEN, TAG_LEN )                 \
+                                                                                \
+typedef char name##_shape_check[ ( (IV_LEN) >= 7 && (IV_LEN) <= 13 &&           \
+                                   (ADD_LEN) <= 14 && (LEN) <= 0xFF0 &&         \
+                                   (TAG_LEN) >= 4 && (TAG_LEN) <= 16 &&         \
+                                   (TAG_LEN) % 2 == 0 ) ? 1 : -1 ];             \
+                                                                                \
+CCM_FIXED_INLINE void name##_template( mbedtls_ccm_fixed *t, const void *iv )   \
+{                                                                               \
+    ccm_fixed_template( t, (const unsigned char *) iv, IV_LEN,                  \
+                        ADD_LEN, LEN, TAG_LEN );                                \
+}                                                                               \
+                                                                                \
+CCM_FIXED_INLINE int name##_encrypt( mbedtls_ccm_context *ctx,                  \
+                                     const mbedtls_ccm_fixed *t,                \
+                                     const unsigned char *add,                  \
+                                     const unsigned char *input,                \
+                                     unsigned char *output,                     \
+                                     unsigned char *tag )                       \
+{                                                                               \
+    unsigned char ks[CCM_FIXED_BLOCKS( LEN )][16];                              \
+                                                                                \
+    return( ccm_fixed_crypt( ctx, t, MBEDTLS_CCM_ENCRYPT, add, ADD_LEN,         \
+                             input, LEN, output, tag, TAG_LEN, ks ) );          \
+}                                                                               \
+                                                                                \
+CCM_FIXED_INLINE int name##_auth_decrypt( mbedtls_ccm_context *ctx,             \
+                                          const mbedtls_ccm_fixed *t,           \
+                                          const unsigned char *add,             \
+                                          const unsigned char *input,           \
+                                          unsigned char *output,                \
+                                          const unsigned char *tag )            \
+{                                                                               \
+    int ret;                                                                    \
+    unsigned char ks[CCM_FIXED_BLOCKS( LEN )][16];                              \
+    unsigned char check_tag[TAG_LEN];                                           \
+                                                                                \
+    if( ( ret = ccm_fixed_crypt( ctx, t, MBEDTLS_CCM_DECRYPT, add, ADD_LEN,     \
+                                 input, LEN, output,                            \
+                                 check_tag, TAG_LEN, ks ) ) != 0 )              \
+        return( ret );                                                          \
+                                                                                \
+    return( ccm_fixed_check( output, LEN, tag, check_tag, TAG_LEN ) );          \
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBEDTLS_CCM_FIXED_H */
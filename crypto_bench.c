@@ -0,0 +1,446 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "aes128.h"
+#include "ccm.h"
+#include "ccm_fixed.h"
+#include "sha256_hkdf.h"
+#include "mi_crypto_engine.h"
+#include "crypto_bench.h"
+
+/*
+ * Time base
+ *
+ * nRF52    DWT cycle counter, exact cycles at 64 MHz
+ * nRF51    RTC1 (the app_timer RTC) at 32768 Hz / (prescaler + 1); Cortex-M0
+ *          has no cycle counter, cycles are derived from the 16 MHz core clock
+ * host     CLOCK_MONOTONIC in ns, no cycles
+ */
+#if defined(NRF52)
+#include "nrf.h"
+
+#define BENCH_TICK_HZ       64000000UL
+#define BENCH_CPU_HZ        64000000UL
+#define BENCH_REPEAT        1
+
+static void bench_timer_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL  |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t bench_ticks(void)
+{
+	return DWT->CYCCNT;
+}
+
+static uint32_t bench_elapsed(uint32_t t0)
+{
+	return DWT->CYCCNT - t0;
+}
+
+#elif defined(NRF51)
+#include "nrf.h"
+
+#define BENCH_TICK_HZ       (32768UL / (NRF_RTC1->PRESCALER + 1))
+#define BENCH_CPU_HZ        16000000UL
+#define BENCH_REPEAT        1
+
+static void bench_timer_init(void)
+{
+}
+
+static uint32_t bench_ticks(void)
+{
+	return NRF_RTC1->COUNTER;
+}
+
+static uint32_t bench_elapsed(uint32_t t0)
+{
+	return (NRF_RTC1->COUNTER - t0) & 0x00FFFFFF;
+}
+
+#else
+#include <time.h>
+
+#define BENCH_TICK_HZ       1000000000UL
+#define BENCH_CPU_HZ        0
+#define BENCH_REPEAT        7
+
+static void bench_timer_init(void)
+{
+}
+
+static uint32_t bench_ticks(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint32_t bench_elapsed(uint32_t t0)
+{
+	return bench_ticks() - t0;
+}
+#endif
+
+/* Operations per timed run; enough RTC ticks on nRF51 even for ECB. */
+#ifndef CRYPTO_BENCH_ITERS
+#if (BENCH_CPU_HZ == 0)
+#define CRYPTO_BENCH_ITERS  5000
+#else
+#define CRYPTO_BENCH_ITERS  100
+#endif
+#endif
+
+#define BENCH_BUF_SIZE      512
+
+static const uint8_t bench_key[16] = {
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+};
+static const uint8_t bench_salt[] = "smartcfg-login-salt";
+static const uint8_t bench_info[] = "smartcfg-login-info";
+
+static uint8_t  bench_nonce[12];
+static uint8_t  bench_in[BENCH_BUF_SIZE];
+static uint8_t  bench_out[BENCH_BUF_SIZE];
+static uint8_t  bench_mic[4];
+static mbedtls_ccm_context bench_ccm;
+static aes128_ctx_t bench_aes;
+static int      bench_err;          /* an operation of the run failed */
+
+static void bench_ecb(size_t len)
+{
+	aes128_encrypt_blocks(&bench_aes, bench_in, bench_out, len / 16);
+}
+
+static void bench_ccm_enc(size_t len)
+{
+	mbedtls_ccm_encrypt_and_tag(&bench_ccm, bench_nonce, sizeof(bench_nonce), NULL, 0,
+	                            bench_in, len, bench_out, bench_mic, sizeof(bench_mic));
+}
+
+/* Decrypts what bench_ccm_enc_prep() left in bench_out back into bench_in. */
+static void bench_ccm_dec(size_t len)
+{
+	bench_err |= mbedtls_ccm_auth_decrypt(&bench_ccm, bench_nonce, sizeof(bench_nonce), NULL, 0,
+	                                      bench_out, len, bench_in, bench_mic, sizeof(bench_mic));
+}
+
+static void bench_ccm_enc_prep(size_t len)
+{
+	bench_ccm_enc(len);
+}
+
+/* The beacon shape: one byte of additional data */
+static void bench_ccm_aad(size_t len)
+{
+	uint8_t aad = 0x11;
+
+	mbedtls_ccm_encrypt_and_tag(&bench_ccm, bench_nonce, sizeof(bench_nonce), &aad, 1,
+	                            bench_in, len, bench_out, bench_mic, sizeof(bench_mic));
+}
+
+/* The same shapes through ccm_fixed.h, one template per shape as the callers keep them */
+CCM_FIXED_DEFINE(bench_fix1,  12, 0,  1, 4)
+CCM_FIXED_DEFINE(bench_fix4,  12, 0,  4, 4)
+CCM_FIXED_DEFINE(bench_fix10, 12, 0, 10, 4)
+CCM_FIXED_DEFINE(bench_fix64, 12, 0, 64, 4)
+CCM_FIXED_DEFINE(bench_fix13, 12, 1, 13, 4)
+
+static mbedtls_ccm_fixed bench_tmpl[5];
+
+static void bench_fix_enc(size_t len)
+{
+	uint8_t aad = 0x11;
+
+	switch (len) {
+	case 1:
+		mbedtls_ccm_fixed_nonce(&bench_tmpl[0], 8, bench_nonce + 8, 4);
+		bench_fix1_encrypt(&bench_ccm, &bench_tmpl[0], NULL, bench_in, bench_out, bench_mic);
+		break;
+	case 4:
+		mbedtls_ccm_fixed_nonce(&bench_tmpl[1], 8, bench_nonce + 8, 4);
+		bench_fix4_encrypt(&bench_ccm, &bench_tmpl[1], NULL, bench_in, bench_out, bench_mic);
+		break;
+	case 10:
+		mbedtls_ccm_fixed_nonce(&bench_tmpl[2], 8, bench_nonce + 8, 4);
+		bench_fix10_encrypt(&bench_ccm, &bench_tmpl[2], NULL, bench_in, bench_out, bench_mic);
+		break;
+	case 64:
+		mbedtls_ccm_fixed_nonce(&bench_tmpl[3], 8, bench_nonce + 8, 4);
+		bench_fix64_encrypt(&bench_ccm, &bench_tmpl[3], NULL, bench_in, bench_out, bench_mic);
+		break;
+	case 13:
+		mbedtls_ccm_fixed_nonce(&bench_tmpl[4], 8, bench_nonce + 8, 4);
+		bench_fix13_encrypt(&bench_ccm, &bench_tmpl[4], &aad, bench_in, bench_out, bench_mic);
+		break;
+	}
+}
+
+/* Decrypts what bench_ccm_enc_prep() left in bench_out back into bench_in. */
+static void bench_fix_dec(size_t len)
+{
+	switch (len) {
+	case 1:
+		bench_err |= bench_fix1_auth_decrypt(&bench_ccm, &bench_tmpl[0], NULL, bench_out, bench_in, bench_mic);
+		break;
+	case 4:
+		bench_err |= bench_fix4_auth_decrypt(&bench_ccm, &bench_tmpl[1], NULL, bench_out, bench_in, bench_mic);
+		break;
+	case 10:
+		bench_err |= bench_fix10_auth_decrypt(&bench_ccm, &bench_tmpl[2], NULL, bench_out, bench_in, bench_mic);
+		break;
+	case 64:
+		bench_err |= bench_fix64_auth_decrypt(&bench_ccm, &bench_tmpl[3], NULL, bench_out, bench_in, bench_mic);
+		break;
+	}
+}
+
+static void bench_sha256(size_t len)
+{
+	mbedtls_sha256(bench_in, len, bench_out, 0);
+}
+
+static void bench_hmac(size_t len)
+{
+	mbedtls_md_hmac(bench_key, sizeof(bench_key), bench_in, len, bench_out);
+}
+
+/* The MAC of one record under a context keyed once, e.g. a stored lock log. */
+static sha256_hmac_context bench_hmac_ctx;
+
+static void bench_hmac_keyed_prep(size_t len)
+{
+	(void)len;
+	sha256_hmac_init(&bench_hmac_ctx, bench_key, sizeof(bench_key));
+}
+
+static void bench_hmac_keyed(size_t len)
+{
+	sha256_hmac_reset(&bench_hmac_ctx);
+	sha256_hmac_update(&bench_hmac_ctx, bench_in, len);
+	sha256_hmac_finish(&bench_hmac_ctx, bench_out);
+}
+
+/* HKDF as in the login: 32 bytes of ECDH secret in, len bytes of keys out. */
+static void bench_hkdf(size_t len)
+{
+	sha256_hkdf(bench_in,            32,
+	            (void *)bench_salt,  sizeof(bench_salt) - 1,
+	            (void *)bench_info,  sizeof(bench_info) - 1,
+	            bench_out,           len);
+}
+
+/* The same HKDF as a mi_crypto_engine job: submit, then wait for completion. */
+static mi_crypto_job_t bench_job;
+
+static void bench_hkdf_job(size_t len)
+{
+	bench_job.type                = MI_CRYPTO_JOB_HKDF;
+	bench_job.param.hkdf.ikm      = bench_in;
+	bench_job.param.hkdf.ikm_len  = 32;
+	bench_job.param.hkdf.salt     = bench_salt;
+	bench_job.param.hkdf.salt_len = sizeof(bench_salt) - 1;
+	bench_job.param.hkdf.info     = bench_info;
+	bench_job.param.hkdf.info_len = sizeof(bench_info) - 1;
+	bench_job.param.hkdf.out      = bench_out;
+	bench_job.param.hkdf.out_len  = len;
+
+	mi_crypto_job_submit(&bench_job);
+	mi_crypto_job_wait(&bench_job);
+}
+
+/*
+ * The same HKDF as a key schedule, up to the first len bytes: 16 is the wait
+ * for the first key of a handshake, 64 a whole session_ctx_t.
+ */
+static mi_keysched_t bench_ks;
+
+static void bench_keysched(size_t len)
+{
+	mi_keysched_start(&bench_ks, bench_in, 32,
+	                  bench_salt, sizeof(bench_salt) - 1,
+	                  bench_info, sizeof(bench_info) - 1,
+	                  bench_out, 64, NULL);
+	while (!mi_keysched_ready(&bench_ks, 0, len))
+		mi_crypto_job_wait(&bench_ks.job);
+	mi_keysched_clear(&bench_ks);
+}
+
+static void bench_crc32(size_t len)
+{
+	soft_crc32(bench_in, len, 0);
+}
+
+typedef struct {
+	const char *name;
+	uint16_t    len;
+	void      (*fn)(size_t len);
+	void      (*prep)(size_t len);
+} bench_case_t;
+
+static const bench_case_t bench_cases[] = {
+	{ "aesecb",        16, bench_ecb,     NULL               },
+	{ "aesecb",        64, bench_ecb,     NULL               },
+	{ "aesccm_enc",     1, bench_ccm_enc, NULL               },
+	{ "aesccm_enc",     4, bench_ccm_enc, NULL               },
+	{ "aesccm_enc",    10, bench_ccm_enc, NULL               },
+	{ "aesccm_enc",    16, bench_ccm_enc, NULL               },
+	{ "aesccm_enc",    32, bench_ccm_enc, NULL               },
+	{ "aesccm_enc",    64, bench_ccm_enc, NULL               },
+	{ "aesccm_dec",     1, bench_ccm_dec, bench_ccm_enc_prep },
+	{ "aesccm_dec",     4, bench_ccm_dec, bench_ccm_enc_prep },
+	{ "aesccm_dec",    16, bench_ccm_dec, bench_ccm_enc_prep },
+	{ "aesccm_dec",    32, bench_ccm_dec, bench_ccm_enc_prep },
+	{ "aesccm_dec",    64, bench_ccm_dec, bench_ccm_enc_prep },
+	{ "aesccm_aad",    13, bench_ccm_aad, NULL               },
+	{ "ccmfix_enc",     1, bench_fix_enc, NULL               },
+	{ "ccmfix_enc",     4, bench_fix_enc, NULL               },
+	{ "ccmfix_enc",    10, bench_fix_enc, NULL               },
+	{ "ccmfix_enc",    64, bench_fix_enc, NULL               },
+	{ "ccmfix_dec",     1, bench_fix_dec, bench_ccm_enc_prep },
+	{ "ccmfix_dec",     4, bench_fix_dec, bench_ccm_enc_prep },
+	{ "ccmfix_dec",    64, bench_fix_dec, bench_ccm_enc_prep },
+	{ "ccmfix_aad",    13, bench_fix_enc, NULL               },
+	{ "sha256",        32, bench_sha256,  NULL               },
+	{ "sha256",        64, bench_sha256,  NULL               },
+	{ "sha256",       256, bench_sha256,  NULL               },
+	{ "hmac",          32, bench_hmac,    NULL               },
+	{ "hmac",          64, bench_hmac,    NULL               },
+	{ "hmac_keyed",    32, bench_hmac_keyed, bench_hmac_keyed_prep },
+	{ "hmac_keyed",    64, bench_hmac_keyed, bench_hmac_keyed_prep },
+	{ "hkdf",          32, bench_hkdf,    NULL               },
+	{ "hkdf",          64, bench_hkdf,    NULL               },
+	{ "hkdf_job",      32, bench_hkdf_job, NULL              },
+	{ "hkdf_job",      64, bench_hkdf_job, NULL              },
+	{ "keysched",      16, bench_keysched, NULL              },
+	{ "keysched",      64, bench_keysched, NULL              },
+	{ "crc32",         64, bench_crc32,   NULL               },
+	{ "crc32",        256, bench_crc32,   NULL               },
+	{ "crc32",        512, bench_crc32,   NULL               },
+};
+
+#define BENCH_CASE_NUM  (int)(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/* The readme profile table, measured with the SoftDevice ECB. */
+#if defined(NRF52)
+static const crypto_bench_ref_t bench_ref_default[] = {
+	{ "aesecb",      16,   14000 },
+	{ "aesccm_enc",  16,   93000 },
+	{ "aesccm_enc",  32,  128000 },
+	{ "hkdf",        32,  490000 },
+	{ "hkdf",        64,  780000 },
+};
+#elif defined(NRF51)
+static const crypto_bench_ref_t bench_ref_default[] = {
+	{ "aesecb",      16,   51000 },
+	{ "aesccm_enc",  16,  360000 },
+	{ "aesccm_enc",  32,  500000 },
+	{ "hkdf",        32, 3400000 },
+	{ "hkdf",        64, 6000000 },
+};
+#endif
+
+#if defined(NRF52) || defined(NRF51)
+static const crypto_bench_ref_t *p_bench_ref = bench_ref_default;
+static int bench_ref_num = sizeof(bench_ref_default) / sizeof(bench_ref_default[0]);
+#else
+static const crypto_bench_ref_t *p_bench_ref;
+static int bench_ref_num;
+#endif
+
+static uint8_t bench_initialized;
+
+static void bench_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(bench_in); i++)
+		bench_in[i] = (uint8_t)i;
+
+	aes128_setkey(&bench_aes, bench_key);
+	mbedtls_ccm_init(&bench_ccm);
+	mbedtls_ccm_setkey(&bench_ccm, bench_key);
+	bench_fix1_template(&bench_tmpl[0], bench_nonce);
+	bench_fix4_template(&bench_tmpl[1], bench_nonce);
+	bench_fix10_template(&bench_tmpl[2], bench_nonce);
+	bench_fix64_template(&bench_tmpl[3], bench_nonce);
+	bench_fix13_template(&bench_tmpl[4], bench_nonce);
+	mi_crypto_engine_init();
+	bench_timer_init();
+
+	bench_initialized = 1;
+}
+
+static uint32_t bench_baseline(const char *name, uint16_t len)
+{
+	int i;
+
+	for (i = 0; i < bench_ref_num; i++) {
+		if (p_bench_ref[i].len == len && strcmp(p_bench_ref[i].name, name) == 0)
+			return p_bench_ref[i].ns;
+	}
+
+	return 0;
+}
+
+int crypto_bench_num(void)
+{
+	return BENCH_CASE_NUM;
+}
+
+void crypto_bench_set_baseline(const crypto_bench_ref_t *p_ref, int num)
+{
+	p_bench_ref   = p_ref;
+	bench_ref_num = p_ref == NULL ? 0 : num;
+}
+
+int crypto_bench_run(int idx, crypto_bench_result_t *p_res)
+{
+	const bench_case_t *p_case;
+	uint32_t t0, ticks, best;
+	uint64_t total;
+	int i, r;
+
+	if (idx < 0 || idx >= BENCH_CASE_NUM)
+		return -1;
+
+	if (!bench_initialized)
+		bench_init();
+
+	p_case = &bench_cases[idx];
+	bench_err = 0;
+	if (p_case->prep != NULL)
+		p_case->prep(p_case->len);
+
+	/* best of BENCH_REPEAT runs, to keep host scheduler noise out */
+	for (r = 0, best = UINT32_MAX; r < BENCH_REPEAT; r++) {
+		t0 = bench_ticks();
+		for (i = 0; i < CRYPTO_BENCH_ITERS; i++)
+			p_case->fn(p_case->len);
+		ticks = bench_elapsed(t0);
+		if (ticks < best)
+			best = ticks;
+	}
+
+	total = (uint64_t)best * 1000000000ULL / BENCH_TICK_HZ;
+
+	p_res->name        = p_case->name;
+	p_res->len         = p_case->len;
+	p_res->iters       = CRYPTO_BENCH_ITERS;
+	p_res->ns          = (uint32_t)(total / CRYPTO_BENCH_ITERS);
+	p_res->cycles      = (uint32_t)((uint64_t)best * BENCH_CPU_HZ / BENCH_TICK_HZ / CRYPTO_BENCH_ITERS);
+	p_res->baseline_ns = bench_baseline(p_case->name, p_case->len);
+
+	if (bench_err)
+		return 1;
+
+	if (p_res->baseline_ns != 0 &&
+	    (uint64_t)p_res->ns * 100 > (uint64_t)p_res->baseline_ns * (100 + CRYPTO_BENCH_TOLERANCE))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef __CRYPTO_BENCH_H__
+#define __CRYPTO_BENCH_H__
+#include <stdint.h>
+
+/* A case may be this many percent slower than its baseline before it fails. */
+#ifndef CRYPTO_BENCH_TOLERANCE
+#define CRYPTO_BENCH_TOLERANCE      10
+#endif
+
+typedef struct {
+	const char *name;
+	uint16_t    len;
+	uint32_t    ns;                 /* per operation, 0 = no baseline */
+} crypto_bench_ref_t;
+
+typedef struct {
+	const char *name;               /* e.g. "aesccm_enc"              */
+	uint16_t    len;                /* bytes per operation            */
+	uint16_t    iters;              /* operations timed               */
+	uint32_t    ns;                 /* per operation                  */
+	uint32_t    cycles;             /* per operation, 0 if unknown    */
+	uint32_t    baseline_ns;        /* per operation, 0 if none       */
+} crypto_bench_result_t;
+
+/* CSV header of the rows the drivers print, one per crypto_bench_result_t. */
+#define CRYPTO_BENCH_HEADER    "case,bytes,iters,ns,cycles,baseline_ns,status\n"
+
+/**@brief Function for getting the number of benchmark cases.
+ */
+int crypto_bench_num(void);
+
+/**@brief Function for replacing the baselines.
+ *
+ * @details The device targets come with the baselines of the readme profile
+ * table. The host has none, its driver loads them from a CSV file.
+ *
+ * @param[in] p_ref    baselines, NULL clears them.
+ * @param[in] num      number of entries.
+ */
+void crypto_bench_set_baseline(const crypto_bench_ref_t *p_ref, int num);
+
+/**@brief Function for running one benchmark case.
+ *
+ * @details Times CRYPTO_BENCH_ITERS operations with the DWT cycle counter on
+ * nRF52, RTC1 on nRF51 and the monotonic clock on the host. The CCM, ECB and
+ * HKDF cases go through the AES backend the firmware is built with.
+ *
+ * @param[in]  idx     case index, 0 .. crypto_bench_num() - 1.
+ * @param[out] p_res   timing and baseline of the case.
+ *
+ * @return  0 within the baseline (or none), 1 regression or a failed
+ *          operation, -1 bad index.
+ */
+int crypto_bench_run(int idx, crypto_bench_result_t *p_res);
+
+#endif  /* __CRYPTO_BENCH_H__ */
@@ -0,0 +1,172 @@
+/*
+ * Host benchmark for the AES-128 / CCM primitives.
+ *
+ * Build with `make -C host bench` and run ./host/ccm_bench.
+ * `make -C host bench-batch` builds the same program with CCM_ECB_BATCH=4,
+ * the batched keystream, against the default of one ECB call per block.
+ * `make -C host bench-bitslice` runs it on the constant-time bitsliced AES
+ * (AES_BACKEND_BITSLICE), the software backend meant for the nRF51.
+ *
+ * When the host has AES instructions, every message is encrypted and
+ * decrypted with both the table code and the instructions, and the outputs
+ * must be byte-identical.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "aes128.h"
+#include "ccm.h"
+
+#ifndef CCM_ECB_BATCH
+#define CCM_ECB_BATCH 1
+#endif
+
+#define REPEAT 5
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Message sizes of the protocol: lock status (1), login crc (4), lock log (10),
+ * a full notification (14), share info (32), registration data (64) and the
+ * largest reliable transfer payload (255).
+ */
+static const size_t msg_len[] = {1, 4, 10, 14, 16, 32, 64, 255};
+#define MSG_NUM (sizeof(msg_len) / sizeof(msg_len[0]))
+
+static uint8_t key[16] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+                          0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
+static uint8_t in[256], out[256], mic[4];
+
+static double bench_ccm(mbedtls_ccm_context *ccm, size_t len, size_t rounds)
+{
+	uint8_t nonce[12] = {0};
+	double t0, t1, best;
+	size_t j, r;
+
+	/* best of REPEAT runs, to keep scheduler noise out */
+	for (r = 0, best = 1e30; r < REPEAT; r++) {
+		t0 = now_ns();
+		for (j = 0; j < rounds; j++) {
+			nonce[8] = (uint8_t)j;
+			mbedtls_ccm_encrypt_and_tag(ccm, nonce, sizeof(nonce), NULL, 0,
+			                            in, len, out, mic, sizeof(mic));
+		}
+		t1 = now_ns();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+
+	return best / rounds;
+}
+
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+/* Table and instruction AES must agree on every size and nonce. */
+static int cross_check(mbedtls_ccm_context *ccm)
+{
+	uint8_t nonce[12], ref[256 + 4], dec[256];
+	size_t i, j;
+	int errors = 0;
+
+	for (i = 0; i < MSG_NUM; i++) {
+		for (j = 0; j < 64; j++) {
+			memset(nonce, (int)j, sizeof(nonce));
+
+			aes128_hw_select(0);
+			aes_ccm_encrypt_and_tag(key, nonce, sizeof(nonce), nonce, j % 13,
+			                        in, msg_len[i], ref, ref + msg_len[i], 4);
+
+			aes128_hw_select(1);
+			aes_ccm_encrypt_and_tag(key, nonce, sizeof(nonce), nonce, j % 13,
+			                        in, msg_len[i], out, mic, 4);
+			if (memcmp(ref, out, msg_len[i]) != 0 || memcmp(ref + msg_len[i], mic, 4) != 0)
+				errors++;
+
+			if (aes_ccm_auth_decrypt(key, nonce, sizeof(nonce), nonce, j % 13,
+			                         out, msg_len[i], dec, mic, 4) != 0 ||
+			    memcmp(dec, in, msg_len[i]) != 0)
+				errors++;
+		}
+	}
+
+	(void)ccm;
+	return errors;
+}
+#endif
+
+int main(void)
+{
+	static uint8_t blocks[16 * 16];
+	mbedtls_ccm_context ccm;
+	aes128_ctx_t aes;
+	double t0, t1, best, ns[2][MSG_NUM];
+	size_t i, j, r;
+	int hw, pass, passes = 1;
+	const size_t rounds = 100000;
+
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = (uint8_t)i;
+
+	aes128_setkey(&aes, key);
+	mbedtls_ccm_init(&ccm);
+	mbedtls_ccm_setkey(&ccm, key);
+
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+	if (aes128_hw_select(1)) {
+		int errors = cross_check(&ccm);
+		printf("# hw vs table cross check: %s\n", errors ? "FAIL" : "PASS");
+		if (errors)
+			return 1;
+		passes = 2;
+	}
+#endif
+
+	for (pass = 0; pass < passes; pass++) {
+		hw = pass;
+#if defined(AES_HW_AESNI) || defined(AES_HW_ARMV8)
+		aes128_hw_select(hw);
+#endif
+		printf("# AES backend %d%s, CCM_ECB_BATCH %d\n", AES_BACKEND,
+		       hw ? " (cpu instructions)" :
+		       AES_BACKEND == AES_BACKEND_BITSLICE ? " (bitsliced)" : " (tables)", CCM_ECB_BATCH);
+
+		for (r = 0, best = 1e30; r < REPEAT; r++) {
+			t0 = now_ns();
+			for (j = 0; j < rounds * 4; j++)
+				aes128_encrypt(&aes, blocks, blocks);
+			t1 = now_ns();
+			if (t1 - t0 < best)
+				best = t1 - t0;
+		}
+		printf("aesecb    %3d bytes  %8.1f ns\n", 16, best / (rounds * 4));
+
+		for (r = 0, best = 1e30; r < REPEAT; r++) {
+			t0 = now_ns();
+			for (j = 0; j < rounds; j++)
+				aes128_encrypt_blocks(&aes, blocks, blocks, 4);
+			t1 = now_ns();
+			if (t1 - t0 < best)
+				best = t1 - t0;
+		}
+		printf("aesecb x4 %3d bytes  %8.1f ns\n", 64, best / rounds);
+
+		for (i = 0; i < MSG_NUM; i++) {
+			ns[pass][i] = bench_ccm(&ccm, msg_len[i], rounds);
+			printf("aesccm    %3u bytes  %8.1f ns  %10.0f msg/s\n", (unsigned)msg_len[i],
+			       ns[pass][i], 1e9 / ns[pass][i]);
+		}
+	}
+
+	if (passes == 2) {
+		printf("# speedup of the cpu instructions\n");
+		for (i = 0; i < MSG_NUM; i++)
+			printf("aesccm    %3u bytes  %6.2fx\n", (unsigned)msg_len[i], ns[0][i] / ns[1][i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Host driver of the crypto benchmark suite (../crypto_bench.c).
+ *
+ *   ./crypto_bench [baseline.csv]
+ *
+ * Prints one CSV row per case. With a baseline file (a previous output of
+ * this program) every case slower than its baseline by more than
+ * CRYPTO_BENCH_TOLERANCE percent is marked FAIL and the exit status is 1.
+ * `make -C host crypto-bench-save` stores the baseline of this machine,
+ * `make -C host crypto-bench` compares against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes128.h"
+#include "crypto_bench.h"
+
+#define REF_MAX     64
+
+static crypto_bench_ref_t ref[REF_MAX];
+static char ref_name[REF_MAX][16];
+
+static int load_baseline(const char *path)
+{
+	char line[128];
+	unsigned len, iters, ns;
+	int num = 0;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (num < REF_MAX && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%15[^,],%u,%u,%u", ref_name[num], &len, &iters, &ns) != 4)
+			continue;       /* header, comments */
+		ref[num].name = ref_name[num];
+		ref[num].len  = (uint16_t)len;
+		ref[num].ns   = ns;
+		num++;
+	}
+
+	fclose(fp);
+	crypto_bench_set_baseline(ref, num);
+
+	return num;
+}
+
+int main(int argc, char *argv[])
+{
+	crypto_bench_result_t res;
+	int i, ret, failed = 0;
+
+	if (argc > 1 && load_baseline(argv[1]) < 0)
+		return 2;
+
+	printf("# AES backend %d, tolerance %d%%\n", AES_BACKEND, CRYPTO_BENCH_TOLERANCE);
+	printf(CRYPTO_BENCH_HEADER);
+
+	for (i = 0; i < crypto_bench_num(); i++) {
+		ret = crypto_bench_run(i, &res);
+		printf("%s,%u,%u,%u,%u,%u,%s\n", res.name, res.len, res.iters, res.ns,
+		       res.cycles, res.baseline_ns,
+		       ret ? "FAIL" : res.baseline_ns ? "ok" : "new");
+		failed += ret;
+	}
+
+	return failed ? 1 : 0;
+}
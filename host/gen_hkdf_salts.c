@@ -0,0 +1,76 @@
+/*
+ * Generator of mi_hkdf_salts.c / mi_hkdf_salts.h, the HMAC midstates of the
+ * constant HKDF salts of the handshakes.
+ *
+ *   ./gen_hkdf_salts c|h name=salt ...
+ *
+ * prints the source (c) or the header (h) defining a sha256_hmac_state
+ * <name>_hmac for every salt. `make -C host hkdf-salts` regenerates both
+ * files from the salts listed in the Makefile, which must match the strings
+ * in mi_secure.c; the M_TEST self-test there checks that they do.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256_hkdf.h"
+
+static void print_words(const uint32_t w[8])
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		printf("%s0x%08X%s", i % 4 ? " " : "\t\t", (unsigned)w[i],
+		       i == 7 ? "" : i % 4 == 3 ? ",\n" : ",");
+}
+
+int main(int argc, char *argv[])
+{
+	sha256_hmac_state st;
+	const char *salt;
+	int i, len, source;
+
+	if (argc < 3 || (strcmp(argv[1], "c") && strcmp(argv[1], "h"))) {
+		fprintf(stderr, "usage: %s c|h name=salt ...\n", argv[0]);
+		return 2;
+	}
+	source = argv[1][0] == 'c';
+
+	printf("/* Generated by host/gen_hkdf_salts.c, do not edit. */\n");
+	if (source) {
+		printf("#include \"mi_hkdf_salts.h\"\n");
+	} else {
+		printf("#ifndef __MI_HKDF_SALTS_H__\n");
+		printf("#define __MI_HKDF_SALTS_H__\n");
+		printf("#include \"sha256_hkdf.h\"\n\n");
+	}
+
+	for (i = 2; i < argc; i++) {
+		salt = strchr(argv[i], '=');
+		if (salt == NULL) {
+			fprintf(stderr, "%s: expected name=salt\n", argv[i]);
+			return 2;
+		}
+		len = (int)(salt - argv[i]);
+		salt++;
+
+		if (!source) {
+			printf("extern const sha256_hmac_state %.*s_hmac;\t/* \"%s\" */\n",
+			       len, argv[i], salt);
+			continue;
+		}
+
+		sha256_hmac_state_gen(&st, (const unsigned char *)salt, strlen(salt));
+		printf("\n/* \"%s\" */\n", salt);
+		printf("const sha256_hmac_state %.*s_hmac = {\n", len, argv[i]);
+		printf("\t{\n");
+		print_words(st.inner);
+		printf("\n\t},\n\t{\n");
+		print_words(st.outer);
+		printf("\n\t}\n};\n");
+	}
+
+	if (!source)
+		printf("\n#endif  /* __MI_HKDF_SALTS_H__ */\n");
+
+	return 0;
+}
@@ -0,0 +1,462 @@
+/*
+ * Multi-buffer HKDF-SHA-256, see hkdf_batch.h.
+ *
+ * The lane states are kept transposed, word j of lane l in st[j][l], so a
+ * row is one vector. Only the message blocks are built lane by lane; the
+ * 64 rounds run on all lanes with the same instructions. Define
+ * HKDF_BATCH_NO_SIMD to build the C lanes only.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hkdf_batch.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(HKDF_BATCH_NO_SIMD)
+#define HKDF_BATCH_X86
+#include <immintrin.h>
+#endif
+
+#define LANES   HKDF_BATCH_LANES_MAX
+
+typedef uint32_t mb_state_t[8][LANES];
+typedef uint32_t mb_block_t[16][LANES];
+
+static const uint32_t K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/*
+ * One compression of every lane, written once against the vector
+ * operations V*() that each implementation defines before expanding it.
+ */
+#define MB_S0(x)        VXOR(VXOR(VROTR(x, 2), VROTR(x, 13)), VROTR(x, 22))
+#define MB_S1(x)        VXOR(VXOR(VROTR(x, 6), VROTR(x, 11)), VROTR(x, 25))
+#define MB_s0(x)        VXOR(VXOR(VROTR(x, 7), VROTR(x, 18)), VSHR(x, 3))
+#define MB_s1(x)        VXOR(VXOR(VROTR(x, 17), VROTR(x, 19)), VSHR(x, 10))
+#define MB_CH(e, f, g)  VXOR(VAND(e, f), VANDNOT(e, g))
+#define MB_MAJ(a, b, c) VOR(VAND(a, b), VAND(c, VOR(a, b)))
+
+#define MB_W(t)                                                         \
+	((t) < 16 ? x[(t) & 15] :                                       \
+	 (x[(t) & 15] = VADD(VADD(MB_s1(x[((t) - 2) & 15]), x[((t) - 7) & 15]), \
+	                     VADD(MB_s0(x[((t) - 15) & 15]), x[(t) & 15]))))
+
+#define MB_ROUND(a, b, c, d, e, f, g, h, t)                             \
+	do {                                                            \
+		t1 = VADD(VADD(h, MB_S1(e)), VADD(MB_CH(e, f, g),       \
+		          VADD(VSET1(K[t]), MB_W(t))));                 \
+		t2 = VADD(MB_S0(a), MB_MAJ(a, b, c));                   \
+		d  = VADD(d, t1);                                       \
+		h  = VADD(t1, t2);                                      \
+	} while (0)
+
+#define MB_COMPRESS(V, st, w)                                           \
+	do {                                                            \
+		V a, b, c, d, e, f, g, h, t1, t2, x[16];                \
+		int t;                                                  \
+		a = VLOAD(st[0]); b = VLOAD(st[1]);                     \
+		c = VLOAD(st[2]); d = VLOAD(st[3]);                     \
+		e = VLOAD(st[4]); f = VLOAD(st[5]);                     \
+		g = VLOAD(st[6]); h = VLOAD(st[7]);                     \
+		for (t = 0; t < 16; t++)                                \
+			x[t] = VLOAD(w[t]);                             \
+		for (t = 0; t < 64; t += 8) {                           \
+			MB_ROUND(a, b, c, d, e, f, g, h, t + 0);        \
+			MB_ROUND(h, a, b, c, d, e, f, g, t + 1);        \
+			MB_ROUND(g, h, a, b, c, d, e, f, t + 2);        \
+			MB_ROUND(f, g, h, a, b, c, d, e, t + 3);        \
+			MB_ROUND(e, f, g, h, a, b, c, d, t + 4);        \
+			MB_ROUND(d, e, f, g, h, a, b, c, t + 5);        \
+			MB_ROUND(c, d, e, f, g, h, a, b, t + 6);        \
+			MB_ROUND(b, c, d, e, f, g, h, a, t + 7);        \
+		}                                                       \
+		VSTORE(st[0], VADD(VLOAD(st[0]), a));                   \
+		VSTORE(st[1], VADD(VLOAD(st[1]), b));                   \
+		VSTORE(st[2], VADD(VLOAD(st[2]), c));                   \
+		VSTORE(st[3], VADD(VLOAD(st[3]), d));                   \
+		VSTORE(st[4], VADD(VLOAD(st[4]), e));                   \
+		VSTORE(st[5], VADD(VLOAD(st[5]), f));                   \
+		VSTORE(st[6], VADD(VLOAD(st[6]), g));                   \
+		VSTORE(st[7], VADD(VLOAD(st[7]), h));                   \
+	} while (0)
+
+/* 4 lanes in C; the independent lanes keep a superscalar core busy. */
+typedef struct { uint32_t l[4]; } v4_t;
+
+#define V4_OP(name, op)                                                 \
+static inline v4_t name(v4_t x, v4_t y)                                 \
+{                                                                       \
+	v4_t r = {{x.l[0] op y.l[0], x.l[1] op y.l[1],                  \
+	           x.l[2] op y.l[2], x.l[3] op y.l[3]}};                \
+	return r;                                                       \
+}
+V4_OP(v4_add, +)
+V4_OP(v4_xor, ^)
+V4_OP(v4_and, &)
+V4_OP(v4_or,  |)
+
+static inline v4_t v4_andnot(v4_t x, v4_t y)
+{
+	v4_t r = {{~x.l[0] & y.l[0], ~x.l[1] & y.l[1],
+	           ~x.l[2] & y.l[2], ~x.l[3] & y.l[3]}};
+	return r;
+}
+
+static inline v4_t v4_shr(v4_t x, int n)
+{
+	v4_t r = {{x.l[0] >> n, x.l[1] >> n, x.l[2] >> n, x.l[3] >> n}};
+	return r;
+}
+
+#define ROTR32(x, n)    ((x) >> (n) | (x) << (32 - (n)))
+
+static inline v4_t v4_rotr(v4_t x, int n)
+{
+	v4_t r = {{ROTR32(x.l[0], n), ROTR32(x.l[1], n),
+	           ROTR32(x.l[2], n), ROTR32(x.l[3], n)}};
+	return r;
+}
+
+static inline v4_t v4_set1(uint32_t k)
+{
+	v4_t r = {{k, k, k, k}};
+	return r;
+}
+
+#define VLOAD(p)        (*(const v4_t *)(p))
+#define VSTORE(p, x)    (*(v4_t *)(p) = (x))
+#define VSET1(k)        v4_set1(k)
+#define VADD(x, y)      v4_add(x, y)
+#define VXOR(x, y)      v4_xor(x, y)
+#define VAND(x, y)      v4_and(x, y)
+#define VOR(x, y)       v4_or(x, y)
+#define VANDNOT(x, y)   v4_andnot(x, y)
+#define VSHR(x, n)      v4_shr(x, n)
+#define VROTR(x, n)     v4_rotr(x, n)
+
+static void mb_compress_c(mb_state_t st, const mb_block_t w)
+{
+	MB_COMPRESS(v4_t, st, w);
+}
+
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VSHR
+#undef VROTR
+
+#if defined(HKDF_BATCH_X86)
+#define VLOAD(p)        _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, x)    _mm_storeu_si128((__m128i *)(p), x)
+#define VSET1(k)        _mm_set1_epi32((int)(k))
+#define VADD(x, y)      _mm_add_epi32(x, y)
+#define VXOR(x, y)      _mm_xor_si128(x, y)
+#define VAND(x, y)      _mm_and_si128(x, y)
+#define VOR(x, y)       _mm_or_si128(x, y)
+#define VANDNOT(x, y)   _mm_andnot_si128(x, y)
+#define VSHR(x, n)      _mm_srli_epi32(x, n)
+#define VROTR(x, n)     _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("sse2")))
+static void mb_compress_sse2(mb_state_t st, const mb_block_t w)
+{
+	MB_COMPRESS(__m128i, st, w);
+}
+
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VSHR
+#undef VROTR
+
+#define VLOAD(p)        _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, x)    _mm256_storeu_si256((__m256i *)(p), x)
+#define VSET1(k)        _mm256_set1_epi32((int)(k))
+#define VADD(x, y)      _mm256_add_epi32(x, y)
+#define VXOR(x, y)      _mm256_xor_si256(x, y)
+#define VAND(x, y)      _mm256_and_si256(x, y)
+#define VOR(x, y)       _mm256_or_si256(x, y)
+#define VANDNOT(x, y)   _mm256_andnot_si256(x, y)
+#define VSHR(x, n)      _mm256_srli_epi32(x, n)
+#define VROTR(x, n)     _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void mb_compress_avx2(mb_state_t st, const mb_block_t w)
+{
+	MB_COMPRESS(__m256i, st, w);
+}
+#endif /* HKDF_BATCH_X86 */
+
+typedef struct {
+	hkdf_batch_backend_t id;
+	const char *name;
+	int lanes;
+	void (*compress)(mb_state_t st, const mb_block_t w);
+} mb_backend_t;
+
+static const mb_backend_t backends[] = {
+#if defined(HKDF_BATCH_X86)
+	{HKDF_BATCH_AVX2,   "avx2",   8, mb_compress_avx2},
+	{HKDF_BATCH_SSE2,   "sse2",   4, mb_compress_sse2},
+#endif
+	{HKDF_BATCH_SCALAR, "scalar", 4, mb_compress_c},
+};
+#define BACKEND_NUM     (sizeof(backends) / sizeof(backends[0]))
+
+static const mb_backend_t *mb;
+
+static int cpu_has(hkdf_batch_backend_t id)
+{
+#if defined(HKDF_BATCH_X86)
+	__builtin_cpu_init();
+	if (id == HKDF_BATCH_AVX2)
+		return __builtin_cpu_supports("avx2");
+	if (id == HKDF_BATCH_SSE2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return id == HKDF_BATCH_SCALAR;
+}
+
+int hkdf_batch_select(hkdf_batch_backend_t backend)
+{
+	size_t i;
+
+	for (i = 0; i < BACKEND_NUM; i++) {
+		if ((backend == HKDF_BATCH_AUTO || backend == backends[i].id) &&
+		    cpu_has(backends[i].id)) {
+			mb = &backends[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *hkdf_batch_name(void)
+{
+	if (mb == NULL)
+		hkdf_batch_select(HKDF_BATCH_AUTO);
+	return mb->name;
+}
+
+static void mb_broadcast(mb_state_t st, const uint32_t s[8])
+{
+	int j, l;
+
+	for (j = 0; j < 8; j++)
+		for (l = 0; l < LANES; l++)
+			st[j][l] = s[j];
+}
+
+/* Compress one 64-byte block of every lane. */
+static void mb_block(mb_state_t st, const unsigned char *const blk[])
+{
+	mb_block_t w;
+	const unsigned char *p;
+	int j, l;
+
+	for (l = 0; l < mb->lanes; l++) {
+		for (j = 0, p = blk[l]; j < 16; j++, p += 4)
+			w[j][l] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+			          (uint32_t)p[2] << 8 | p[3];
+	}
+	mb->compress(st, w);
+}
+
+/*
+ * Finish the hash of msg[l] for every lane, from a state that has taken
+ * one block (an HMAC key) already.
+ */
+static void mb_hash(mb_state_t st, const unsigned char *const msg[], size_t len,
+                    unsigned char *const out[])
+{
+	unsigned char tail[LANES][128];
+	const unsigned char *blk[LANES];
+	uint64_t bits = (uint64_t)(64 + len) * 8;
+	size_t off, rem, tail_len;
+	int j, l;
+
+	for (off = 0; len - off >= 64; off += 64) {
+		for (l = 0; l < mb->lanes; l++)
+			blk[l] = msg[l] + off;
+		mb_block(st, blk);
+	}
+
+	rem = len - off;
+	tail_len = rem + 9 > 64 ? 128 : 64;
+	for (l = 0; l < mb->lanes; l++) {
+		memcpy(tail[l], msg[l] + off, rem);
+		tail[l][rem] = 0x80;
+		memset(tail[l] + rem + 1, 0, tail_len - rem - 9);
+		for (j = 0; j < 8; j++)
+			tail[l][tail_len - 1 - j] = (unsigned char)(bits >> (8 * j));
+	}
+
+	for (off = 0; off < tail_len; off += 64) {
+		for (l = 0; l < mb->lanes; l++)
+			blk[l] = tail[l] + off;
+		mb_block(st, blk);
+	}
+
+	for (l = 0; l < mb->lanes; l++) {
+		for (j = 0; j < 8; j++) {
+			out[l][4 * j + 0] = (unsigned char)(st[j][l] >> 24);
+			out[l][4 * j + 1] = (unsigned char)(st[j][l] >> 16);
+			out[l][4 * j + 2] = (unsigned char)(st[j][l] >> 8);
+			out[l][4 * j + 3] = (unsigned char)(st[j][l]);
+		}
+	}
+}
+
+/* HMAC keyed with the 32-byte key[l] in every lane: the two midstates. */
+static void mb_hmac_key(mb_state_t inner, mb_state_t outer,
+                        unsigned char *const key[])
+{
+	unsigned char pad[LANES][64];
+	const unsigned char *blk[LANES];
+	int i, l;
+
+	for (l = 0; l < mb->lanes; l++) {
+		memset(pad[l], 0x36, 64);
+		for (i = 0; i < 32; i++)
+			pad[l][i] ^= key[l][i];
+		blk[l] = pad[l];
+	}
+	mb_broadcast(inner, IV);
+	mb_block(inner, blk);
+
+	for (l = 0; l < mb->lanes; l++)
+		for (i = 0; i < 64; i++)
+			pad[l][i] ^= 0x36 ^ 0x5C;
+	mb_broadcast(outer, IV);
+	mb_block(outer, blk);
+}
+
+/*
+ * One derivation per lane. m[l] is the HMAC input of the expand step,
+ * T(i-1) | info | i, which has info copied in already; T(i) is written
+ * back to its head.
+ */
+static void mb_hkdf(const sha256_hmac_state *salt,
+                    const unsigned char *const ikm[], size_t ikm_len,
+                    size_t info_len, unsigned char *const m[],
+                    unsigned char *const okm[], size_t okm_len)
+{
+	mb_state_t st, prk_inner, prk_outer;
+	unsigned char buf[LANES][32];
+	unsigned char *inner[LANES];
+	const unsigned char *msg[LANES];
+	size_t done, n;
+	int i, l;
+
+	for (l = 0; l < mb->lanes; l++)
+		inner[l] = buf[l];
+
+	/* PRK = HMAC(salt, IKM), the PRK goes to m[l] for keying */
+	mb_broadcast(st, salt->inner);
+	mb_hash(st, ikm, ikm_len, inner);
+	mb_broadcast(st, salt->outer);
+	mb_hash(st, (const unsigned char *const *)inner, 32, m);
+	mb_hmac_key(prk_inner, prk_outer, m);
+
+	for (i = 1, done = 0; done < okm_len; i++, done += n) {
+		for (l = 0; l < mb->lanes; l++) {
+			m[l][32 + info_len] = (unsigned char)i;
+			msg[l] = i == 1 ? m[l] + 32 : m[l];
+		}
+		memcpy(st, prk_inner, sizeof(st));
+		mb_hash(st, msg, (i == 1 ? 0 : 32) + info_len + 1, inner);
+		memcpy(st, prk_outer, sizeof(st));
+		mb_hash(st, (const unsigned char *const *)inner, 32, m);
+
+		n = okm_len - done < 32 ? okm_len - done : 32;
+		for (l = 0; l < mb->lanes; l++)
+			memcpy(okm[l] + done, m[l], n);
+	}
+
+	memset(prk_inner, 0, sizeof(prk_inner));
+	memset(prk_outer, 0, sizeof(prk_outer));
+	memset(buf, 0, sizeof(buf));
+}
+
+int hkdf_batch_state(const sha256_hmac_state *st,
+                     const unsigned char *ikm, size_t ikm_len,
+                     const unsigned char *info, size_t info_len,
+                     unsigned char *okm, size_t okm_len, size_t n)
+{
+	const unsigned char *lane_ikm[LANES];
+	unsigned char *lane_okm[LANES], *m[LANES];
+	unsigned char *scratch, *spare;
+	size_t m_len = 32 + info_len + 1, b;
+	int l;
+
+	if (okm_len > 255 * 32)
+		return -1;
+	if (mb == NULL)
+		hkdf_batch_select(HKDF_BATCH_AUTO);
+
+	/* the lanes past the end of the batch work on the first key */
+	scratch = malloc(LANES * m_len + okm_len);
+	if (scratch == NULL)
+		return -1;
+	spare = scratch + LANES * m_len;
+	for (l = 0; l < LANES; l++) {
+		m[l] = scratch + l * m_len;
+		memcpy(m[l] + 32, info, info_len);
+	}
+
+	for (b = 0; b < n; b += mb->lanes) {
+		for (l = 0; l < mb->lanes; l++) {
+			if (b + l < n) {
+				lane_ikm[l] = ikm + (b + l) * ikm_len;
+				lane_okm[l] = okm + (b + l) * okm_len;
+			} else {
+				lane_ikm[l] = ikm + b * ikm_len;
+				lane_okm[l] = spare;
+			}
+		}
+		mb_hkdf(st, lane_ikm, ikm_len, info_len, m, lane_okm, okm_len);
+	}
+
+	memset(scratch, 0, LANES * m_len + okm_len);
+	free(scratch);
+	return 0;
+}
+
+int hkdf_batch(const unsigned char *salt, size_t salt_len,
+               const unsigned char *ikm, size_t ikm_len,
+               const unsigned char *info, size_t info_len,
+               unsigned char *okm, size_t okm_len, size_t n)
+{
+	sha256_hmac_state st;
+	int ret;
+
+	sha256_hmac_state_gen(&st, salt, salt_len);
+	ret = hkdf_batch_state(&st, ikm, ikm_len, info, info_len, okm, okm_len, n);
+	memset(&st, 0, sizeof(st));
+	return ret;
+}
@@ -0,0 +1,71 @@
+/*
+ * Multi-buffer HKDF-SHA-256, for host tools deriving the keys of many
+ * devices at once (e.g. the cloud keys of a batch of LTMKs).
+ *
+ * The derivations of a batch share the salt, the info string and all the
+ * lengths, so every SHA-256 of one derivation has the same shape as the
+ * ones of the others and they run in lockstep, one derivation per lane of
+ * a vector register: 8 lanes with AVX2, 4 with SSE2, 4 interleaved in
+ * plain C elsewhere. The output is the one of sha256_hkdf().
+ */
+#ifndef __HKDF_BATCH_H__
+#define __HKDF_BATCH_H__
+
+#include <stddef.h>
+
+#include "sha256_hkdf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HKDF_BATCH_LANES_MAX    8
+
+typedef enum {
+	HKDF_BATCH_AUTO,        /* the widest one the CPU has */
+	HKDF_BATCH_SCALAR,      /* 4 lanes interleaved in C */
+	HKDF_BATCH_SSE2,        /* 4 lanes */
+	HKDF_BATCH_AVX2,        /* 8 lanes */
+} hkdf_batch_backend_t;
+
+/**
+ * @brief Select the implementation used by the following calls.
+ *
+ * @return 0, or -1 if the build or the CPU lacks it (the selection is kept).
+ */
+int hkdf_batch_select(hkdf_batch_backend_t backend);
+
+/**
+ * @brief Name of the selected implementation, for logs.
+ */
+const char *hkdf_batch_name(void);
+
+/**
+ * @brief Derive n keys: okm[i] = HKDF(salt, ikm[i], info).
+ *
+ * @param[in]  st        midstates of the salt, see sha256_hmac_state_gen()
+ * @param[in]  ikm       n input keying materials of ikm_len bytes each
+ * @param[in]  info      info string, the same for every key
+ * @param[out] okm       n keys of okm_len bytes each
+ * @param[in]  n         number of keys
+ *
+ * @return 0, or -1 if okm_len is over 255 * 32 or out of memory.
+ */
+int hkdf_batch_state(const sha256_hmac_state *st,
+                     const unsigned char *ikm, size_t ikm_len,
+                     const unsigned char *info, size_t info_len,
+                     unsigned char *okm, size_t okm_len, size_t n);
+
+/**
+ * @brief hkdf_batch_state() with the salt itself.
+ */
+int hkdf_batch(const unsigned char *salt, size_t salt_len,
+               const unsigned char *ikm, size_t ikm_len,
+               const unsigned char *info, size_t info_len,
+               unsigned char *okm, size_t okm_len, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __HKDF_BATCH_H__ */
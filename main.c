@@ -45,6 +45,7 @@
 #include "mi_secure.h"
 #include "mi_beacon.h"
 #include "mi_crypto.h"
+#include "mi_crypto_engine.h"
 #include "mi_psm.h"
 
 #include "app_util_platform.h"
@@ -165,24 +166,66 @@ static void gap_params_init(void)
  */
 /**@snippet [Handling the data received over BLE] */
 uint8_t msg[32];
-static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
-{
-	uint32_t errno;
 
-	NRF_LOG_HEXDUMP_INFO(p_data, length);
-	errno = mi_session_decrypt(p_data, length, msg);
+/*
+ * The echo runs as session operations: this handler is in the SoftDevice
+ * event context and may preempt the main loop in the middle of a lock
+ * opcode decryption or a lock state encryption, the ops then finish there.
+ */
+static uint8_t nus_rx[32];
+static mi_session_op_t nus_dec_op;
+static mi_session_op_t nus_enc_op;
 
-	if (errno != NRF_SUCCESS) {
+static void nus_echo_handler(mi_session_op_t * p_op)
+{
+	uint16_t length;
+
+	if (p_op->result == 0 && p_op->dir == MI_SESSION_DECRYPT) {
+		NRF_LOG_HEXDUMP_INFO(msg, p_op->len - 6);
+		nus_enc_op.conn_handle = p_op->conn_handle;
+		nus_enc_op.dir         = MI_SESSION_ENCRYPT;
+		nus_enc_op.input       = msg;
+		nus_enc_op.len         = p_op->len - 6;
+		nus_enc_op.output      = msg;
+		nus_enc_op.handler     = nus_echo_handler;
+		if (mi_session_submit(&nus_enc_op) == 0)
+			return;
+	}
+
+	if (p_op->result == 0 && p_op->dir == MI_SESSION_ENCRYPT) {
+		length = p_op->len + 6;
+		NRF_LOG_HEXDUMP_INFO(msg, length);
+	} else {
 		length = 1;
 		msg[0] = 0xFF;
-	} else {
-		NRF_LOG_HEXDUMP_INFO(msg, length-6);
-		mi_session_encrypt(msg, length-6, msg);
-		NRF_LOG_HEXDUMP_INFO(msg, length);
 	}
-	
+
 	ble_nus_string_send(&m_nus, msg, length);
+}
+
+static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
+{
+	uint8_t err = 0xFF;
+
+	NRF_LOG_HEXDUMP_INFO(p_data, length);
+
+	/* The previous echo is still on its way (msg is its buffer), or it does not fit. */
+	if (nus_dec_op.pending || nus_enc_op.pending || length < 6 || length > sizeof(nus_rx)) {
+		ble_nus_string_send(&m_nus, &err, 1);
+		return;
+	}
 
+	/* p_data is gone once we return, the op may run later. */
+	memcpy(nus_rx, p_data, length);
+	nus_dec_op.conn_handle = p_nus->conn_handle;
+	nus_dec_op.dir         = MI_SESSION_DECRYPT;
+	nus_dec_op.input       = nus_rx;
+	nus_dec_op.len         = length;
+	nus_dec_op.output      = msg;
+	nus_dec_op.handler     = nus_echo_handler;
+
+	if (mi_session_submit(&nus_dec_op) != 0)
+		ble_nus_string_send(&m_nus, &err, 1);
 }
 
 
@@ -635,6 +678,7 @@ void twi0_handler(nrf_drv_twi_evt_t const * p_event, void * p_context)
 	case NRF_DRV_TWI_EVT_DONE:
 		NRF_LOG_INFO("TWI evt done: %d\n", p_event->xfer_desc.type);
 		m_twi0_xfer_done = true;
+		mi_scheduler_wake(MI_SCHD_WAKE_TWI);
 		break;
 
 	default:
@@ -723,7 +767,8 @@ int main(void)
 	/* <!> mi_psm_init() must be called after ble_stack_init(). */
 	mi_psm_init();
 	mibeacon_init();
-	mi_scheduler_init(APP_TIMER_TICKS(10, APP_TIMER_PRESCALER), mi_schd_event_handler);
+	/* The threads are woken by their events, the tick only checks the timeouts. */
+	mi_scheduler_init(APP_TIMER_TICKS(100, APP_TIMER_PRESCALER), APP_TIMER_PRESCALER, mi_schd_event_handler);
 	
 	mi_scheduler_start(SYS_KEY_RESTORE);
 
@@ -791,8 +836,9 @@ int main(void)
 			lock_opcode = 0;
 		}
 
-		if (NRF_LOG_PROCESS() == false)
+		if (NRF_LOG_PROCESS() == false && mi_crypto_engine_process() == 0)
         {
+			mi_crypto_ks_refill();
             power_manage();
         }
     }
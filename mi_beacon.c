@@ -32,6 +32,7 @@ static uint8_t  frame_cnt;
 static uint8_t  beacon_key[16] = "DUMMY KEY";
 static uint8_t  m_beacon_timer_is_running;
 static uint8_t  m_beacon_key_is_vaild;
+static mbedtls_ccm_context beacon_ccm;
 
 static mibeacon_config_t m_beacon_data;
 
@@ -46,6 +47,7 @@ void set_beacon_key(uint8_t *p_key)
 {
 	arch_dev_mac_get(beacon_nonce.mac, 6);
 	memcpy(beacon_key, p_key, sizeof(beacon_key));
+	mbedtls_ccm_setkey(&beacon_ccm, beacon_key);
 	m_beacon_key_is_vaild = 1;
 }
 
@@ -108,7 +110,9 @@ int mibeacon_data_set(mibeacon_config_t const * const config, uint8_t *output, u
 	{
 		p_frame_ctrl->evt_include = 1;
 		p_obj = (void*)output;
-		event_encode(config->p_obj, output);
+		/* An encrypted object is written by the CCM below, straight from config. */
+		if (p_frame_ctrl->is_encrypt != 1)
+			event_encode(config->p_obj, output);
 		output      += 3 + config->p_obj->len;
 		*output_len += 3 + config->p_obj->len;
 	}
@@ -135,37 +139,49 @@ int mibeacon_data_set(mibeacon_config_t const * const config, uint8_t *output, u
 			beacon_nonce.cnt = frame_cnt;
 			arch_rand_get(beacon_nonce.rand, 3);
 
-			uint8_t mic[4];
 			uint8_t aad = 0x11;
-			uint8_t evt_len = p_obj->len+3;
+			uint8_t hdr[3];
+			mbedtls_ccm_iovec in[2], out[1];
+
+			/* object header and value in, the frame's object field out */
+			hdr[0] = config->p_obj->type;
+			hdr[1] = config->p_obj->type >> 8;
+			hdr[2] = config->p_obj->len;
+			in[0].base  = hdr;
+			in[0].len   = sizeof(hdr);
+			in[1].base  = config->p_obj->val;
+			in[1].len   = config->p_obj->len;
+			out[0].base = p_obj;
+			out[0].len  = sizeof(hdr) + config->p_obj->len;
 	#if (PRINT_ENC_CTX == 1)
 			NRF_LOG_RAW_INFO("Plain text:\n");
-			NRF_LOG_RAW_HEXDUMP_INFO((uint8_t*)p_obj, evt_len);
+			NRF_LOG_RAW_HEXDUMP_INFO(hdr, sizeof(hdr));
+			NRF_LOG_RAW_HEXDUMP_INFO(config->p_obj->val, config->p_obj->len);
 			NRF_LOG_RAW_INFO("Nonce:\n");
 			NRF_LOG_RAW_HEXDUMP_INFO(&beacon_nonce, 12);
 			NRF_LOG_RAW_INFO("Key:\n");
 			NRF_LOG_RAW_HEXDUMP_INFO(beacon_key, 16);
 	#endif
-			aes_ccm_encrypt_and_tag(beacon_key,
+			/* random part of the nonce, then the MIC right behind it */
+			memcpy(output, beacon_nonce.rand, 3);
+			mbedtls_ccm_encrypt_and_tag_iov(&beacon_ccm,
 	                (uint8_t*)&beacon_nonce, sizeof(beacon_nonce),
 	                                   &aad, sizeof(aad),
-	                        (uint8_t*)p_obj, evt_len,
-	                        (uint8_t*)p_obj,
-	                                    mic, 4);
-
-			memcpy(output, beacon_nonce.rand, 3);
-			output += 3;
+	                                     in, 2,
+	                                    out, 1,
+	                             output + 3, 4);
 
-			memcpy(output, mic, sizeof(mic));
-			*output_len += 3 + sizeof(mic);
+			*output_len += 3 + 4;
 	#if (PRINT_ENC_CTX == 1)
 			NRF_LOG_RAW_INFO("Cipher:\n");
-			NRF_LOG_RAW_HEXDUMP_INFO((uint8_t*)p_obj, evt_len);
+			NRF_LOG_RAW_HEXDUMP_INFO((uint8_t*)p_obj, out[0].len);
 			NRF_LOG_RAW_INFO("MIC:\n");
-			NRF_LOG_RAW_HEXDUMP_INFO((uint8_t*)mic, 4);
+			NRF_LOG_RAW_HEXDUMP_INFO(output + 3, 4);
 	#endif
 		} else {
 			p_frame_ctrl->is_encrypt = 0;
+			if (config->p_obj != NULL)
+				event_encode(config->p_obj, (uint8_t*)p_obj);
 			return MI_ERROR_NOT_INIT;
 		}
 	}
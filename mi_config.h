@@ -8,6 +8,44 @@
 #define BLE_COMPANY_ID_XIAOMI  0x038F
 #define BLE_SDK_AND_USER_VERSION    "2.0.0_0001"
 
+/* Number of connections with a session at the same time (owner and shared
+ * user). Costs about 700 bytes of RAM each. */
+#ifndef MI_CRYPTO_SESSION_MAX
+#define MI_CRYPTO_SESSION_MAX  2
+#endif
+
+/* Number of session nonces with precomputed keystream, 0 to disable.
+ * Costs 36 bytes of RAM each, per session. */
+#ifndef MI_CRYPTO_KS_POOL
+#define MI_CRYPTO_KS_POOL      0
+#endif
+
+/* Phases kept of the last handshake and handshakes in the statistics of the
+ * diagnostics characteristic (mi_metrics.h). Cost 24 bytes of RAM per phase
+ * and 28 per handshake. The characteristic is 104 + 12 * MI_METRICS_PHASE_MAX
+ * bytes, at most 512. */
+#ifndef MI_METRICS_PHASE_MAX
+#define MI_METRICS_PHASE_MAX   20
+#endif
+
+#ifndef MI_METRICS_HISTORY
+#define MI_METRICS_HISTORY     8
+#endif
+
+/* Adds the diagnostics characteristic. It is readable on any link, unpaired
+ * included, and tells when each login and crypto phase ran, so it is for
+ * development builds only. */
+#ifndef MI_METRICS_DIAG
+#define MI_METRICS_DIAG        0
+#endif
+
+/* Shared login signature made once instead of on every shared login:
+ * 0 off, 1 kept in RAM and made at each boot, 2 also kept in flash. Costs
+ * 100 bytes of RAM. */
+#ifndef MI_SHARED_PRESIGN
+#define MI_SHARED_PRESIGN      0
+#endif
+
 #endif  /* __MI_CONFIG_H__ */ 
 
 
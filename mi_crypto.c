@@ -1,12 +1,15 @@
 #include <string.h>
+#include <stddef.h>
 
 #define NRF_LOG_MODULE_NAME "CRYP"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
 
 #include "mi_type.h"
+#include "mi_config.h"
 #include "mi_crypto.h"
 #include "ccm.h"
+#include "ccm_fixed.h"
 
 typedef struct { 
 	uint8_t   iv[4];
@@ -14,17 +17,244 @@ typedef struct {
 	uint32_t  counter;
 } session_nonce_t;
 
-static struct {
-	uint8_t initialized :1;
-	uint8_t encrypting  :1;
-	uint8_t decrypting  :1;
-	uint8_t pending     :1;
-	uint8_t processing  :1;
-} m_flags;
+/* The fixed message shapes: lock state and lock opcode (1 byte), lock log (10 bytes). */
+CCM_FIXED_DEFINE(session_ccm1,  sizeof(session_nonce_t), 0,  1, 4)
+CCM_FIXED_DEFINE(session_ccm10, sizeof(session_nonce_t), 0, 10, 4)
+
+#define NONCE_CNT_OFFSET    offsetof(session_nonce_t, counter)
+
+#if MI_CRYPTO_KS_POOL
+/* S_0 and S_1 of one nonce, enough for a notification of up to 16 bytes. */
+#define KS_POOL_BLOCKS  2
+#endif
+
+/* The session of one connection, everything mi_session_encrypt/decrypt touch. */
+typedef struct {
+	/* Encryption and decryption, each held by one context at a time. */
+	struct {
+		volatile uint8_t busy;
+		mi_session_op_t *head;      /* submitted while busy */
+		mi_session_op_t *tail;
+	} dir[2];
+
+	/*
+	 * An init / uninit that found a direction held, done by the context that
+	 * lets go of the last one (see session_teardown()). These and dir[]
+	 * outlive session_wipe().
+	 */
+	volatile uint8_t teardown;      /* bumped by each init / uninit, 0 if none */
+	uint8_t          rekey;         /* start rekey_ctx once torn down */
+	session_ctx_t    rekey_ctx;
+
+	uint8_t   in_use;               /* session_wipe() clears from here on */
+	uint8_t   epoch;            /* changes on every init / uninit */
+	uint16_t  conn_handle;
+	uint8_t   dev_iv[4];
+	uint8_t   app_iv[4];
+	uint32_t  dev_cnt;
+	uint32_t  app_cnt;          /* highest app counter accepted */
+	uint64_t  app_seen;         /* bit k: app_cnt - k accepted */
+	mbedtls_ccm_context dev_ccm;
+	mbedtls_ccm_context app_ccm;
+
+	/* B_0 / A_0 templates of the session keys, only the nonce counter changes. */
+	struct {
+		mbedtls_ccm_fixed dev1;
+		mbedtls_ccm_fixed dev10;
+		mbedtls_ccm_fixed app1;
+	} tmpl;
+
+#if MI_CRYPTO_KS_POOL
+	/* Slot (cnt % MI_CRYPTO_KS_POOL) holds the keystream of nonce counter cnt. */
+	struct {
+		uint32_t cnt[MI_CRYPTO_KS_POOL];
+		uint8_t  ks[MI_CRYPTO_KS_POOL][KS_POOL_BLOCKS * 16];
+	} ks_pool;
+#endif
+} mi_session_t;
+
+static mi_session_t sessions[MI_CRYPTO_SESSION_MAX];
+
+#ifdef M_TEST
+/* Stands for an interrupt preempting the holder of a direction. */
+static void (*test_preempt)(uint16_t conn_handle, mi_session_dir_t dir);
+#define TEST_PREEMPT(p_sess, d) \
+	do { if (test_preempt != NULL) test_preempt((p_sess)->conn_handle, d); } while (0)
+/* Stands for an interrupt between the lookup of a session and taking a direction. */
+static void (*test_lookup)(uint16_t conn_handle);
+#define TEST_LOOKUP(conn_handle) \
+	do { if (test_lookup != NULL) test_lookup(conn_handle); } while (0)
+#else
+#define TEST_PREEMPT(p_sess, d)
+#define TEST_LOOKUP(conn_handle)
+#endif
+
+static int session_encrypt(mi_session_t *p_sess, const uint8_t *input, uint8_t len, uint8_t *output);
+static int session_decrypt(mi_session_t *p_sess, const uint8_t *input, uint8_t len, uint8_t *output);
+
+static void secure_wipe(void *p_buf, uint16_t n)
+{
+	volatile uint8_t *p = p_buf;
+	while (n--) *p++ = 0;
+}
+
+/* Everything but the locks and queues, which other contexts may be using. */
+static void session_wipe(mi_session_t *p_sess)
+{
+	secure_wipe(&p_sess->in_use, sizeof(mi_session_t) - offsetof(mi_session_t, in_use));
+}
+
+/*
+ * A session lives in slot (conn_handle % MI_CRYPTO_SESSION_MAX), or in the
+ * next free one after it. The SoftDevice hands out handles from 0 up, so with
+ * no more links than slots every lookup hits at the first probe.
+ */
+static mi_session_t *session_find(uint16_t conn_handle)
+{
+	mi_session_t *p = &sessions[conn_handle % MI_CRYPTO_SESSION_MAX];
+	uint8_t i;
+
+	for (i = 0; i < MI_CRYPTO_SESSION_MAX; i++) {
+		if (p->in_use && p->conn_handle == conn_handle)
+			return p;
+		if (++p == sessions + MI_CRYPTO_SESSION_MAX)
+			p = sessions;
+	}
+
+	return NULL;
+}
+
+/* The session of the link, also while an init / uninit of it waits. */
+static mi_session_t *session_find_any(uint16_t conn_handle)
+{
+	mi_session_t *p = session_find(conn_handle);
+	uint8_t i;
+
+	for (i = 0; p == NULL && i < MI_CRYPTO_SESSION_MAX; i++)
+		if (sessions[i].teardown && sessions[i].conn_handle == conn_handle)
+			p = &sessions[i];
+
+	return p;
+}
+
+static mi_session_t *session_alloc(uint16_t conn_handle)
+{
+	mi_session_t *p = session_find_any(conn_handle);
+	uint8_t i;
+
+	if (p != NULL)
+		return p;
+
+	p = &sessions[conn_handle % MI_CRYPTO_SESSION_MAX];
+	for (i = 0; i < MI_CRYPTO_SESSION_MAX; i++) {
+		if (!p->in_use && !p->teardown)
+			return p;
+		if (++p == sessions + MI_CRYPTO_SESSION_MAX)
+			p = sessions;
+	}
+
+	return NULL;
+}
+
+/*
+ * Submission queues
+ *
+ * The context that sets busy holds the direction until it clears it again,
+ * and before that runs whatever was submitted meanwhile. The nRF51 has no
+ * LDREX/STREX, so the few instructions on busy and the queue run in a
+ * critical region; the crypto itself never does.
+ *
+ * The slot may have been ended, or given to another link, since the lookup,
+ * so that is checked along with busy. Returns 0 with the direction held, 1 if
+ * conn_handle has no session in the slot, 2 if the direction is held.
+ */
+static int dir_acquire(mi_session_t *p_sess, uint16_t conn_handle, mi_session_dir_t dir)
+{
+	int ret = 2;
+
+	CRITICAL_REGION_ENTER();
+	if (p_sess->in_use != 1 || p_sess->conn_handle != conn_handle) {
+		ret = 1;
+	} else if (p_sess->dir[dir].busy == 0 && p_sess->teardown == 0) {
+		p_sess->dir[dir].busy = 1;
+		ret = 0;
+	}
+	CRITICAL_REGION_EXIT();
+
+	return ret;
+}
+
+static mi_session_op_t *dir_pop(mi_session_t *p_sess, mi_session_dir_t dir)
+{
+	mi_session_op_t *p_op;
+
+	CRITICAL_REGION_ENTER();
+	p_op = p_sess->dir[dir].head;
+	if (p_op != NULL) {
+		p_sess->dir[dir].head = p_op->p_next;
+		if (p_op->p_next == NULL)
+			p_sess->dir[dir].tail = NULL;
+	}
+	CRITICAL_REGION_EXIT();
+
+	return p_op;
+}
 
-static uint32_t  session_dev_cnt;
-static uint32_t  session_app_cnt;
-static session_ctx_t session_ctx;
+static void op_complete(mi_session_op_t *p_op, int result)
+{
+	p_op->result  = result;
+	p_op->pending = 0;
+	if (p_op->handler != NULL)
+		p_op->handler(p_op);
+}
+
+static void session_teardown(mi_session_t *p_sess);
+
+/* Runs the queue of a direction the caller holds, then lets go of it. */
+static void dir_release(mi_session_t *p_sess, mi_session_dir_t dir)
+{
+	mi_session_op_t *p_op;
+	uint8_t last = 0;
+
+	do {
+		while ((p_op = dir_pop(p_sess, dir)) != NULL) {
+			if (p_sess->teardown)
+				op_complete(p_op, 1);
+			else if (dir == MI_SESSION_ENCRYPT)
+				op_complete(p_op, session_encrypt(p_sess, p_op->input, p_op->len, p_op->output));
+			else
+				op_complete(p_op, session_decrypt(p_sess, p_op->input, p_op->len, p_op->output));
+		}
+		TEST_PREEMPT(p_sess, dir);
+
+		/* the last one out does an init / uninit that came meanwhile */
+		CRITICAL_REGION_ENTER();
+		if (p_sess->teardown && !p_sess->dir[dir ^ 1].busy) {
+			p_sess->dir[dir ^ 1].busy = 1;
+			last = 1;
+		} else {
+			p_sess->dir[dir].busy = 0;
+		}
+		CRITICAL_REGION_EXIT();
+
+		if (last) {
+			session_teardown(p_sess);
+			return;
+		}
+		/* one submitted between the last pop and here found us still busy */
+	} while (p_sess->dir[dir].head != NULL && dir_acquire(p_sess, p_sess->conn_handle, dir) == 0);
+}
+
+/* Completes what is queued on a session that goes away. */
+static void session_flush(mi_session_t *p_sess)
+{
+	mi_session_op_t *p_op;
+
+	while ((p_op = dir_pop(p_sess, MI_SESSION_ENCRYPT)) != NULL)
+		op_complete(p_op, 1);
+	while ((p_op = dir_pop(p_sess, MI_SESSION_DECRYPT)) != NULL)
+		op_complete(p_op, 1);
+}
 
 static int update_cnt(uint32_t* p_cnt, uint16_t cnt_low)
 {
@@ -38,87 +268,827 @@ static int update_cnt(uint32_t* p_cnt, uint16_t cnt_low)
 	return 0;
 }
 
-int mi_crypto_init(session_ctx_t *p_ctx)
+/*
+ * Replay window
+ *
+ * The app counter on the wire is the low 16 bits; it is taken as the full
+ * counter nearest to the highest one accepted so far. Counters up to
+ * MI_CRYPTO_REPLAY_WINDOW - 1 behind that one may still come in, once each,
+ * so a client can have several writes in flight. The window only moves once
+ * the MIC of a message has checked out.
+ */
+#define MI_CRYPTO_REPLAY_WINDOW     64
+
+static int replay_check(const mi_session_t *p_sess, uint16_t cnt_low, uint32_t *p_cnt)
 {
-	if (p_ctx == NULL)
+	int16_t  diff = (int16_t)(cnt_low - (uint16_t)p_sess->app_cnt);
+	uint32_t back;
+
+	if (diff < 0 && (uint32_t)-diff > p_sess->app_cnt)
 		return 1;
 
-	session_ctx = *p_ctx;
-	session_app_cnt = 0;
-	session_dev_cnt = 0;
+	*p_cnt = p_sess->app_cnt + diff;
+	if (diff > 0)
+		return 0;
+
+	back = (uint32_t)-diff;
+	if (back >= MI_CRYPTO_REPLAY_WINDOW || (p_sess->app_seen >> back & 1))
+		return 1;
 
-	m_flags.initialized = 1;
 	return 0;
 }
 
-int mi_crypto_uninit(void)
+static void replay_accept(mi_session_t *p_sess, uint32_t cnt)
 {
-	m_flags.initialized = 0;
-	return 0;
+	uint32_t shift;
+
+	if (cnt > p_sess->app_cnt) {
+		shift = cnt - p_sess->app_cnt;
+		p_sess->app_seen = shift < MI_CRYPTO_REPLAY_WINDOW ? p_sess->app_seen << shift : 0;
+		p_sess->app_cnt  = cnt;
+		p_sess->app_seen |= 1;
+	} else {
+		p_sess->app_seen |= (uint64_t)1 << (p_sess->app_cnt - cnt);
+	}
 }
 
+#if MI_CRYPTO_KS_POOL
+static uint32_t next_dev_cnt(uint32_t cnt)
+{
+	uint16_t cnt_low = (uint16_t)cnt;
+	update_cnt(&cnt, ++cnt_low);
+	return cnt;
+}
+#endif
 
-int mi_session_encrypt(const uint8_t *input, uint8_t len, uint8_t *output)
+/* Sets up the session keys, with both directions held. */
+static void session_start(mi_session_t *p_sess, uint16_t conn_handle, const session_ctx_t *p_ctx)
 {
-	uint32_t ret = 0;
+	session_nonce_t nonce = {0};
 
-	if (m_flags.initialized != 1)
-		return 1;
+	p_sess->conn_handle = conn_handle;
+
+	mbedtls_ccm_setkey(&p_sess->dev_ccm, p_ctx->dev_key);
+	mbedtls_ccm_setkey(&p_sess->app_ccm, p_ctx->app_key);
+	memcpy(p_sess->dev_iv, p_ctx->dev_iv, sizeof(p_sess->dev_iv));
+	memcpy(p_sess->app_iv, p_ctx->app_iv, sizeof(p_sess->app_iv));
+
+	memcpy(nonce.iv, p_ctx->dev_iv, sizeof(nonce.iv));
+	session_ccm1_template(&p_sess->tmpl.dev1, &nonce);
+	session_ccm10_template(&p_sess->tmpl.dev10, &nonce);
+	memcpy(nonce.iv, p_ctx->app_iv, sizeof(nonce.iv));
+	session_ccm1_template(&p_sess->tmpl.app1, &nonce);
+
+	p_sess->in_use = 1;
+}
+
+/*
+ * Ends the session and starts the one asked for last, if any. The caller
+ * holds both directions and lets go of them here, unless another init /
+ * uninit came meanwhile, which is then done as well.
+ */
+static void session_teardown(mi_session_t *p_sess)
+{
+	session_ctx_t ctx;
+	uint16_t conn_handle;
+	uint8_t  seen, rekey, epoch, done = 0;
+
+	do {
+		CRITICAL_REGION_ENTER();
+		seen        = p_sess->teardown;
+		rekey       = p_sess->rekey;
+		conn_handle = p_sess->conn_handle;
+		memcpy(&ctx, &p_sess->rekey_ctx, sizeof(ctx));
+		CRITICAL_REGION_EXIT();
+
+		/* A new session of the link replaces the old one, keystream included. */
+		epoch = p_sess->epoch + 1;
+		session_flush(p_sess);
+		mbedtls_ccm_free(&p_sess->dev_ccm);
+		mbedtls_ccm_free(&p_sess->app_ccm);
+		session_wipe(p_sess);
+		p_sess->epoch = epoch;
+		p_sess->conn_handle = conn_handle;
+		if (rekey)
+			session_start(p_sess, conn_handle, &ctx);
+
+		CRITICAL_REGION_ENTER();
+		if (p_sess->teardown == seen) {
+			p_sess->teardown = 0;
+			p_sess->rekey    = 0;
+			secure_wipe(&p_sess->rekey_ctx, sizeof(p_sess->rekey_ctx));
+			p_sess->dir[MI_SESSION_ENCRYPT].busy = 0;
+			p_sess->dir[MI_SESSION_DECRYPT].busy = 0;
+			done = 1;
+		}
+		CRITICAL_REGION_EXIT();
+	} while (!done);
+
+	secure_wipe(&ctx, sizeof(ctx));
+}
+
+/*
+ * Ends the session, then starts p_ctx on conn_handle if not NULL. It is done
+ * right away if both directions are free, else by the context holding the
+ * last one as it lets go; the session takes nothing new meanwhile.
+ */
+static void session_request(mi_session_t *p_sess, uint16_t conn_handle, const session_ctx_t *p_ctx)
+{
+	uint8_t now = 0;
 
 	CRITICAL_REGION_ENTER();
-	if (m_flags.processing == 1)
-		ret = 2;
-	else
-		m_flags.processing = 1;
+	p_sess->in_use = 0;
+	p_sess->rekey  = p_ctx != NULL;
+	if (p_ctx != NULL) {
+		p_sess->conn_handle = conn_handle;
+		memcpy(&p_sess->rekey_ctx, p_ctx, sizeof(p_sess->rekey_ctx));
+	}
+	if (++p_sess->teardown == 0)
+		p_sess->teardown = 1;
+	if (!p_sess->dir[MI_SESSION_ENCRYPT].busy && !p_sess->dir[MI_SESSION_DECRYPT].busy) {
+		p_sess->dir[MI_SESSION_ENCRYPT].busy = 1;
+		p_sess->dir[MI_SESSION_DECRYPT].busy = 1;
+		now = 1;
+	}
 	CRITICAL_REGION_EXIT();
 
-	if (ret)
-		return ret;
+	if (now)
+		session_teardown(p_sess);
+}
 
-	uint8_t tmp[len];
-	memcpy(tmp, input, len);
-	
+int mi_crypto_init(uint16_t conn_handle, session_ctx_t *p_ctx)
+{
+	mi_session_t *p_sess;
+
+	if (p_ctx == NULL)
+		return 1;
+
+	p_sess = session_alloc(conn_handle);
+	if (p_sess == NULL)
+		return 2;
+
+	session_request(p_sess, conn_handle, p_ctx);
+	return 0;
+}
+
+int mi_crypto_uninit(uint16_t conn_handle)
+{
+	mi_session_t *p_sess = session_find_any(conn_handle);
+
+	if (p_sess == NULL)
+		return 1;
+
+	session_request(p_sess, conn_handle, NULL);
+	return 0;
+}
+
+#if MI_CRYPTO_KS_POOL
+static int session_ks_refill(mi_session_t *p_sess)
+{
 	session_nonce_t nonce = {0};
-	memcpy(nonce.iv, session_ctx.dev_iv, sizeof(nonce.iv));
-	uint16_t cnt_low = (uint16_t)session_dev_cnt;
-	update_cnt(&session_dev_cnt, ++cnt_low);
-	nonce.counter = session_dev_cnt;
+	uint8_t  ks[KS_POOL_BLOCKS * 16];
+	uint32_t cnt, slot;
+	uint8_t  i, epoch, filled = 0;
+
+	epoch = p_sess->epoch;
+	memcpy(nonce.iv, p_sess->dev_iv, sizeof(nonce.iv));
+	cnt = p_sess->dev_cnt;
+
+	/*
+	 * The dev_ccm context is shared with encryption (the SoftDevice backend
+	 * keeps its ECB block in it), so hold the direction for one slot at a
+	 * time; encryptions submitted meanwhile run in between.
+	 */
+	for (i = 0; i < MI_CRYPTO_KS_POOL; i++) {
+		if (dir_acquire(p_sess, p_sess->conn_handle, MI_SESSION_ENCRYPT) != 0)
+			break;
+
+		cnt  = next_dev_cnt(cnt);
+		slot = cnt % MI_CRYPTO_KS_POOL;
+		if (p_sess->ks_pool.cnt[slot] != cnt) {
+			nonce.counter = cnt;
+			mbedtls_ccm_keystream(&p_sess->dev_ccm, (void*)&nonce, sizeof(nonce), ks, KS_POOL_BLOCKS);
+			TEST_PREEMPT(p_sess, MI_SESSION_ENCRYPT);
+
+			/* A new session may preempt us, publish the slot in one piece. */
+			CRITICAL_REGION_ENTER();
+			if (p_sess->in_use == 1 && p_sess->epoch == epoch && cnt > p_sess->dev_cnt) {
+				memcpy(p_sess->ks_pool.ks[slot], ks, sizeof(ks));
+				p_sess->ks_pool.cnt[slot] = cnt;
+				filled++;
+			}
+			CRITICAL_REGION_EXIT();
+		}
+
+		dir_release(p_sess, MI_SESSION_ENCRYPT);
+	}
+
+	memset(ks, 0, sizeof(ks));
+	return filled;
+}
+#endif
+
+int mi_crypto_ks_refill(void)
+{
+	int filled = 0;
+#if MI_CRYPTO_KS_POOL
+	uint8_t i;
+
+	for (i = 0; i < MI_CRYPTO_SESSION_MAX; i++)
+		if (sessions[i].in_use == 1)
+			filled += session_ks_refill(&sessions[i]);
+#endif
+	return filled;
+}
+
+/* Both run with their direction held. */
+static int session_encrypt(mi_session_t *p_sess, const uint8_t *input, uint8_t len, uint8_t *output)
+{
+	/* Encrypted straight into output; a caller reusing its buffer is moved in place first. */
+	if (input != output + 2 && input < output + 2 + len && output + 2 < input + len) {
+		memmove(output + 2, input, len);
+		input = output + 2;
+	}
+
+	session_nonce_t nonce = {0};
+	memcpy(nonce.iv, p_sess->dev_iv, sizeof(nonce.iv));
+	uint16_t cnt_low = (uint16_t)p_sess->dev_cnt;
+	update_cnt(&p_sess->dev_cnt, ++cnt_low);
+	nonce.counter = p_sess->dev_cnt;
+	TEST_PREEMPT(p_sess, MI_SESSION_ENCRYPT);
 	
-	aes_ccm_encrypt_and_tag(session_ctx.dev_key, (void*)&nonce, sizeof(nonce), NULL, 0,
-	                        tmp, len, 2+output, 2+output+len, 4);
+#if MI_CRYPTO_KS_POOL
+	uint32_t slot = p_sess->dev_cnt % MI_CRYPTO_KS_POOL;
+	if (len <= 16 && p_sess->ks_pool.cnt[slot] == p_sess->dev_cnt) {
+		mbedtls_ccm_encrypt_and_tag_ks(&p_sess->dev_ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+		                               input, len, 2+output, 2+output+len, 4,
+		                               p_sess->ks_pool.ks[slot]);
+		p_sess->ks_pool.cnt[slot] = 0;
+		memset(p_sess->ks_pool.ks[slot], 0, sizeof(p_sess->ks_pool.ks[slot]));
+	}
+	else
+#endif
+	if (len == 1) {
+		mbedtls_ccm_fixed_nonce(&p_sess->tmpl.dev1, NONCE_CNT_OFFSET, &nonce.counter, 4);
+		session_ccm1_encrypt(&p_sess->dev_ccm, &p_sess->tmpl.dev1, NULL,
+		                     input, 2+output, 2+output+len);
+	}
+	else if (len == 10) {
+		mbedtls_ccm_fixed_nonce(&p_sess->tmpl.dev10, NONCE_CNT_OFFSET, &nonce.counter, 4);
+		session_ccm10_encrypt(&p_sess->dev_ccm, &p_sess->tmpl.dev10, NULL,
+		                      input, 2+output, 2+output+len);
+	}
+	else
+	mbedtls_ccm_encrypt_and_tag(&p_sess->dev_ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+	                            input, len, 2+output, 2+output+len, 4);
 
-	*(uint16_t*)output = session_dev_cnt;
+	*(uint16_t*)output = p_sess->dev_cnt;
 
-	m_flags.processing = 0;
 	return 0;
 }
 
-int mi_session_decrypt(const uint8_t *input, uint8_t len, uint8_t *output)
+static int session_decrypt(mi_session_t *p_sess, const uint8_t *input, uint8_t len, uint8_t *output)
+{
+	int ret;
+
+	session_nonce_t nonce = {0};
+	memcpy(nonce.iv, p_sess->app_iv, sizeof(nonce.iv));
+	uint16_t cnt_low = input[1]<<8 | input[0];
+	if (replay_check(p_sess, cnt_low, &nonce.counter))
+		return 3;
+	TEST_PREEMPT(p_sess, MI_SESSION_DECRYPT);
+
+	if (len == 1 + 6) {
+		mbedtls_ccm_fixed_nonce(&p_sess->tmpl.app1, NONCE_CNT_OFFSET, &nonce.counter, 4);
+		ret = session_ccm1_auth_decrypt(&p_sess->app_ccm, &p_sess->tmpl.app1, NULL,
+		                                2+input, output, 2+input+1);
+	}
+	else
+	ret = mbedtls_ccm_auth_decrypt(&p_sess->app_ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+	                               2+input, len-6, output, 2+input+len-6, 4);
+
+	if (ret == 0)
+		replay_accept(p_sess, nonce.counter);
+
+	return ret;
+}
+
+int mi_session_encrypt(uint16_t conn_handle, const uint8_t *input, uint8_t len, uint8_t *output)
+{
+	mi_session_t *p_sess = session_find(conn_handle);
+	int ret;
+
+	if (p_sess == NULL)
+		return 1;
+	TEST_LOOKUP(conn_handle);
+
+	ret = dir_acquire(p_sess, conn_handle, MI_SESSION_ENCRYPT);
+	if (ret != 0)
+		return ret;
+
+	ret = session_encrypt(p_sess, input, len, output);
+	dir_release(p_sess, MI_SESSION_ENCRYPT);
+
+	return ret;
+}
+
+int mi_session_decrypt(uint16_t conn_handle, const uint8_t *input, uint8_t len, uint8_t *output)
+{
+	mi_session_t *p_sess = session_find(conn_handle);
+	int ret;
+
+	if (p_sess == NULL)
+		return 1;
+	TEST_LOOKUP(conn_handle);
+
+	ret = dir_acquire(p_sess, conn_handle, MI_SESSION_DECRYPT);
+	if (ret != 0)
+		return ret;
+
+	ret = session_decrypt(p_sess, input, len, output);
+	dir_release(p_sess, MI_SESSION_DECRYPT);
+
+	return ret;
+}
+
+int mi_session_submit(mi_session_op_t *p_op)
 {
-	uint32_t ret = 0;
+	mi_session_t *p_sess = session_find(p_op->conn_handle);
+	int ret = 0;
 
-	if (m_flags.initialized != 1)
+	if (p_sess == NULL)
 		return 1;
 
+	/* The session may have ended since the lookup. */
 	CRITICAL_REGION_ENTER();
-	if (m_flags.processing == 1)
+	if (p_op->pending) {
 		ret = 2;
-	else
-		m_flags.processing = 1;
+	} else if (p_sess->in_use != 1 || p_sess->conn_handle != p_op->conn_handle) {
+		ret = 1;
+	} else {
+		p_op->pending = 1;
+		p_op->p_next  = NULL;
+		if (p_sess->dir[p_op->dir].tail != NULL)
+			p_sess->dir[p_op->dir].tail->p_next = p_op;
+		else
+			p_sess->dir[p_op->dir].head = p_op;
+		p_sess->dir[p_op->dir].tail = p_op;
+	}
 	CRITICAL_REGION_EXIT();
 
-	if (ret)
-		return ret;
-	
+	if (ret == 0 && dir_acquire(p_sess, p_op->conn_handle, p_op->dir) == 0)
+		dir_release(p_sess, p_op->dir);
+
+	return ret;
+}
+
+#ifdef M_TEST
+static const uint8_t test_len[] = {1, 10, 4, 16, 14};
+
+/* A write of the phone: app counter cnt, plain -> cipher. */
+static void test_write(const session_ctx_t *p_ctx, uint32_t cnt,
+                       const uint8_t *plain, uint8_t len, uint8_t *cipher)
+{
 	session_nonce_t nonce = {0};
-	memcpy(nonce.iv, session_ctx.app_iv, sizeof(nonce.iv));
-	uint16_t cnt_low = input[1]<<8 | input[0];
-	update_cnt(&session_app_cnt, cnt_low);
-	nonce.counter = session_app_cnt;
+	mbedtls_ccm_context ccm;
 
-	ret = aes_ccm_auth_decrypt(session_ctx.app_key, (void*)&nonce, sizeof(nonce), NULL, 0,
-	                           2+input, len-6, output, 2+input+len-6, 4);
+	memcpy(nonce.iv, p_ctx->app_iv, sizeof(nonce.iv));
+	nonce.counter = cnt;
+	cipher[0] = (uint8_t)cnt;
+	cipher[1] = (uint8_t)(cnt >> 8);
 
-	m_flags.processing = 0;
-	return ret;
+	mbedtls_ccm_init(&ccm);
+	mbedtls_ccm_setkey(&ccm, p_ctx->app_key);
+	mbedtls_ccm_encrypt_and_tag(&ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+	                            plain, len, cipher + 2, cipher + 2 + len, 4);
+	mbedtls_ccm_free(&ccm);
+}
+
+/*
+ * Stress: the main loop encrypts and decrypts while "interrupts" (the
+ * TEST_PREEMPT points, inside an operation and in the window before a
+ * direction is let go) submit one operation of each direction, and some
+ * decrypt handlers submit an encryption in turn, as an echo would. Every
+ * operation must complete, each in a slot of its own.
+ */
+#define STRESS_OPS  16
+
+static struct {
+	const session_ctx_t *p_ctx;
+	uint16_t        conn;
+	uint8_t         irq;
+	uint8_t         tick;
+	uint8_t         n;          /* ops used */
+	uint8_t         done;       /* ops completed */
+	uint32_t        app_cnt;
+	int             failed;
+	mi_session_op_t op[STRESS_OPS];
+	uint8_t         buf[STRESS_OPS][16 + 6];
+	uint8_t         out[STRESS_OPS][16];
+} stress;
+
+static void stress_plain(uint8_t k, uint8_t *p, uint8_t len)
+{
+	while (len--)
+		p[len] = k * 7 + len;
+}
+
+static void stress_handler(mi_session_op_t *p_op);
+
+/* Encrypts in place in buf, decrypts from buf to out. */
+static mi_session_op_t *stress_op(mi_session_dir_t dir)
+{
+	uint8_t k = stress.n++;
+	mi_session_op_t *p_op = &stress.op[k];
+	uint8_t len = test_len[k % sizeof(test_len)];
+
+	memset(p_op, 0, sizeof(*p_op));
+	p_op->conn_handle = stress.conn;
+	p_op->dir     = dir;
+	p_op->handler = stress_handler;
+	if (dir == MI_SESSION_ENCRYPT) {
+		stress_plain(k, stress.buf[k] + 2, len);
+		p_op->input  = stress.buf[k] + 2;
+		p_op->len    = len;
+		p_op->output = stress.buf[k];
+	} else {
+		stress_plain(k, stress.out[k], len);
+		test_write(stress.p_ctx, stress.app_cnt++, stress.out[k], len, stress.buf[k]);
+		memset(stress.out[k], 0, len);
+		p_op->input  = stress.buf[k];
+		p_op->len    = len + 6;
+		p_op->output = stress.out[k];
+	}
+
+	return p_op;
+}
+
+static void stress_handler(mi_session_op_t *p_op)
+{
+	stress.done++;
+	if (p_op->dir == MI_SESSION_DECRYPT && (p_op - stress.op) % 4 == 1 &&
+	    stress.n < STRESS_OPS)
+		stress.failed += mi_session_submit(stress_op(MI_SESSION_ENCRYPT)) != 0;
+}
+
+static void stress_preempt(uint16_t conn_handle, mi_session_dir_t dir)
+{
+	uint8_t tmp[1 + 6] = {0};
+
+	/* every third point, so that all of them get hit */
+	if (conn_handle != stress.conn || stress.irq || stress.n + 3 > STRESS_OPS ||
+	    stress.tick++ % 3 != 2)
+		return;
+
+	stress.irq = 1;
+	stress.failed += mi_session_submit(stress_op(MI_SESSION_ENCRYPT)) != 0;
+	stress.failed += mi_session_submit(stress_op(MI_SESSION_DECRYPT)) != 0;
+	/* the blocking call on the held direction refuses instead of interleaving */
+	if (dir == MI_SESSION_ENCRYPT)
+		stress.failed += mi_session_encrypt(stress.conn, tmp, 1, tmp) != 2;
+	else
+		stress.failed += mi_session_decrypt(stress.conn, tmp, 1 + 6, tmp) != 2;
+	stress.irq = 0;
+}
+
+/* Back in the main loop, nothing may be left waiting. */
+static int stress_pending(void)
+{
+	uint8_t k;
+	int n = 0;
+
+	for (k = 0; k < stress.n; k++)
+		n += stress.op[k].pending;
+
+	return n;
+}
+
+static int stress_test(const session_ctx_t *p_ctx, uint16_t conn, uint32_t dev_cnt)
+{
+	session_nonce_t nonce = {0};
+	mbedtls_ccm_context ccm;
+	mi_session_op_t *p_op;
+	uint8_t plain[16], out[16];
+	uint32_t seen = 0, cnt;
+	uint8_t k, n_enc = 0;
+	int failed = 0;
+
+	memset(&stress, 0, sizeof(stress));
+	stress.p_ctx   = p_ctx;
+	stress.conn    = conn;
+	stress.app_cnt = 1000;
+	test_preempt   = stress_preempt;
+
+	for (k = 0; stress.n + 4 <= STRESS_OPS; k++) {
+		p_op = stress_op(k & 1 ? MI_SESSION_DECRYPT : MI_SESSION_ENCRYPT);
+		if (k % 3 == 2) {
+			failed += mi_session_submit(p_op) != 0;
+			failed += stress_pending();
+			mi_crypto_ks_refill();
+		} else {
+			if (p_op->dir == MI_SESSION_ENCRYPT)
+				p_op->result = mi_session_encrypt(conn, p_op->input, p_op->len, p_op->output);
+			else
+				p_op->result = mi_session_decrypt(conn, p_op->input, p_op->len, p_op->output);
+			stress_handler(p_op);
+		}
+		failed += stress_pending();
+	}
+	test_preempt = NULL;
+
+	failed += stress.failed;
+	failed += stress.done != stress.n;
+
+	mbedtls_ccm_init(&ccm);
+	mbedtls_ccm_setkey(&ccm, p_ctx->dev_key);
+	memcpy(nonce.iv, p_ctx->dev_iv, sizeof(nonce.iv));
+	for (k = 0; k < stress.n; k++) {
+		p_op = &stress.op[k];
+		failed += p_op->pending || p_op->result != 0;
+		if (p_op->dir == MI_SESSION_DECRYPT) {
+			stress_plain(k, plain, p_op->len - 6);
+			failed += memcmp(p_op->output, plain, p_op->len - 6) != 0;
+			continue;
+		}
+
+		/* each notification on a counter of its own, none skipped */
+		n_enc++;
+		cnt = stress.buf[k][0] | stress.buf[k][1] << 8;
+		if (cnt <= dev_cnt || cnt > dev_cnt + STRESS_OPS || (seen >> (cnt - dev_cnt) & 1)) {
+			failed++;
+			continue;
+		}
+		seen |= 1UL << (cnt - dev_cnt);
+		nonce.counter = cnt;
+		stress_plain(k, plain, p_op->len);
+		failed += mbedtls_ccm_auth_decrypt(&ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+		                                   stress.buf[k] + 2, p_op->len, out,
+		                                   stress.buf[k] + 2 + p_op->len, 4) != 0;
+		failed += memcmp(out, plain, p_op->len) != 0;
+	}
+	mbedtls_ccm_free(&ccm);
+	failed += seen != ((1UL << n_enc) - 1) << 1;
+
+	return failed;
+}
+
+/*
+ * An init, then an uninit, from an "interrupt" inside an operation of the
+ * same link. The operation ends on the keys it started with, nothing gets in
+ * meanwhile, an op queued on the held direction completes with 1, and the new
+ * session starts from counter 1 once the main loop lets go.
+ */
+static struct {
+	uint16_t             conn;
+	const session_ctx_t *p_ctx;     /* NULL for an uninit */
+	uint8_t              hits;
+	int                  failed;
+	mi_session_op_t      op;
+	uint8_t              buf[1 + 6];
+} teardown;
+
+static void teardown_preempt(uint16_t conn_handle, mi_session_dir_t dir)
+{
+	uint8_t tmp[1 + 6] = {0};
+
+	if (conn_handle != teardown.conn || teardown.hits++ != 0)
+		return;
+
+	memset(&teardown.op, 0, sizeof(teardown.op));
+	teardown.op.conn_handle = teardown.conn;
+	teardown.op.dir    = dir;
+	teardown.op.input  = teardown.buf + 2;
+	teardown.op.len    = dir == MI_SESSION_ENCRYPT ? 1 : 1 + 6;
+	teardown.op.output = teardown.buf;
+	teardown.failed += mi_session_submit(&teardown.op) != 0;
+	teardown.failed += teardown.op.pending != 1;
+
+	if (teardown.p_ctx != NULL)
+		teardown.failed += mi_crypto_init(teardown.conn, (session_ctx_t *)teardown.p_ctx) != 0;
+	else
+		teardown.failed += mi_crypto_uninit(teardown.conn) != 0;
+
+	teardown.failed += mi_session_encrypt(teardown.conn, tmp, 1, tmp) != 1;
+	teardown.failed += mi_session_decrypt(teardown.conn, tmp, 1 + 6, tmp) != 1;
+	teardown.failed += teardown.op.pending != 1;
+}
+
+/* A notification of the session with p_ctx on counter cnt, plain as sent. */
+static int test_notify_check(const session_ctx_t *p_ctx, uint32_t cnt,
+                             const uint8_t *cipher, const uint8_t *plain, uint8_t len)
+{
+	session_nonce_t nonce = {0};
+	mbedtls_ccm_context ccm;
+	uint8_t out[16];
+	int failed = 0;
+
+	memcpy(nonce.iv, p_ctx->dev_iv, sizeof(nonce.iv));
+	nonce.counter = cnt;
+	failed += (cipher[0] | cipher[1] << 8) != (uint16_t)cnt;
+
+	mbedtls_ccm_init(&ccm);
+	mbedtls_ccm_setkey(&ccm, p_ctx->dev_key);
+	failed += mbedtls_ccm_auth_decrypt(&ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+	                                   cipher + 2, len, out, cipher + 2 + len, 4) != 0;
+	failed += memcmp(out, plain, len) != 0;
+	mbedtls_ccm_free(&ccm);
+
+	return failed;
+}
+
+static int teardown_test(const session_ctx_t *p_old, const session_ctx_t *p_new, uint16_t conn)
+{
+	uint8_t plain[4] = {1, 2, 3, 4}, cipher[4 + 6], out[4];
+	uint32_t cnt;
+	int failed = 0;
+
+	memset(&teardown, 0, sizeof(teardown));
+	teardown.conn  = conn;
+	teardown.p_ctx = p_new;
+	test_preempt   = teardown_preempt;
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 0;
+	test_preempt   = NULL;
+	failed += teardown.hits == 0 || teardown.failed;
+	failed += teardown.op.pending || teardown.op.result != 1;
+
+	/* the one under way on the old keys, then the new session from 1 */
+	cnt = cipher[0] | cipher[1] << 8;
+	failed += test_notify_check(p_old, cnt, cipher, plain, sizeof(plain));
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 0;
+	failed += test_notify_check(p_new, 1, cipher, plain, sizeof(plain));
+
+	teardown.hits  = 0;
+	teardown.p_ctx = NULL;
+	test_write(p_new, 1, plain, sizeof(plain), cipher);
+	test_preempt   = teardown_preempt;
+	failed += mi_session_decrypt(conn, cipher, sizeof(plain) + 6, out) != 0;
+	test_preempt   = NULL;
+	failed += teardown.hits == 0 || teardown.failed;
+	failed += teardown.op.pending || teardown.op.result != 1;
+	failed += memcmp(out, plain, sizeof(plain)) != 0;
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 1;
+
+	/* the slot is free again */
+	failed += mi_crypto_init(conn, (session_ctx_t *)p_old) != 0;
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 0;
+	failed += test_notify_check(p_old, 1, cipher, plain, sizeof(plain));
+
+	return failed;
+}
+
+/*
+ * An uninit, then an init of another link in the same slot, from an
+ * "interrupt" between the lookup of the session and taking the direction.
+ * The call finds no session and leaves the new one alone.
+ */
+static struct {
+	uint16_t             conn;
+	uint16_t             new_conn;
+	const session_ctx_t *p_ctx;
+	uint8_t              hits;
+	int                  failed;
+} lookup;
+
+static void lookup_preempt(uint16_t conn_handle)
+{
+	if (conn_handle != lookup.conn || lookup.hits++ != 0)
+		return;
+
+	lookup.failed += mi_crypto_uninit(lookup.conn) != 0;
+	lookup.failed += mi_crypto_init(lookup.new_conn, (session_ctx_t *)lookup.p_ctx) != 0;
+}
+
+static int lookup_test(const session_ctx_t *p_old, const session_ctx_t *p_new, uint16_t conn)
+{
+	uint16_t new_conn = conn + MI_CRYPTO_SESSION_MAX;
+	uint8_t plain[4] = {1, 2, 3, 4}, cipher[4 + 6], out[4];
+	mi_session_t *p_slot = session_find(conn);
+	int failed = 0;
+
+	memset(&lookup, 0, sizeof(lookup));
+	lookup.conn     = conn;
+	lookup.new_conn = new_conn;
+	lookup.p_ctx    = p_new;
+	memset(cipher, 0xA5, sizeof(cipher));
+	test_lookup = lookup_preempt;
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 1;
+	test_lookup = NULL;
+	failed += lookup.hits == 0 || lookup.failed;
+	failed += session_find(new_conn) != p_slot;
+	failed += cipher[0] != 0xA5 || cipher[1] != 0xA5;
+
+	/* the new link starts from counter 1 on its own keys */
+	failed += mi_session_encrypt(new_conn, plain, sizeof(plain), cipher) != 0;
+	failed += test_notify_check(p_new, 1, cipher, plain, sizeof(plain));
+
+	/* and back, on the decryption side */
+	memset(&lookup, 0, sizeof(lookup));
+	lookup.conn     = new_conn;
+	lookup.new_conn = conn;
+	lookup.p_ctx    = p_old;
+	test_write(p_new, 1, plain, sizeof(plain), cipher);
+	memset(out, 0, sizeof(out));
+	test_lookup = lookup_preempt;
+	failed += mi_session_decrypt(new_conn, cipher, sizeof(plain) + 6, out) != 1;
+	test_lookup = NULL;
+	failed += lookup.hits == 0 || lookup.failed;
+	failed += session_find(conn) != p_slot;
+	failed += out[0] != 0;
+
+	failed += mi_session_encrypt(conn, plain, sizeof(plain), cipher) != 0;
+	failed += test_notify_check(p_old, 1, cipher, plain, sizeof(plain));
+
+	return failed;
+}
+
+/*
+ * Two links with keys of their own and their traffic interleaved, as from
+ * an owner and a shared user at once. Every notification must open with the
+ * keys and counter of its own link, every write only on its own link. Then
+ * writes out of order within the replay window, replays and stale counters,
+ * and the stress, teardown and lookup tests on the second link.
+ */
+int mi_crypto_self_test(void)
+{
+	static const uint16_t conn[2] = {0, 1};
+	/*
+	 * App counters of link 0 after 40 (34 .. 37 unused): out of order,
+	 * replays, the window edge, and across the 16-bit wrap.
+	 */
+	static const struct {
+		uint32_t cnt;
+		uint8_t  ret;
+	} replay[] = {
+		{ 44, 0 }, { 42, 0 }, { 43, 0 }, { 42, 3 }, { 41, 0 }, { 44, 3 },
+		{ 100, 0 }, { 37, 0 }, { 36, 3 }, { 40, 3 }, { 99, 0 }, { 37, 3 },
+		{ 0x4000, 0 }, { 0x8000, 0 }, { 0xFFF0, 0 }, { 0x10005, 0 },
+		{ 0xFFF8, 0 }, { 0xFFF0, 3 }, { 0x10005, 3 }, { 0x10004, 0 },
+		{ 0xFFC5, 3 }, { 0xFFC6, 0 },
+	};
+	session_ctx_t ctx[2];
+	session_nonce_t nonce;
+	mbedtls_ccm_context ccm;
+	uint8_t plain[16], cipher[16 + 6], out[16];
+	uint32_t dev_cnt[2] = {0, 0};
+	uint8_t i, k, l, len;
+	int failed = 0;
+
+	for (l = 0; l < 2; l++) {
+		for (k = 0; k < sizeof(session_ctx_t); k++)
+			((uint8_t*)&ctx[l])[k] = 17 * k + 101 * l + 3;
+		failed += mi_crypto_init(conn[l], &ctx[l]) != 0;
+	}
+
+#if (MI_CRYPTO_SESSION_MAX == 2)
+	failed += mi_crypto_init(2, &ctx[0]) != 2;
+#endif
+
+	mbedtls_ccm_init(&ccm);
+	for (i = 0; i < 40; i++) {
+		l   = (i * 7 >> 2) & 1;
+		len = test_len[i % sizeof(test_len)];
+		if (i % 3 == 0)
+			mi_crypto_ks_refill();
+		for (k = 0; k < len; k++)
+			plain[k] = i + k;
+
+		/* device to phone */
+		failed += mi_session_encrypt(conn[l], plain, len, cipher) != 0;
+		memset(&nonce, 0, sizeof(nonce));
+		memcpy(nonce.iv, ctx[l].dev_iv, sizeof(nonce.iv));
+		nonce.counter = ++dev_cnt[l];
+		mbedtls_ccm_setkey(&ccm, ctx[l].dev_key);
+		failed += (cipher[0] | cipher[1] << 8) != (uint16_t)nonce.counter;
+		failed += mbedtls_ccm_auth_decrypt(&ccm, (void*)&nonce, sizeof(nonce), NULL, 0,
+		                                   cipher + 2, len, out, cipher + 2 + len, 4) != 0;
+		failed += memcmp(out, plain, len) != 0;
+
+		/* phone to device, which the other link must reject */
+		test_write(&ctx[l], i + 1, plain, len, cipher);
+		failed += mi_session_decrypt(conn[l ^ 1], cipher, len + 6, out) == 0;
+		failed += mi_session_decrypt(conn[l], cipher, len + 6, out) != 0;
+		failed += memcmp(out, plain, len) != 0;
+	}
+	mbedtls_ccm_free(&ccm);
+
+	/* a write whose MIC fails must not use up its counter */
+	test_write(&ctx[0], 41, plain, 4, cipher);
+	cipher[3] ^= 1;
+	failed += mi_session_decrypt(conn[0], cipher, 4 + 6, out) == 0;
+
+	for (i = 0; i < sizeof(replay) / sizeof(replay[0]); i++) {
+		test_write(&ctx[0], replay[i].cnt, plain, 4, cipher);
+		failed += mi_session_decrypt(conn[0], cipher, 4 + 6, out) != replay[i].ret;
+	}
+
+	failed += stress_test(&ctx[1], conn[1], dev_cnt[1]);
+	failed += teardown_test(&ctx[1], &ctx[0], conn[1]);
+	failed += lookup_test(&ctx[1], &ctx[0], conn[1]);
+
+	for (l = 0; l < 2; l++)
+		failed += mi_crypto_uninit(conn[l]) != 0;
+	failed += mi_session_encrypt(conn[0], plain, 1, cipher) != 1;
+
+	return failed;
 }
+#endif
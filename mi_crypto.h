@@ -10,8 +10,66 @@ typedef struct {
 	uint8_t reserve[24];
 } session_ctx_t;
 
-int mi_crypto_init(session_ctx_t *p_ctx);
-int mi_crypto_uninit(void);
+typedef enum {
+	MI_SESSION_ENCRYPT = 0,     /* device to phone, dev_key */
+	MI_SESSION_DECRYPT          /* phone to device, app_key */
+} mi_session_dir_t;
+
+typedef struct mi_session_op_s mi_session_op_t;
+
+typedef void (*mi_session_handler_t)(mi_session_op_t *p_op);
+
+/* One mi_session_encrypt() / mi_session_decrypt(), for mi_session_submit(). */
+struct mi_session_op_s {
+	uint16_t              conn_handle;
+	mi_session_dir_t      dir;
+	const uint8_t        *input;
+	uint8_t               len;        /* of input, as for the blocking calls */
+	uint8_t              *output;
+	mi_session_handler_t  handler;    /* called on completion, may be NULL */
+	void                 *p_context;
+	volatile uint8_t      pending;
+	int                   result;     /* as the blocking call returns, valid once not pending */
+
+	/* session private */
+	mi_session_op_t      *p_next;
+};
+
+/**@brief Function for starting the session of a connection.
+ *
+ * @details Each connection has its own keys and nonce counters, up to
+ * MI_CRYPTO_SESSION_MAX of them. A session already running on conn_handle
+ * is replaced. May be called from any context: if it preempted an operation
+ * of the session, the operation ends on the old keys and the new session
+ * starts as it returns; the session takes no operation meanwhile.
+ *
+ * @param[in] conn_handle  connection the session keys were agreed on.
+ * @param[in] p_ctx        session keys from the login.
+ *
+ * @return  0, 1 if p_ctx is NULL, 2 if every session is in use.
+ */
+int mi_crypto_init(uint16_t conn_handle, session_ctx_t *p_ctx);
+
+/**@brief Function for ending the session of a connection, on disconnect.
+ *
+ * @details Queued operations complete with result 1. An operation this call
+ * preempted runs to its end, then the session is wiped.
+ *
+ * @return  0, 1 if conn_handle has no session.
+ */
+int mi_crypto_uninit(uint16_t conn_handle);
+
+/**@brief Function for refilling the session keystream pools.
+ *
+ * @details With MI_CRYPTO_KS_POOL > 0, the CTR keystream of the next
+ * MI_CRYPTO_KS_POOL device nonces of every session is computed ahead of time, so that
+ * mi_session_encrypt() of up to 16 bytes only has to do the CBC-MAC. Call it
+ * from the main loop before going to sleep. Without the pool it does nothing.
+ *
+ * @return  number of keystream slots filled.
+ */
+int mi_crypto_ks_refill(void);
+
 /**@brief Function for encrypt the data.
  *
  * @details After Secure auth login, device and application will both generate the
@@ -19,17 +77,56 @@ int mi_crypto_uninit(void);
  * output is concatenating LSB of counter in nonce, cipher text and the MIC. So
  * the length of output buffer MUST be 6 bytes larger than input buffer.
  *
+ * @param[in] conn_handle  connection to send on.
  * @param[in] input    plain text.
  * @param[in] len      plain text bytes.
  * @param[out] output  cipher text and 6-bytes extra info.
+ *
+ * @return  0, 1 no session on conn_handle, 2 an encryption of the session is
+ *          running in a context this call preempted; use mi_session_submit()
+ *          from interrupts.
  */
-int mi_session_encrypt(const uint8_t *input, uint8_t len, uint8_t *output);
+int mi_session_encrypt(uint16_t conn_handle, const uint8_t *input, uint8_t len, uint8_t *output);
 
-/**@brief Function for handling the Xiaomi Service's BLE events.
+/**@brief Function for decrypt the data.
  *
+ * @details Encryption and decryption of a session have state of their own and
+ * may run at the same time. Each counter is accepted once. Up to 63 counters behind the
+ * highest one accepted may still arrive, in any order.
+ *
+ * @param[in] conn_handle  connection the data came in on.
  * @param[in] input    cipher text and 6-bytes extra info.
  * @param[in] len      num of byte.
  * @param[out] output  plain text.
+ *
+ * @return  0, 1 no session on conn_handle, 2 a decryption of the session is
+ *          running in a context this call preempted, 3 a replayed or too old
+ *          counter, or the CCM error of a bad MIC.
+ */
+int mi_session_decrypt(uint16_t conn_handle, const uint8_t *input, uint8_t len, uint8_t *output);
+
+/**@brief Function for submitting an encryption or decryption from any context.
+ *
+ * @details If the direction of the session is free, the operation runs right
+ * away and its handler is called before this returns. Otherwise it is queued
+ * and the context holding the direction runs it, in submission order, before
+ * letting go; that is the preempted main loop when called from an interrupt.
+ * The op and its buffers must stay untouched while it is pending. Ending the
+ * session completes the queued ones with result 1.
+ *
+ * @param[in] p_op     op with conn_handle, dir, input, len, output and
+ *                     optionally handler set.
+ *
+ * @return  0, 1 no session on conn_handle, 2 p_op is still pending.
+ */
+int mi_session_submit(mi_session_op_t *p_op);
+
+#ifdef M_TEST
+/**@brief Function for testing two sessions carrying interleaved traffic,
+ * the replay window, and operations submitted from preempting contexts.
+ *
+ * @return  number of failed checks.
  */
-int mi_session_decrypt(const uint8_t *input, uint8_t len, uint8_t *output);
+int mi_crypto_self_test(void);
+#endif
 #endif  /* __MI_CRYPTO_H__ */ 
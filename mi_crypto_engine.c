@@ -0,0 +1,392 @@
+#include <string.h>
+
+#include "mi_error.h"
+#include "ccm.h"
+#include "sha256_hkdf.h"
+#include "mi_crypto_engine.h"
+
+/*
+ * Device: cooperative, one chunk per mi_crypto_engine_process() call from the
+ * main loop. The queue is shared with the interrupts that submit jobs.
+ * Host:   a worker thread drains the queue.
+ */
+#if defined(NRF51) || defined(NRF52)
+#include "app_util_platform.h"
+#define ENGINE_THREAD       0
+#define ENGINE_LOCK()       CRITICAL_REGION_ENTER()
+#define ENGINE_UNLOCK()     CRITICAL_REGION_EXIT()
+#else
+#include <pthread.h>
+#define ENGINE_THREAD       1
+#define ENGINE_LOCK()       pthread_mutex_lock(&m_lock)
+#define ENGINE_UNLOCK()     pthread_mutex_unlock(&m_lock)
+
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  m_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  m_done = PTHREAD_COND_INITIALIZER;
+static pthread_t       m_worker;
+#endif
+
+static mi_crypto_job_t *m_head;
+static mi_crypto_job_t *m_tail;
+static uint8_t          m_initialized;
+#if !ENGINE_THREAD
+static volatile uint8_t m_busy;
+#endif
+
+static void wipe(void *p, uint16_t n)
+{
+	volatile uint8_t *v = p;
+	while (n--) *v++ = 0;
+}
+
+/* Appends the next T(i) to the output, returns 1 while more are needed. */
+static int hkdf_expand(mi_crypto_job_t *p_job)
+{
+	mi_crypto_hkdf_param_t *p = &p_job->param.hkdf;
+	uint8_t  t[32];
+	uint16_t done, n;
+
+	done = p_job->hkdf.i * 32;
+	if (done >= p->out_len)
+		return 0;
+
+	sha256_hkdf_expand_next(&p_job->hkdf, p->info, p->info_len, t);
+
+	n = p->out_len - done < 32 ? p->out_len - done : 32;
+	memcpy(p->out + done, t, n);
+	wipe(t, sizeof(t));
+
+	return done + n < p->out_len;
+}
+
+/*
+ * HKDF (RFC 5869), one HMAC per chunk:
+ * step 0       PRK  = HMAC(salt, IKM), skipped by HKDF_EXPAND
+ * step 1       T(i) = HMAC(PRK, T(i-1) | info | i), appended to the output,
+ *              skipped by HKDF_EXTRACT
+ * Only a whole HKDF job wipes the PRK when done.
+ */
+static int hkdf_step(mi_crypto_job_t *p_job)
+{
+	mi_crypto_hkdf_param_t *p = &p_job->param.hkdf;
+
+	if (p_job->step == 0 && p_job->type != MI_CRYPTO_JOB_HKDF_EXPAND) {
+		if (p->salt_hmac != NULL)
+			sha256_hkdf_extract_state(&p_job->hkdf, p->salt_hmac, p->ikm, p->ikm_len);
+		else
+			sha256_hkdf_extract(&p_job->hkdf, p->salt, p->salt_len, p->ikm, p->ikm_len);
+		p_job->step = 1;
+		if (p_job->type == MI_CRYPTO_JOB_HKDF)
+			return 1;
+	} else if (hkdf_expand(p_job)) {
+		return 1;
+	}
+
+	if (p_job->type == MI_CRYPTO_JOB_HKDF)
+		sha256_hkdf_free(&p_job->hkdf);
+	p_job->result = 0;
+	return 0;
+}
+
+/* A CCM job is short enough to be a single chunk. */
+static int ccm_step(mi_crypto_job_t *p_job)
+{
+	mi_crypto_ccm_param_t *p = &p_job->param.ccm;
+	mbedtls_ccm_context ctx;
+
+	mbedtls_ccm_init(&ctx);
+	p_job->result = mbedtls_ccm_setkey(&ctx, p->key);
+	if (p_job->result != 0)
+		return 0;
+
+	if (p_job->type == MI_CRYPTO_JOB_CCM_ENCRYPT)
+		p_job->result = mbedtls_ccm_encrypt_and_tag(&ctx, p->nonce, p->nonce_len,
+		                                            p->add, p->add_len,
+		                                            p->in, p->len, p->out,
+		                                            p->mic, p->mic_len);
+	else
+		p_job->result = mbedtls_ccm_auth_decrypt(&ctx, p->nonce, p->nonce_len,
+		                                         p->add, p->add_len,
+		                                         p->in, p->len, p->out,
+		                                         p->mic, p->mic_len);
+
+	mbedtls_ccm_free(&ctx);
+	wipe(&ctx, sizeof(ctx));
+	return 0;
+}
+
+/* Runs one chunk of p_job, returns 1 while more chunks are needed. */
+static int job_step(mi_crypto_job_t *p_job)
+{
+	p_job->state = MI_CRYPTO_JOB_RUNNING;
+
+	if (p_job->type == MI_CRYPTO_JOB_CCM_ENCRYPT || p_job->type == MI_CRYPTO_JOB_CCM_DECRYPT)
+		return ccm_step(p_job);
+	else
+		return hkdf_step(p_job);
+}
+
+/* Takes the finished head job off the queue. */
+static void job_dequeue(void)
+{
+	m_head = m_head->p_next;
+	if (m_head == NULL)
+		m_tail = NULL;
+}
+
+#if !ENGINE_THREAD
+static void job_complete(mi_crypto_job_t *p_job)
+{
+	mi_crypto_job_handler_t handler = p_job->handler;
+
+	p_job->state = MI_CRYPTO_JOB_DONE;
+	if (handler != NULL)
+		handler(p_job);
+}
+#else
+static void * engine_worker(void *arg)
+{
+	mi_crypto_job_t *p_job;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&m_lock);
+		while (m_head == NULL)
+			pthread_cond_wait(&m_work, &m_lock);
+		p_job = m_head;
+		pthread_mutex_unlock(&m_lock);
+
+		while (job_step(p_job))
+			;
+
+		pthread_mutex_lock(&m_lock);
+		job_dequeue();
+		p_job->state = MI_CRYPTO_JOB_DONE;
+		pthread_cond_broadcast(&m_done);
+		pthread_mutex_unlock(&m_lock);
+
+		if (p_job->handler != NULL)
+			p_job->handler(p_job);
+	}
+
+	return NULL;
+}
+#endif
+
+int mi_crypto_engine_init(void)
+{
+	if (m_initialized)
+		return MI_SUCCESS;
+
+#if ENGINE_THREAD
+	if (pthread_create(&m_worker, NULL, engine_worker, NULL) != 0)
+		return MI_ERROR_INTERNAL;
+	pthread_detach(m_worker);
+#endif
+
+	m_head = m_tail = NULL;
+	m_initialized = 1;
+	return MI_SUCCESS;
+}
+
+int mi_crypto_job_submit(mi_crypto_job_t *p_job)
+{
+	int ret = MI_SUCCESS;
+
+	if (!m_initialized)
+		return MI_ERROR_NOT_INIT;
+
+	if (p_job == NULL)
+		return MI_ERROR_NULL;
+
+	switch (p_job->type) {
+	case MI_CRYPTO_JOB_HKDF:
+		if (p_job->param.hkdf.out_len == 0 || p_job->param.hkdf.out_len > 255 * 32)
+			return MI_ERROR_INVALID_LENGTH;
+		break;
+
+	case MI_CRYPTO_JOB_HKDF_EXTRACT:
+		break;
+
+	case MI_CRYPTO_JOB_HKDF_EXPAND:
+		if (p_job->param.hkdf.out_len > 255 * 32)
+			return MI_ERROR_INVALID_LENGTH;
+		break;
+
+	case MI_CRYPTO_JOB_CCM_ENCRYPT:
+	case MI_CRYPTO_JOB_CCM_DECRYPT:
+		if (p_job->param.ccm.key == NULL)
+			return MI_ERROR_NULL;
+		break;
+
+	default:
+		return MI_ERROR_INVALID_PARAM;
+	}
+
+	ENGINE_LOCK();
+	if (mi_crypto_job_busy(p_job)) {
+		ret = MI_ERROR_BUSY;
+	} else {
+		p_job->step   = 0;
+		p_job->result = 0;
+		p_job->p_next = NULL;
+		p_job->state  = MI_CRYPTO_JOB_PENDING;
+		if (m_tail == NULL)
+			m_head = p_job;
+		else
+			m_tail->p_next = p_job;
+		m_tail = p_job;
+#if ENGINE_THREAD
+		pthread_cond_signal(&m_work);
+#endif
+	}
+	ENGINE_UNLOCK();
+
+	return ret;
+}
+
+int mi_crypto_job_wait(mi_crypto_job_t *p_job)
+{
+#if ENGINE_THREAD
+	pthread_mutex_lock(&m_lock);
+	while (p_job->state != MI_CRYPTO_JOB_DONE)
+		pthread_cond_wait(&m_done, &m_lock);
+	pthread_mutex_unlock(&m_lock);
+#else
+	while (p_job->state != MI_CRYPTO_JOB_DONE)
+		mi_crypto_engine_process();
+#endif
+
+	return p_job->result;
+}
+
+int mi_crypto_engine_process(void)
+{
+#if ENGINE_THREAD
+	return 0;
+#else
+	mi_crypto_job_t *p_job;
+	int more;
+
+	ENGINE_LOCK();
+	p_job = m_busy ? NULL : m_head;
+	if (p_job != NULL)
+		m_busy = 1;
+	ENGINE_UNLOCK();
+
+	if (p_job == NULL)
+		return 0;
+
+	if (job_step(p_job) == 0) {
+		ENGINE_LOCK();
+		job_dequeue();
+		ENGINE_UNLOCK();
+		job_complete(p_job);
+	}
+
+	ENGINE_LOCK();
+	m_busy = 0;
+	more = m_head != NULL;
+	ENGINE_UNLOCK();
+
+	return more;
+#endif
+}
+
+static int keysched_start(mi_keysched_t *p_ks,
+                          const uint8_t *ikm,  uint16_t ikm_len,
+                          const uint8_t *salt, uint16_t salt_len,
+                          const sha256_hmac_state *salt_hmac,
+                          const uint8_t *info, uint16_t info_len,
+                          void *p_okm, uint16_t okm_len,
+                          mi_crypto_job_handler_t handler)
+{
+	mi_crypto_job_t *p_job = &p_ks->job;
+
+	if (mi_crypto_job_busy(p_job))
+		return MI_ERROR_BUSY;
+
+	if (okm_len > 255 * 32)
+		return MI_ERROR_INVALID_LENGTH;
+
+	p_job->type                 = MI_CRYPTO_JOB_HKDF_EXTRACT;
+	p_job->param.hkdf.ikm       = ikm;
+	p_job->param.hkdf.ikm_len   = ikm_len;
+	p_job->param.hkdf.salt      = salt;
+	p_job->param.hkdf.salt_len  = salt_len;
+	p_job->param.hkdf.salt_hmac = salt_hmac;
+	p_job->param.hkdf.info      = info;
+	p_job->param.hkdf.info_len  = info_len;
+	p_job->param.hkdf.out       = p_okm;
+	p_job->param.hkdf.out_len   = 0;
+	p_job->handler              = handler;
+	p_ks->okm_len               = okm_len;
+
+	return mi_crypto_job_submit(p_job);
+}
+
+int mi_keysched_start(mi_keysched_t *p_ks,
+                      const uint8_t *ikm,  uint16_t ikm_len,
+                      const uint8_t *salt, uint16_t salt_len,
+                      const uint8_t *info, uint16_t info_len,
+                      void *p_okm, uint16_t okm_len,
+                      mi_crypto_job_handler_t handler)
+{
+	return keysched_start(p_ks, ikm, ikm_len, salt, salt_len, NULL,
+	                      info, info_len, p_okm, okm_len, handler);
+}
+
+int mi_keysched_start_salt(mi_keysched_t *p_ks,
+                           const uint8_t *ikm, uint16_t ikm_len,
+                           const sha256_hmac_state *salt_hmac,
+                           const uint8_t *info, uint16_t info_len,
+                           void *p_okm, uint16_t okm_len,
+                           mi_crypto_job_handler_t handler)
+{
+	return keysched_start(p_ks, ikm, ikm_len, NULL, 0, salt_hmac,
+	                      info, info_len, p_okm, okm_len, handler);
+}
+
+/*
+ * out_len is the number of output bytes derived so far, valid whenever no job
+ * is queued. Blocks are asked for whole, only the last one of the output may
+ * be cut short.
+ */
+int mi_keysched_ready(mi_keysched_t *p_ks, uint16_t offset, uint16_t len)
+{
+	mi_crypto_job_t *p_job = &p_ks->job;
+	uint16_t end = offset + len, done;
+
+	if (mi_crypto_job_busy(p_job) || p_job->state == MI_CRYPTO_JOB_IDLE)
+		return 0;
+
+	if (end > p_ks->okm_len)
+		end = p_ks->okm_len;
+
+	if (end <= p_job->param.hkdf.out_len)
+		return 1;
+
+	done = p_job->param.hkdf.out_len;
+	end  = (end + 31) / 32 * 32;
+	p_job->type               = MI_CRYPTO_JOB_HKDF_EXPAND;
+	p_job->param.hkdf.out_len = end < p_ks->okm_len ? end : p_ks->okm_len;
+	if (mi_crypto_job_submit(p_job) != MI_SUCCESS)
+		p_job->param.hkdf.out_len = done;
+
+	return 0;
+}
+
+int mi_keysched_clear(mi_keysched_t *p_ks)
+{
+	mi_crypto_job_t *p_job = &p_ks->job;
+
+	if (mi_crypto_job_busy(p_job))
+		return MI_ERROR_BUSY;
+
+	sha256_hkdf_free(&p_job->hkdf);
+	p_job->param.hkdf.out_len = 0;
+	p_job->state = MI_CRYPTO_JOB_IDLE;
+
+	return MI_SUCCESS;
+}
@@ -0,0 +1,197 @@
+#ifndef __MI_CRYPTO_ENGINE_H__
+#define __MI_CRYPTO_ENGINE_H__
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256_hkdf.h"
+
+typedef enum {
+	MI_CRYPTO_JOB_HKDF = 0,
+	MI_CRYPTO_JOB_CCM_ENCRYPT,
+	MI_CRYPTO_JOB_CCM_DECRYPT,
+	MI_CRYPTO_JOB_HKDF_EXTRACT,
+	MI_CRYPTO_JOB_HKDF_EXPAND
+} mi_crypto_job_type_t;
+
+typedef enum {
+	MI_CRYPTO_JOB_IDLE = 0,
+	MI_CRYPTO_JOB_PENDING,
+	MI_CRYPTO_JOB_RUNNING,
+	MI_CRYPTO_JOB_DONE
+} mi_crypto_job_state_t;
+
+typedef struct mi_crypto_job_s mi_crypto_job_t;
+
+typedef void (*mi_crypto_job_handler_t)(mi_crypto_job_t *p_job);
+
+/*
+ * HKDF-SHA256: out_len bytes of OKM from ikm, salt and info.
+ * An HKDF_EXTRACT job only takes ikm and salt and keeps the PRK in the job.
+ * An HKDF_EXPAND job on the same job struct then appends T(i) blocks to out
+ * until out_len bytes are there, and keeps the PRK for the next one.
+ */
+typedef struct {
+	const uint8_t *ikm;
+	uint16_t       ikm_len;
+	const uint8_t *salt;
+	uint16_t       salt_len;
+	const sha256_hmac_state *salt_hmac;     /* stored midstates of the salt, used
+	                                           instead of salt if not NULL */
+	const uint8_t *info;
+	uint16_t       info_len;
+	uint8_t       *out;
+	uint16_t       out_len;
+} mi_crypto_hkdf_param_t;
+
+/* AES128-CCM: len bytes from in to out, the MIC goes to / comes from mic. */
+typedef struct {
+	const uint8_t *key;
+	const uint8_t *nonce;
+	uint8_t        nonce_len;
+	const uint8_t *add;
+	uint16_t       add_len;
+	const uint8_t *in;
+	uint16_t       len;
+	uint8_t       *out;
+	uint8_t       *mic;
+	uint8_t        mic_len;
+} mi_crypto_ccm_param_t;
+
+struct mi_crypto_job_s {
+	mi_crypto_job_type_t            type;
+	union {
+		mi_crypto_hkdf_param_t      hkdf;
+		mi_crypto_ccm_param_t       ccm;
+	} param;
+	mi_crypto_job_handler_t         handler;    /* called on completion, may be NULL */
+	void                           *p_context;
+	volatile mi_crypto_job_state_t  state;
+	int                             result;     /* 0 or the crypto error, valid when DONE */
+
+	/* engine private */
+	mi_crypto_job_t                *p_next;
+	uint8_t                         step;
+	sha256_hkdf_context             hkdf;
+};
+
+/**@brief Function for initializing the crypto engine.
+ *
+ * @details On the device, jobs run in chunks from mi_crypto_engine_process(),
+ * which the main loop calls; an interrupt (BLE events, the mi_scheduler tick)
+ * is never held up by more than one chunk. On a host build a worker thread
+ * runs them and mi_crypto_engine_process() does nothing.
+ *
+ * @return  MI_SUCCESS, or MI_ERROR_INTERNAL if the worker cannot start.
+ */
+int mi_crypto_engine_init(void);
+
+/**@brief Function for submitting a job.
+ *
+ * @details Jobs run one after another in submission order. The job and all
+ * the buffers it points to must stay untouched until it is DONE. The handler
+ * is called from the engine context: the main loop on the device, the worker
+ * thread on the host.
+ *
+ * @param[in] p_job    job with type, param and optionally handler set.
+ *
+ * @return  MI_SUCCESS, MI_ERROR_NOT_INIT, MI_ERROR_NULL, MI_ERROR_BUSY (the
+ *          job is still queued or running), MI_ERROR_INVALID_PARAM or
+ *          MI_ERROR_INVALID_LENGTH.
+ */
+int mi_crypto_job_submit(mi_crypto_job_t *p_job);
+
+/**@brief Function for checking whether a job has completed.
+ */
+static inline int mi_crypto_job_done(const mi_crypto_job_t *p_job)
+{
+	return p_job->state == MI_CRYPTO_JOB_DONE;
+}
+
+/**@brief Function for checking whether a job is queued or running.
+ */
+static inline int mi_crypto_job_busy(const mi_crypto_job_t *p_job)
+{
+	return p_job->state == MI_CRYPTO_JOB_PENDING || p_job->state == MI_CRYPTO_JOB_RUNNING;
+}
+
+/**@brief Function for waiting for a job.
+ *
+ * @details Blocks on the host. On the device it drives the engine itself, so
+ * it must not be called from an interrupt that may have preempted
+ * mi_crypto_engine_process().
+ *
+ * @return  the job result.
+ */
+int mi_crypto_job_wait(mi_crypto_job_t *p_job);
+
+/**@brief Function for running one chunk of the queued jobs.
+ *
+ * @details A chunk is one HMAC of an HKDF job or a whole CCM job. Call it from
+ * the main loop and only go to sleep when it returns 0.
+ *
+ * @return  1 if more work is queued, 0 otherwise.
+ */
+int mi_crypto_engine_process(void);
+
+/*
+ * Key schedule: an HKDF whose output blocks are only computed when a field of
+ * the output is first asked for. A handshake that only needs the first key of
+ * a derived struct never computes the rest.
+ */
+typedef struct {
+	mi_crypto_job_t job;
+	uint16_t        okm_len;
+} mi_keysched_t;
+
+/* Offset and size of a field of the output struct, for mi_keysched_ready(). */
+#define MI_KEYSCHED_FIELD(type, field)    offsetof(type, field), sizeof(((type *)0)->field)
+
+/**@brief Function for starting a key schedule.
+ *
+ * @details Submits the HKDF extract. The inputs are read by the extract job,
+ * the info string and p_okm must stay valid until mi_keysched_clear().
+ *
+ * @param[in]  p_ks     key schedule.
+ * @param[in]  p_okm    where the output keying material goes.
+ * @param[in]  okm_len  its full length, at most 255 * 32 bytes.
+ * @param[in]  handler  called on completion of each job, may be NULL.
+ *
+ * @return  MI_SUCCESS, MI_ERROR_BUSY (the previous job is still queued or
+ *          running), or an error of mi_crypto_job_submit().
+ */
+int mi_keysched_start(mi_keysched_t *p_ks,
+                      const uint8_t *ikm,  uint16_t ikm_len,
+                      const uint8_t *salt, uint16_t salt_len,
+                      const uint8_t *info, uint16_t info_len,
+                      void *p_okm, uint16_t okm_len,
+                      mi_crypto_job_handler_t handler);
+
+/**@brief Function for starting a key schedule with a precomputed salt.
+ *
+ * @details As mi_keysched_start(), with the salt given by its HMAC midstates
+ * (see mi_hkdf_salts.h), which saves two SHA-256 compressions.
+ */
+int mi_keysched_start_salt(mi_keysched_t *p_ks,
+                           const uint8_t *ikm, uint16_t ikm_len,
+                           const sha256_hmac_state *salt_hmac,
+                           const uint8_t *info, uint16_t info_len,
+                           void *p_okm, uint16_t okm_len,
+                           mi_crypto_job_handler_t handler);
+
+/**@brief Function for checking whether part of the output is derived.
+ *
+ * @details If it is not, submits the expansion of the blocks up to it and
+ * returns 0; call again once the job handler ran. Meant for
+ *
+ *	PT_WAIT_UNTIL(pt, mi_keysched_ready(&ks, MI_KEYSCHED_FIELD(session_ctx_t, dev_key)));
+ *
+ * @return  1 if the bytes offset .. offset + len - 1 of the output are valid.
+ */
+int mi_keysched_ready(mi_keysched_t *p_ks, uint16_t offset, uint16_t len);
+
+/**@brief Function for wiping the PRK of a key schedule.
+ *
+ * @return  MI_SUCCESS, or MI_ERROR_BUSY if a job is still queued or running.
+ */
+int mi_keysched_clear(mi_keysched_t *p_ks);
+
+#endif  /* __MI_CRYPTO_ENGINE_H__ */
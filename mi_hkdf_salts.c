@@ -0,0 +1,62 @@
+/* Generated by host/gen_hkdf_salts.c, do not edit. */
+#include "mi_hkdf_salts.h"
+
+/* "smartcfg-setup-salt" */
+const sha256_hmac_state reg_salt_hmac = {
+	{
+		0x42206D5F, 0xF748B3AC, 0x2A7182F8, 0x6A40027C,
+		0x023C7328, 0x9254E0F4, 0x471CE52F, 0x0A81BE0D
+	},
+	{
+		0x0E068920, 0xB4A49411, 0x8313AF11, 0x944B1C36,
+		0xBFAD0CDB, 0xBB29C4AE, 0xB40456F5, 0x5DFBB78F
+	}
+};
+
+/* "smartcfg-login-salt" */
+const sha256_hmac_state log_salt_hmac = {
+	{
+		0xD937AA65, 0x6EAC53A9, 0x58FD1A88, 0x15218FB7,
+		0xE9F774FF, 0x84197505, 0x798EDD92, 0x8E719632
+	},
+	{
+		0x77A1E346, 0x982FA7F1, 0xC3D5EA57, 0x5F1CC7ED,
+		0xD2D6584E, 0x18CF70EB, 0xF9B23AE0, 0x116CD9FA
+	}
+};
+
+/* "smartcfg-share-salt" */
+const sha256_hmac_state share_salt_hmac = {
+	{
+		0xCE5B4045, 0x5D65B3BB, 0x01841259, 0x3DD11A93,
+		0xA7DEE4A2, 0x9A1F059F, 0xE385DCDC, 0x95DAE859
+	},
+	{
+		0x50E819E2, 0x808AA041, 0x53C9C96C, 0x54A5037A,
+		0x62715D6B, 0x31CFDE0C, 0x7CA33FC8, 0x32429EE8
+	}
+};
+
+/* "smartcfg-cloud-salt" */
+const sha256_hmac_state cloud_salt_hmac = {
+	{
+		0x97FBC433, 0x6B4B791F, 0xA8B321E0, 0x116F0343,
+		0xD596F8D4, 0xA3C13A5D, 0x2F3BBCFC, 0x535EB185
+	},
+	{
+		0x2DA0D7F7, 0x3EA23D62, 0xD45A072B, 0x480BA5FA,
+		0xFC27D32C, 0x10EA9BD0, 0x5BAF8B25, 0xFF84B0CC
+	}
+};
+
+/* "smartcfg-masterkey-salt" */
+const sha256_hmac_state mk_salt_hmac = {
+	{
+		0xDA54436F, 0x82E4EC19, 0x0FD7256B, 0xBAF16AB0,
+		0x3EF524A3, 0xC052F3FA, 0xA5A1C035, 0x5E52D05C
+	},
+	{
+		0x93933B15, 0x512DBB12, 0x3A642ECE, 0x93E0952E,
+		0xD1CA6899, 0x4ADB78A5, 0x406DB971, 0x01A069DD
+	}
+};
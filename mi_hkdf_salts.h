@@ -0,0 +1,12 @@
+/* Generated by host/gen_hkdf_salts.c, do not edit. */
+#ifndef __MI_HKDF_SALTS_H__
+#define __MI_HKDF_SALTS_H__
+#include "sha256_hkdf.h"
+
+extern const sha256_hmac_state reg_salt_hmac;	/* "smartcfg-setup-salt" */
+extern const sha256_hmac_state log_salt_hmac;	/* "smartcfg-login-salt" */
+extern const sha256_hmac_state share_salt_hmac;	/* "smartcfg-share-salt" */
+extern const sha256_hmac_state cloud_salt_hmac;	/* "smartcfg-cloud-salt" */
+extern const sha256_hmac_state mk_salt_hmac;	/* "smartcfg-masterkey-salt" */
+
+#endif  /* __MI_HKDF_SALTS_H__ */
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "app_util_platform.h"
+#include "app_timer.h"
+#include "mi_metrics.h"
+
+/*
+ * Everything runs in a critical region: phases begin and end in the scheduler
+ * and in the flash event handler. The SoftDevice may read m_pub in the middle
+ * of an update, so seq_end is bumped before and seq after it.
+ */
+typedef enum {
+	REC_IDLE = 0,
+	REC_RUN,
+	REC_ENDED                   /* waiting for its flash writes */
+} rec_stat_t;
+
+static struct {
+	uint32_t               rtc0;            /* RTC1 counter at the start */
+	rec_stat_t             state;
+	uint8_t                gen;
+	uint8_t                flash;           /* flash phases running */
+	uint8_t                proc;
+	uint8_t                result;
+	uint8_t                phase_num;
+	uint8_t                phase_lost;
+	uint16_t               wakes;
+	uint16_t               passes;
+	uint32_t               sum[MI_PHASE_NUM];
+	mi_metrics_phase_rec_t phase[MI_METRICS_PHASE_MAX];
+} m_rec;
+
+static uint32_t     m_hist[MI_METRICS_HISTORY][MI_PHASE_NUM];
+static uint8_t      m_hist_num;
+static uint8_t      m_hist_next;
+static mi_metrics_t m_pub = { .version = MI_METRICS_VERSION };
+
+static uint32_t rec_ticks(void)
+{
+	uint32_t diff;
+
+	app_timer_cnt_diff_compute(app_timer_cnt_get(), m_rec.rtc0, &diff);
+	return diff;
+}
+
+static void publish(void)
+{
+	uint32_t min, max, sum, t;
+	uint8_t i, k;
+
+	memcpy(m_hist[m_hist_next], m_rec.sum, sizeof(m_rec.sum));
+	m_hist_next = (m_hist_next + 1) % MI_METRICS_HISTORY;
+	if (m_hist_num < MI_METRICS_HISTORY)
+		m_hist_num++;
+
+	m_pub.seq_end = m_pub.seq + 1;
+	__DMB();
+
+	m_pub.history    = m_hist_num;
+	m_pub.proc       = m_rec.proc;
+	m_pub.result     = m_rec.result;
+	m_pub.phase_num  = m_rec.phase_num;
+	m_pub.phase_lost = m_rec.phase_lost;
+	m_pub.ticks      = m_rec.sum[MI_PHASE_PROC];
+	m_pub.wakes      = m_rec.wakes;
+	m_pub.passes     = m_rec.passes;
+	memcpy(m_pub.phase, m_rec.phase, sizeof(m_pub.phase));
+
+	for (k = 0; k < MI_PHASE_NUM; k++) {
+		min = max = sum = m_hist[0][k];
+		for (i = 1; i < m_hist_num; i++) {
+			t    = m_hist[i][k];
+			min  = t < min ? t : min;
+			max  = t > max ? t : max;
+			sum += t;
+		}
+		m_pub.stat[k].min = min;
+		m_pub.stat[k].avg = sum / m_hist_num;
+		m_pub.stat[k].max = max;
+	}
+
+	__DMB();
+	m_pub.seq = m_pub.seq_end;
+
+	m_rec.state = REC_IDLE;
+}
+
+static void phase_end(mi_metrics_phase_t *p_ph)
+{
+	uint32_t end;
+
+	if (p_ph->gen == 0)
+		return;
+
+	if (p_ph->gen == m_rec.gen && m_rec.state != REC_IDLE) {
+		end = rec_ticks();
+		m_rec.sum[p_ph->phase] += end - p_ph->start;
+		if (p_ph->slot < MI_METRICS_PHASE_MAX)
+			m_rec.phase[p_ph->slot].end = end;
+
+		if (p_ph->phase == MI_PHASE_FLASH && --m_rec.flash == 0 && m_rec.state == REC_ENDED)
+			publish();
+	}
+
+	p_ph->gen = 0;
+}
+
+void mi_metrics_init(uint32_t prescaler)
+{
+	m_pub.tick_hz = APP_TIMER_CLOCK_FREQ / (prescaler + 1);
+}
+
+void mi_metrics_begin(uint8_t proc)
+{
+	CRITICAL_REGION_ENTER();
+	if (m_rec.state == REC_ENDED)
+		publish();
+
+	m_rec.gen        = m_rec.gen == 0xFF ? 1 : m_rec.gen + 1;
+	m_rec.rtc0       = app_timer_cnt_get();
+	m_rec.state      = REC_RUN;
+	m_rec.flash      = 0;
+	m_rec.proc       = proc;
+	m_rec.phase_num  = 0;
+	m_rec.phase_lost = 0;
+	memset(m_rec.sum, 0, sizeof(m_rec.sum));
+	memset(m_rec.phase, 0, sizeof(m_rec.phase));
+	CRITICAL_REGION_EXIT();
+}
+
+void mi_metrics_end(uint8_t result, uint16_t wakes, uint16_t passes)
+{
+	CRITICAL_REGION_ENTER();
+	if (m_rec.state == REC_RUN) {
+		m_rec.sum[MI_PHASE_PROC] = rec_ticks();
+		m_rec.result = result;
+		m_rec.wakes  = wakes;
+		m_rec.passes = passes;
+		m_rec.state  = REC_ENDED;
+		if (m_rec.flash == 0)
+			publish();
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+void mi_metrics_phase_begin(mi_metrics_phase_t *p_ph, mi_phase_id_t phase, uint8_t arg)
+{
+	mi_metrics_phase_rec_t *p_rec;
+
+	CRITICAL_REGION_ENTER();
+	phase_end(p_ph);
+
+	if (m_rec.state == REC_RUN) {
+		p_ph->start = rec_ticks();
+		p_ph->phase = phase;
+		p_ph->gen   = m_rec.gen;
+		if (m_rec.phase_num < MI_METRICS_PHASE_MAX) {
+			p_ph->slot     = m_rec.phase_num++;
+			p_rec          = &m_rec.phase[p_ph->slot];
+			p_rec->phase   = phase;
+			p_rec->arg     = arg;
+			p_rec->retries = 0;
+			p_rec->start   = p_ph->start;
+			p_rec->end     = MI_METRICS_RUNNING;
+		} else {
+			p_ph->slot     = 0xFF;
+			m_rec.phase_lost++;
+		}
+		if (phase == MI_PHASE_FLASH)
+			m_rec.flash++;
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+void mi_metrics_phase_retry(mi_metrics_phase_t *p_ph)
+{
+	mi_metrics_phase_rec_t *p_rec;
+
+	CRITICAL_REGION_ENTER();
+	if (p_ph->gen == m_rec.gen && m_rec.state != REC_IDLE && p_ph->slot < MI_METRICS_PHASE_MAX) {
+		p_rec = &m_rec.phase[p_ph->slot];
+		if (p_rec->retries < 0xFF)
+			p_rec->retries++;
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+void mi_metrics_phase_end(mi_metrics_phase_t *p_ph)
+{
+	CRITICAL_REGION_ENTER();
+	phase_end(p_ph);
+	CRITICAL_REGION_EXIT();
+}
+
+const mi_metrics_t * mi_metrics_get(void)
+{
+	return &m_pub;
+}
@@ -0,0 +1,122 @@
+#ifndef __MI_METRICS_H__
+#define __MI_METRICS_H__
+#include <stdint.h>
+#include "mi_config.h"
+
+/*
+ * Handshake timing. The scheduler opens a record when a registration or login
+ * starts and closes it when the procedure ends. In between, each MSC command,
+ * reliable transfer leg, HKDF job, CCM and flash write is a phase with its
+ * start and end in RTC ticks since the procedure started, tick_hz per second.
+ *
+ * The last record and the min / avg / max per phase over the last
+ * MI_METRICS_HISTORY handshakes are readable as mi_metrics_t, little endian,
+ * through the diagnostics characteristic of the Mi service when
+ * MI_METRICS_DIAG is set.
+ */
+
+typedef enum {
+	MI_PHASE_PROC = 0,          /* the whole procedure, only in stat[] */
+	MI_PHASE_MSC,               /* arg: MSC command */
+	MI_PHASE_RXFER_RX,          /* arg: fctrl_cmd_t data type */
+	MI_PHASE_RXFER_TX,          /* arg: fctrl_cmd_t data type */
+	MI_PHASE_HKDF,              /* arg: mi_crypto_job_type_t */
+	MI_PHASE_CCM,
+	MI_PHASE_FLASH,             /* arg: low byte of the record key */
+	MI_PHASE_NUM
+} mi_phase_id_t;
+
+typedef struct {
+	uint8_t  phase;             /* mi_phase_id_t */
+	uint8_t  arg;
+	uint8_t  retries;           /* MSC command retries, packets sent again */
+	uint8_t  reserve;
+	uint32_t start;             /* RTC ticks since the procedure started */
+	uint32_t end;               /* MI_METRICS_RUNNING if it did not end */
+} mi_metrics_phase_rec_t;
+
+typedef struct {
+	uint32_t min;
+	uint32_t avg;
+	uint32_t max;
+} mi_metrics_stat_t;
+
+typedef struct {
+	uint16_t seq;               /* same as seq_end if not updated while read */
+	uint8_t  version;
+	uint8_t  history;           /* handshakes in stat[] */
+
+	/* the last handshake */
+	uint8_t  proc;              /* REG_START, LOG_START, SHARED_LOG_START... */
+	uint8_t  result;            /* schd_evt_t it ended with */
+	uint8_t  phase_num;
+	uint8_t  phase_lost;        /* phases past MI_METRICS_PHASE_MAX */
+	uint32_t ticks;
+	uint16_t wakes;             /* scheduler wake-ups */
+	uint16_t passes;
+	mi_metrics_phase_rec_t phase[MI_METRICS_PHASE_MAX];
+
+	/* RTC ticks per handshake spent in each mi_phase_id_t */
+	mi_metrics_stat_t      stat[MI_PHASE_NUM];
+	uint16_t seq_end;
+	uint16_t tick_hz;           /* RTC ticks per second */
+} mi_metrics_t;
+
+#define MI_METRICS_VERSION          2
+#define MI_METRICS_RUNNING          0xFFFFFFFFUL
+
+/* A running phase, kept by its caller. */
+typedef struct {
+	uint32_t start;
+	uint8_t  phase;
+	uint8_t  slot;              /* in mi_metrics_t.phase[], 0xFF if none */
+	uint8_t  gen;               /* of the record, 0 when not running */
+	uint8_t  reserve;
+} mi_metrics_phase_t;
+
+/**@brief Function for setting the RTC tick rate the records are in.
+ *
+ * @param[in] prescaler  the RTC1 prescaler app_timer runs with.
+ */
+void mi_metrics_init(uint32_t prescaler);
+
+/**@brief Function for starting the record of a procedure.
+ *
+ * @param[in] proc     auth status the procedure started with.
+ */
+void mi_metrics_begin(uint8_t proc);
+
+/**@brief Function for ending the record of a procedure.
+ *
+ * @details Does nothing if no record was started. A flash write still running,
+ * as the one queued at the end of a registration, is waited for; the record is
+ * published when it ends. Other phases still running are published as
+ * MI_METRICS_RUNNING and left out of the statistics.
+ *
+ * @param[in] result   schd_evt_t the procedure ended with.
+ * @param[in] wakes    scheduler wake-ups during the procedure.
+ * @param[in] passes   scheduler passes during the procedure.
+ */
+void mi_metrics_end(uint8_t result, uint16_t wakes, uint16_t passes);
+
+/**@brief Function for starting a phase of the running procedure.
+ *
+ * @details Does nothing when no procedure is recorded. May be called from
+ * any context. A phase started again while running is ended first.
+ */
+void mi_metrics_phase_begin(mi_metrics_phase_t *p_ph, mi_phase_id_t phase, uint8_t arg);
+
+/**@brief Function for counting a retry of a running phase. */
+void mi_metrics_phase_retry(mi_metrics_phase_t *p_ph);
+
+/**@brief Function for ending a phase, if it is running. */
+void mi_metrics_phase_end(mi_metrics_phase_t *p_ph);
+
+/**@brief Function for getting the published records.
+ *
+ * @details The struct stays at the same address and is updated in place by
+ * mi_metrics_end(); a reader that finds seq != seq_end reads it again.
+ */
+const mi_metrics_t * mi_metrics_get(void);
+
+#endif  /* __MI_METRICS_H__ */
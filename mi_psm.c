@@ -1,6 +1,9 @@
+#include <string.h>
 #include "fds.h"
+#include "app_util_platform.h"
 #include "mi_error.h"
 #include "mi_psm.h"
+#include "mi_metrics.h"
 
 #define NRF_LOG_MODULE_NAME "PSM"
 #include "nrf_log.h"
@@ -8,6 +11,96 @@
 
 #define MI_RECORD_FILE_ID              0x4D49		// file used to storage
 uint8_t m_psm_done;
+
+/*
+ * The flash phase of each write in flight, oldest first. FDS runs its queue
+ * in order, so a write ends the oldest phase of its record key.
+ */
+#define PSM_WRITES_MAX      4           /* FDS_OP_QUEUE_SIZE of both boards */
+
+static struct {
+	uint16_t           key;
+	mi_metrics_phase_t phase;
+} psm_writes[PSM_WRITES_MAX];
+static uint8_t psm_writes_num;
+
+static void psm_write_phase_begin(uint16_t rec_key)
+{
+	CRITICAL_REGION_ENTER();
+	if (psm_writes_num == PSM_WRITES_MAX) {
+		/* an event was missed, give up on the oldest */
+		mi_metrics_phase_end(&psm_writes[0].phase);
+		memmove(&psm_writes[0], &psm_writes[1], sizeof(psm_writes[0]) * --psm_writes_num);
+	}
+	psm_writes[psm_writes_num].key = rec_key;
+	memset(&psm_writes[psm_writes_num].phase, 0, sizeof(psm_writes[0].phase));
+	mi_metrics_phase_begin(&psm_writes[psm_writes_num].phase, MI_PHASE_FLASH, (uint8_t)rec_key);
+	psm_writes_num++;
+	CRITICAL_REGION_EXIT();
+}
+
+static void psm_write_phase_end(uint16_t rec_key)
+{
+	uint8_t i;
+
+	CRITICAL_REGION_ENTER();
+	for (i = 0; i < psm_writes_num; i++) {
+		if (psm_writes[i].key == rec_key) {
+			mi_metrics_phase_end(&psm_writes[i].phase);
+			psm_writes_num--;
+			memmove(&psm_writes[i], &psm_writes[i+1], sizeof(psm_writes[0]) * (psm_writes_num - i));
+			break;
+		}
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+/*
+ * A write that found the flash full, done again once fds_gc() has run. Its
+ * writer gets MI_ERROR_BUSY until the write is in flash, then the outcome.
+ */
+typedef enum {
+	PSM_GC_IDLE,
+	PSM_GC_RUNNING,                 /* fds_gc() queued */
+	PSM_GC_WRITING,                 /* the write queued again */
+	PSM_GC_DONE,                    /* result holds the outcome */
+} psm_gc_state_t;
+
+static struct {
+	uint16_t key;
+	uint16_t len;
+	uint8_t *p_data;
+	uint32_t result;
+	volatile psm_gc_state_t state;
+} psm_gc_write;
+
+static uint32_t psm_record_write(uint16_t rec_key, uint8_t *in, uint16_t in_len);
+
+static void psm_write_end(uint16_t rec_key, uint32_t result)
+{
+	psm_write_phase_end(rec_key);
+	if (psm_gc_write.state == PSM_GC_WRITING && psm_gc_write.key == rec_key) {
+		psm_gc_write.result = result;
+		psm_gc_write.state  = PSM_GC_DONE;
+	}
+}
+
+static int psm_error(uint32_t ret)
+{
+	switch (ret) {
+	case FDS_SUCCESS:                   return MI_SUCCESS;
+	case FDS_ERR_NO_SPACE_IN_QUEUES:    return MI_ERROR_RESOURCES;
+	case FDS_ERR_NO_SPACE_IN_FLASH:     return MI_ERROR_NO_MEM;
+	case FDS_ERR_RECORD_TOO_LARGE:      return MI_ERROR_DATA_SIZE;
+	case FDS_ERR_NOT_INITIALIZED:       return MI_ERROR_NOT_INIT;
+	case FDS_ERR_NULL_ARG:              return MI_ERROR_NULL;
+	case FDS_ERR_UNALIGNED_ADDR:        return MI_ERROR_INVALID_ADDR;
+	case FDS_ERR_INVALID_ARG:           return MI_ERROR_INVALID_PARAM;
+	case FDS_ERR_BUSY:                  return MI_ERROR_BUSY;
+	default:                            return MI_ERROR_INTERNAL;
+	}
+}
+
 static void mi_psm_fds_evt_handler(fds_evt_t const * const p_fds_evt)
 {
     switch (p_fds_evt->id) {
@@ -20,6 +113,8 @@ static void mi_psm_fds_evt_handler(fds_evt_t const * const p_fds_evt)
 		break;
 		
 	case FDS_EVT_WRITE:
+		if ((uint32_t)p_fds_evt->write.file_id == MI_RECORD_FILE_ID)
+			psm_write_end(p_fds_evt->write.record_key, p_fds_evt->result);
 		if (p_fds_evt->result == FDS_SUCCESS) {
 			NRF_LOG_INFO("FDS_EVT_WR SUCCESS\n");
 			if ((uint32_t)p_fds_evt->write.file_id == MI_RECORD_FILE_ID) {
@@ -31,6 +126,8 @@ static void mi_psm_fds_evt_handler(fds_evt_t const * const p_fds_evt)
 		break;
 		
 	case FDS_EVT_UPDATE:
+		if ((uint32_t)p_fds_evt->write.file_id == MI_RECORD_FILE_ID)
+			psm_write_end(p_fds_evt->write.record_key, p_fds_evt->result);
 		if (p_fds_evt->result == FDS_SUCCESS) {
 			NRF_LOG_INFO("FDS_EVT_UPDATE SUCCESS\n");
 			if ((uint32_t)p_fds_evt->write.file_id == MI_RECORD_FILE_ID) {
@@ -69,6 +166,16 @@ static void mi_psm_fds_evt_handler(fds_evt_t const * const p_fds_evt)
 		}else{
 			NRF_LOG_INFO("FDS_EVT_GC FAILED\n");
 		}
+		if (psm_gc_write.state == PSM_GC_RUNNING) {
+			uint32_t ret = psm_record_write(psm_gc_write.key, psm_gc_write.p_data, psm_gc_write.len);
+			if (ret == FDS_SUCCESS) {
+				psm_gc_write.state  = PSM_GC_WRITING;
+			} else {
+				NRF_LOG_ERROR("mi psm write KEY %X failed after gc: %d\n", psm_gc_write.key, ret);
+				psm_gc_write.result = ret;
+				psm_gc_write.state  = PSM_GC_DONE;
+			}
+		}
 		break;
     }
 }
@@ -83,8 +190,7 @@ void mi_psm_init(void)
     APP_ERROR_CHECK(errno);
 }
 
-/**@brief Flash Write function type. */
-int mi_psm_record_write(uint16_t rec_key, uint8_t *in, uint16_t in_len)
+static uint32_t psm_record_write(uint16_t rec_key, uint8_t *in, uint16_t in_len)
 {
     uint32_t ret = 0;
     fds_record_t        record;
@@ -111,20 +217,54 @@ int mi_psm_record_write(uint16_t rec_key, uint8_t *in, uint16_t in_len)
 		ret = fds_record_write(&record_desc, &record); 
 	}
 
-	if (ret == FDS_ERR_NO_SPACE_IN_QUEUES)
-	{
-		NRF_LOG_INFO("mi psm write KEY %X failed :%d \n", rec_key, ret);
-		ret = MI_ERROR_RESOURCES;
+	if (ret == FDS_SUCCESS)
+		psm_write_phase_begin(rec_key);
+
+	return ret;
+}
+
+/**@brief Flash Write function type.
+ *
+ * Returns MI_SUCCESS once the write is queued, @p in must stay valid until it
+ * is done. If the flash is full the write is done again after fds_gc(); it
+ * returns MI_ERROR_BUSY until that is in flash, then MI_SUCCESS, or the error,
+ * to the writer calling again with the same key. Other writes get
+ * MI_ERROR_BUSY meanwhile. MI_ERROR_RESOURCES means the FDS queue is full;
+ * either way the caller tries again later.
+ */
+int mi_psm_record_write(uint16_t rec_key, uint8_t *in, uint16_t in_len)
+{
+    uint32_t ret = 0;
+	psm_gc_state_t state = psm_gc_write.state;
+
+	if (state == PSM_GC_DONE) {
+		/* the outcome is the writer's, anyone else only clears it */
+		psm_gc_write.state = PSM_GC_IDLE;
+		if (psm_gc_write.key == rec_key)
+			return psm_error(psm_gc_write.result);
+	} else if (state != PSM_GC_IDLE) {
+		return MI_ERROR_BUSY;
 	}
-	else if (ret == FDS_ERR_NO_SPACE_IN_FLASH)
+
+	ret = psm_record_write(rec_key, in, in_len);
+
+	if (ret == FDS_ERR_NO_SPACE_IN_FLASH)
 	{
 		NRF_LOG_INFO("mi psm startup fds_gc().\n");
+		psm_gc_write.key    = rec_key;
+		psm_gc_write.len    = in_len;
+		psm_gc_write.p_data = in;
+		psm_gc_write.state  = PSM_GC_RUNNING;
 		ret = fds_gc();
-		if (ret != FDS_SUCCESS)
-			NRF_LOG_ERROR("WTF? \n");
+		if (ret == FDS_SUCCESS)
+			return MI_ERROR_BUSY;
+		psm_gc_write.state  = PSM_GC_IDLE;
 	}
+
+	if (ret != FDS_SUCCESS)
+		NRF_LOG_INFO("mi psm write KEY %X failed :%d \n", rec_key, ret);
     
-    return ret;
+    return psm_error(ret);
 }
 
 /**@brief Flash Read function type. */
@@ -14,6 +14,11 @@ typedef enum {
 	REC_STATUS             = 0x0003,
 
 	REC_MKPK_KEY           = 0x0010,
+
+	REC_MSC_CACHE          = 0x0020,
+	REC_MSC_DEV_CERT,
+	REC_MSC_MANU_CERT,
+	REC_MSC_SHARED_SIGN,
 } mi_psm_record_t;
 
 extern uint8_t m_psm_done;
@@ -12,12 +12,20 @@
 
 #include "sha256_hkdf.h"
 #include "ccm.h"
+#include "ccm_fixed.h"
+#include "mi_config.h"
 #include "mi_secure.h"
 #include "mi_crypto.h"
+#include "mi_crypto_engine.h"
+#include "mi_hkdf_salts.h"
 #include "mi_error.h"
 #include "mi_beacon.h"
 #include "mi_psm.h"
+#include "mi_metrics.h"
 #include "ble_mi_secure.h"
+#ifdef M_TEST
+#include "crypto_bench.h"
+#endif
 
 #if defined(__CC_ARM)
   #pragma anon_unions
@@ -69,6 +77,8 @@ typedef struct {
 #define  RTC_TIME_DRIFT  600
 
 APP_TIMER_DEF(mi_schd_timer);
+APP_TIMER_DEF(mi_schd_wake_timer);
+APP_TIMER_DEF(mi_schd_poll_timer);
 
 static struct {
 	uint8_t msc_info   :1 ;
@@ -90,8 +100,6 @@ static struct {
 } flags;
 
 uint8_t app_pub[64];
-uint8_t msc_info[12];
-uint8_t dev_pub[64];
 uint8_t dev_sha[32];
 uint8_t eph_key[32];
 uint8_t LTMK[32];
@@ -133,6 +141,11 @@ session_ctx_t cloud_key;
 static uint8_t nonce[12] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
                          0x19, 0x1a, 0x1b};
 
+/* The fixed shapes of the register / login / share data, see ccm_fixed.h. */
+CCM_FIXED_DEFINE(reg_ccm,   sizeof(nonce), 0, sizeof(encrypt_reg_data.cipher),   4)
+CCM_FIXED_DEFINE(login_ccm, sizeof(nonce), 0, sizeof(encrypt_login_data.cipher), 4)
+CCM_FIXED_DEFINE(share_ccm, sizeof(nonce), 0, sizeof(encrypt_share_data.cipher), 4)
+
 msc_info_t tmp_info;
 
 struct {
@@ -142,15 +155,32 @@ struct {
 	uint8_t reserve: 5;
 } pt_flags;
 
-struct {
-	uint16_t dev;
-	uint16_t manu;
-	uint16_t root;
-} m_certs_len;
+/*
+ * What the MSC answers the same for the life of the chip, kept across resets
+ * (see msc_cache_load()). The certificates are records of their own, an FDS
+ * page of the nRF51 is 1 KB.
+ */
+static __ALIGN(4) struct {
+	uint16_t version;
+	uint16_t protocol_ver;
+	uint8_t  msc_info[12];          /* MSC_ID, sw_ver and protocol_ver */
+	uint8_t  dev_pub[64];           /* sent along with msc_info */
+	struct {
+		uint16_t dev;
+		uint16_t manu;
+		uint16_t root;
+	} certs_len;
+	uint32_t crc;                   /* of all the above and the certificates */
+} msc_cache;
 
-uint8_t dev_cert[512];
-uint8_t manu_cert[512];
+static __ALIGN(4) uint8_t dev_cert[512];
+static __ALIGN(4) uint8_t manu_cert[512];
 
+/*
+ * The salts are only used through their HMAC midstates in mi_hkdf_salts.c;
+ * after changing one, run `make -C host hkdf-salts`. The TEST target checks
+ * that both agree.
+ */
 const uint8_t reg_salt[] = "smartcfg-setup-salt";
 const uint8_t reg_info[] = "smartcfg-setup-info";
 const uint8_t log_salt[] = "smartcfg-login-salt";
@@ -162,11 +192,43 @@ const uint8_t cloud_info[] = "smartcfg-cloud-info";
 const uint8_t mk_salt[] = "smartcfg-masterkey-salt";
 const uint8_t mk_info[] = "smartcfg-masterkey-info";
 
-static uint32_t schd_time;
+static uint32_t schd_time;         /* ms since mi_scheduler_start(), as of this pass */
 static uint32_t schd_stat;
 static uint32_t schd_interval = 64;
 static pt_t pt1, pt2, pt3, pt4;
 
+/*
+ * Wake-ups
+ *
+ * The threads run when something they may wait on happened: mi_scheduler_wake()
+ * from the TWI, GATT and crypto engine handlers sets a bit in schd_pending and,
+ * if none was pending, starts the single shot wake timer. The periodic timer
+ * is only the fallback for the timeouts and the few waits with no event. A
+ * pass is repeated right away while it moves a thread on, since the threads
+ * also wait on each other (the flags).
+ */
+#define SCHD_PASS_MAX      4
+#define MI_SCHD_WAKE_SELF  (1UL << 31)        /* a pass limit was hit */
+#define MSC_POLL_MAX_MS    10
+
+static volatile uint32_t schd_pending;
+static uint32_t schd_rtc;           /* RTC1 counter at the last pass */
+static uint32_t schd_ticks;         /* RTC1 ticks since mi_scheduler_start() */
+static uint32_t schd_prescaler;     /* of RTC1, as given to mi_scheduler_init() */
+
+static uint32_t schd_ticks_ms(uint32_t ticks)
+{
+	uint32_t hz = APP_TIMER_CLOCK_FREQ / (schd_prescaler + 1);
+
+	return ticks / hz * 1000 + ticks % hz * 1000 / hz;
+}
+
+static struct {
+	uint16_t ticks;                 /* fallback timer wake-ups */
+	uint16_t wakes;                 /* event and poll wake-ups */
+	uint16_t passes;
+} schd_stats;
+
 /*** Pseduo timer ***/
 typedef struct {
 	int start;
@@ -174,7 +236,7 @@ typedef struct {
 } timer_t;
 
 static void timer_set(timer_t * t, int interval_ms)
-{ t->interval = (interval_ms << 5) / schd_interval; t->start = schd_time; }
+{ t->interval = interval_ms; t->start = schd_time; }
 
 static int timer_expired(timer_t * t, void (*handler)(void))
 {
@@ -233,16 +295,22 @@ extern fast_xfer_t fast_control_block;
 extern reliable_xfer_t rxfer_control_block;
 
 static void mi_scheduler(void * p_context);
+static void mi_scheduler_wake_handler(void * p_context);
+static void mi_scheduler_run(void * p_context);
 static void sys_procedure(uint32_t type);
 static void reg_procedure(void);
 static void admin_login_procedure(void);
 static void shared_login_procedure(void);
 static int monitor(pt_t *pt);
+static int msc_exec_thread(pt_t *pt);
+static void msc_flush(void);
+static void msc_cache_flush(void);
 
 static uint32_t key_id;
 static mi_author_stat_t mi_authorization_status;
 static mi_schd_event_handler_t m_user_event_handler;
 static uint8_t m_is_registered;
+static mi_keysched_t key_sched;
 
 static __ALIGN(4) struct {
 	uint8_t  did[8];
@@ -250,6 +318,8 @@ static __ALIGN(4) struct {
 	uint8_t  cloud_key[16];
 } mi_sysinfo;
 
+static mbedtls_ccm_context cloud_ccm;
+
 int get_mi_reg_stat(void)
 {
 	return m_is_registered;
@@ -275,12 +345,20 @@ uint32_t get_mi_authorization(void)
 }
 
 
-uint32_t mi_scheduler_init(uint32_t interval, mi_schd_event_handler_t handler)
+uint32_t mi_scheduler_init(uint32_t interval, uint32_t prescaler, mi_schd_event_handler_t handler)
 {
 	int32_t errno;
-	schd_interval = interval;
+	schd_interval  = interval;
+	schd_prescaler = prescaler;
+	mi_metrics_init(prescaler);
 	errno = app_timer_create(&mi_schd_timer, APP_TIMER_MODE_REPEATED, mi_scheduler);
 	APP_ERROR_CHECK(errno);
+	errno = app_timer_create(&mi_schd_wake_timer, APP_TIMER_MODE_SINGLE_SHOT, mi_scheduler_wake_handler);
+	APP_ERROR_CHECK(errno);
+	errno = app_timer_create(&mi_schd_poll_timer, APP_TIMER_MODE_SINGLE_SHOT, mi_scheduler_wake_handler);
+	APP_ERROR_CHECK(errno);
+	errno = mi_crypto_engine_init();
+	APP_ERROR_CHECK(errno);
 
 	if (handler != NULL)
 		m_user_event_handler = handler;
@@ -297,9 +375,15 @@ uint32_t mi_scheduler_start(uint32_t auth_stat)
 	if (schd_stat == 0) {
 		schd_stat = auth_stat;
 		schd_time = 0;
+		schd_ticks = 0;
+		schd_rtc = app_timer_cnt_get();
+		memset(&schd_stats, 0, sizeof(schd_stats));
 	} else
 		return -1;
 
+	if ((auth_stat & 0xF0UL) != SYS_TYPE)
+		mi_metrics_begin(auth_stat);
+
 	PT_INIT(&pt1);
 	PT_INIT(&pt2);
 	PT_INIT(&pt3);
@@ -312,7 +396,7 @@ uint32_t mi_scheduler_start(uint32_t auth_stat)
 
 	NRF_LOG_WARNING(" START %X\n\n", schd_stat);
 
-	mi_scheduler(&schd_stat);
+	mi_scheduler_run(&schd_stat);
 	app_timer_stop(mi_schd_timer);
 	errno = app_timer_start(mi_schd_timer, schd_interval, &schd_stat);
 	APP_ERROR_CHECK(errno);
@@ -325,66 +409,108 @@ static uint32_t mi_scheduler_stop(int type)
 	int32_t errno;
 	errno = app_timer_stop(mi_schd_timer);
 	APP_ERROR_CHECK(errno);
+	app_timer_stop(mi_schd_wake_timer);
+	app_timer_stop(mi_schd_poll_timer);
+	mi_keysched_clear(&key_sched);
+	msc_flush();
+	NRF_LOG_RAW_INFO("SCHD %X: %d ms, ", schd_stat, schd_time);
+	NRF_LOG_RAW_INFO("%d wake-ups (%d by the tick), %d passes\n",
+	                 schd_stats.ticks + schd_stats.wakes, schd_stats.ticks, schd_stats.passes);
+	mi_metrics_end(type, schd_stats.ticks + schd_stats.wakes, schd_stats.passes);
 	return errno;
 }
 
+void mi_scheduler_wake(uint32_t sources)
+{
+	uint32_t was_pending;
+
+	CRITICAL_REGION_ENTER();
+	was_pending  = schd_pending;
+	schd_pending = was_pending | sources;
+	CRITICAL_REGION_EXIT();
+
+	if (was_pending == 0 && schd_stat != 0)
+		app_timer_start(mi_schd_wake_timer, APP_TIMER_MIN_TIMEOUT_TICKS, &schd_stat);
+}
+
+/* A wait with no event behind it: look again in ms, unless already set to. */
+static void mi_scheduler_poll(uint32_t ms)
+{
+	app_timer_start(mi_schd_poll_timer, APP_TIMER_TICKS(ms, schd_prescaler), &schd_stat);
+}
+
 #ifdef M_TEST
-void aes_ecb_test();
-void aes_ccm_test();
-void aes_ccm_test2();
-static uint8_t msg[20] = "helloworld";
-static uint8_t cipher[20] = {0};
-static uint8_t plain[20] = {0};
-uint8_t test_str[] = {12, 1,2,3,4,5,6,7,8,9,0,1,2,
-					   1, 0,
-					  16, 0,'x',0xD,0xE,0xA,0xD,0xB,0xE,0xE,0xF,'a','b','c','d','e',30,
-                      16, 1,2,3,4,5,6,7,8,9,0,1,2,3,4,5,6};
+/*
+ * Crypto benchmark (crypto_bench.c), one case per scheduler tick so that the
+ * deferred log keeps up. The rows are CSV; a case slower than its baseline
+ * in crypto_bench.c is marked FAIL.
+ */
+/* The HKDF from each stored salt midstate against sha256_hkdf() with the salt. */
+static int hkdf_salts_self_test(void)
+{
+	static const struct {
+		const uint8_t           *salt;
+		uint8_t                  salt_len;
+		const sha256_hmac_state *salt_hmac;
+	} salts[] = {
+		{ reg_salt,   sizeof(reg_salt) - 1,   &reg_salt_hmac   },
+		{ log_salt,   sizeof(log_salt) - 1,   &log_salt_hmac   },
+		{ share_salt, sizeof(share_salt) - 1, &share_salt_hmac },
+		{ cloud_salt, sizeof(cloud_salt) - 1, &cloud_salt_hmac },
+		{ mk_salt,    sizeof(mk_salt) - 1,    &mk_salt_hmac    },
+	};
+	sha256_hkdf_context ctx;
+	uint8_t ikm[64], ref[64], okm[64];
+	int i, failed = 0;
+
+	for (i = 0; i < sizeof(ikm); i++)
+		ikm[i] = i;
+
+	for (i = 0; i < sizeof(salts) / sizeof(salts[0]); i++) {
+		sha256_hkdf(ikm, sizeof(ikm), (void *)salts[i].salt, salts[i].salt_len,
+		            (void *)log_info, sizeof(log_info) - 1, ref, sizeof(ref));
+
+		sha256_hkdf_extract_state(&ctx, salts[i].salt_hmac, ikm, sizeof(ikm));
+		sha256_hkdf_expand_next(&ctx, log_info, sizeof(log_info) - 1, okm);
+		sha256_hkdf_expand_next(&ctx, log_info, sizeof(log_info) - 1, okm + 32);
+		sha256_hkdf_free(&ctx);
+
+		if (memcmp(ref, okm, sizeof(ref)) != 0) {
+			NRF_LOG_RAW_INFO("HKDF salt %s: stored midstates do not match\n",
+			                 (uint32_t)salts[i].salt);
+			failed++;
+		}
+	}
+
+	return failed;
+}
 
 int test_thd(pt_t *pt)
 {
 	PT_BEGIN(pt);
-	static int i;
-	static uint16_t len;
-//	session_ctx_t key = {0};
-//	memcpy(key.app_key, "DUMMY KEY", 10);
-//	memcpy(key.dev_key, "DUMMY KEY", 10);
-//	memcpy(key.dev_iv , "DUMMY KEY", 4);
-//	memcpy(key.app_iv , "DUMMY KEY", 4);
-//	mi_crypto_init(&key);
-
-//	mi_session_encrypt(msg, 10, msg);
-//	NRF_LOG_RAW_HEXDUMP_INFO(msg, 16);
-
-//	mi_session_decrypt(msg, 10+6, cipher);
-//	NRF_LOG_RAW_HEXDUMP_INFO(cipher, 16);
-
-    
-
-//	i = 1000;
-//	nrf_gpio_pin_set(PROFILE_PIN);
-//	while(i--)
-//	aes_ccm_test();
-//	nrf_gpio_pin_clear(PROFILE_PIN);
-	
-//	i = 1000;
-//	nrf_gpio_pin_set(PROFILE_PIN);
-//	while(i--)
-//	aes_ccm_test2();
-//	nrf_gpio_pin_clear(PROFILE_PIN);
-
-//	i = 1;
-//	nrf_gpio_pin_set(PROFILE_PIN);
-//	while(i--)
-//	sha256_hkdf(   test_str,          32,
-//		  (void *)share_salt,         sizeof(share_salt)-1,
-//	      (void *)share_info,         sizeof(share_info)-1,
-//	    (void *)&session_key,         64);
-//	nrf_gpio_pin_clear(PROFILE_PIN);
-//	msc_control_block = MSC_XFER(MSC_AESCCM_ENC, test_str, sizeof(test_str), cipher, 20);
-//	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-//	NRF_LOG_HEXDUMP_INFO(cipher, 20);
-
-//	PT_YIELD(pt);
+	static int i, ret, failed;
+	static crypto_bench_result_t res;
+
+	failed = hkdf_salts_self_test();
+	NRF_LOG_RAW_INFO("HKDF salt self test: %s\n", (uint32_t)(failed ? "FAIL" : "ok"));
+	PT_YIELD(pt);
+
+	failed = mi_crypto_self_test();
+	NRF_LOG_RAW_INFO("Session self test: %s\n", (uint32_t)(failed ? "FAIL" : "ok"));
+	PT_YIELD(pt);
+
+	NRF_LOG_RAW_INFO(CRYPTO_BENCH_HEADER);
+
+	for (i = 0, failed = 0; i < crypto_bench_num(); i++) {
+		ret = crypto_bench_run(i, &res);
+		failed += ret;
+		NRF_LOG_RAW_INFO("%s,%d,%d,", (uint32_t)res.name, res.len, res.iters);
+		NRF_LOG_RAW_INFO("%d,%d,%d,%s\n", res.ns, res.cycles, res.baseline_ns,
+		                 (uint32_t)(ret ? "FAIL" : res.baseline_ns ? "ok" : "new"));
+		PT_YIELD(pt);
+	}
+
+	NRF_LOG_RAW_INFO("crypto bench: %d of %d cases failed\n", failed, crypto_bench_num());
 
 	PT_WAIT_UNTIL(pt, 0);
 	PT_END(pt);
@@ -393,9 +519,81 @@ int test_thd(pt_t *pt)
 
 static void mi_scheduler(void * p_context)
 {
-	schd_time++;
+	schd_stats.ticks++;
+	mi_scheduler_run(p_context);
+}
+
+static void mi_scheduler_wake_handler(void * p_context)
+{
+	schd_stats.wakes++;
+	mi_scheduler_run(p_context);
+}
+
+static void schd_time_update(void)
+{
+	uint32_t now = app_timer_cnt_get();
+	uint32_t diff;
+
+	app_timer_cnt_diff_compute(now, schd_rtc, &diff);
+	schd_rtc    = now;
+	schd_ticks += diff;
+	schd_time   = schd_ticks_ms(schd_ticks);
+}
+
+/* The spawned threads. */
+pt_t pt_resend, pt_send;
+static pt_t pt_r_rx_thd, pt_r_tx_thd, pt_msc_thd, pt_cache_thd;
+
+/* What a pass changes when it moves a thread on. */
+typedef struct {
+	lc_t    lc[10];
+	uint8_t flags[sizeof(flags)];
+	uint8_t pt_flags[sizeof(pt_flags)];
+} schd_snapshot_t;
+
+static void schd_snapshot(schd_snapshot_t *p)
+{
+	p->lc[0] = pt1.lc;
+	p->lc[1] = pt2.lc;
+	p->lc[2] = pt3.lc;
+	p->lc[3] = pt4.lc;
+	p->lc[4] = pt_resend.lc;
+	p->lc[5] = pt_send.lc;
+	p->lc[6] = pt_r_rx_thd.lc;
+	p->lc[7] = pt_r_tx_thd.lc;
+	p->lc[8] = pt_msc_thd.lc;
+	p->lc[9] = pt_cache_thd.lc;
+	memcpy(p->flags, &flags, sizeof(flags));
+	memcpy(p->pt_flags, &pt_flags, sizeof(pt_flags));
+}
+
+static void mi_scheduler_pass(uint32_t proc_type);
+
+/* The passes of one wake-up, from the tick, an event or a poll. */
+static void mi_scheduler_run(void * p_context)
+{
 	uint32_t proc_type = *(uint32_t*)p_context;
-	
+	schd_snapshot_t before, after;
+	uint8_t n = 0;
+
+	schd_time_update();
+	do {
+		schd_pending = 0;
+		schd_snapshot(&before);
+		mi_scheduler_pass(proc_type);
+		schd_stats.passes++;
+		schd_snapshot(&after);
+	} while (schd_stat != 0 &&
+	         memcmp(&before, &after, sizeof(before)) != 0 && ++n < SCHD_PASS_MAX);
+
+	/* still moving, let the other interrupts in first */
+	if (n == SCHD_PASS_MAX)
+		mi_scheduler_wake(MI_SCHD_WAKE_SELF);
+}
+
+/* One pass over the threads. */
+static void mi_scheduler_pass(uint32_t proc_type)
+{
 #ifdef M_TEST
 
 //	fast_xfer_test(&pt1);
@@ -424,6 +622,10 @@ static void mi_scheduler(void * p_context)
 		break;
 	}
 	
+	msc_exec_thread(&pt_msc_thd);
+
+	msc_cache_flush();
+
 	monitor(&pt4);
 
 	nrf_gpio_pin_clear(PROFILE_PIN);
@@ -454,7 +656,9 @@ static uint16_t find_lost_sn(reliable_xfer_t *pxfer)
 	}
 }
 
-pt_t pt_resend;
+static mi_metrics_phase_t rxfer_rx_phase;
+static mi_metrics_phase_t rxfer_tx_phase;
+
 static int pthd_resend(pt_t *pt, reliable_xfer_t *pxfer)
 {
 	PT_BEGIN(pt);
@@ -469,6 +673,7 @@ static int pthd_resend(pt_t *pt, reliable_xfer_t *pxfer)
 		}
 		else {
 			NRF_LOG_ERROR("lost packet %d.\n", sn);
+			mi_metrics_phase_retry(&rxfer_rx_phase);
 			PT_WAIT_UNTIL(pt, reliable_xfer_ack(A_LOST, sn) == NRF_SUCCESS);
 			PT_WAIT_UNTIL(pt, pxfer->curr_sn == sn);
 		}
@@ -477,7 +682,6 @@ static int pthd_resend(pt_t *pt, reliable_xfer_t *pxfer)
 	PT_END(pt);
 }
 
-pt_t pt_send;
 static int pthd_send(pt_t *pt, reliable_xfer_t *pxfer)
 {
 	PT_BEGIN(pt);
@@ -498,6 +702,7 @@ static int pthd_send(pt_t *pt, reliable_xfer_t *pxfer)
 			break;
 		}
 		else if(pxfer->curr_sn <= pxfer->tx_num) {
+			mi_metrics_phase_retry(&rxfer_tx_phase);
 			PT_WAIT_UNTIL(pt, reliable_xfer_data(pxfer, pxfer->curr_sn) == NRF_SUCCESS);
 		}
 		pxfer->curr_sn = 0;
@@ -511,6 +716,7 @@ static int format_rx_cb(reliable_xfer_t *pxfer, void *p_rxd, uint16_t rxd_bytes)
 	pxfer->pdata = p_rxd;
 	pxfer->max_rx_num = CEIL_DIV(rxd_bytes, 18);
 	pxfer->last_bytes  = last_bytes == 0 ? 18 : last_bytes;
+	pxfer->rx_hook = NULL;
 	return 0;
 }
 
@@ -523,14 +729,161 @@ static int format_tx_cb(reliable_xfer_t *pxfer, void *p_txd, uint16_t txd_bytes)
 	return 0;
 }
 
+/*** Frame by frame decryption ***/
+/*
+ * The encrypted login / share data is decrypted while the frames arrive, so the
+ * MIC is checked as soon as the last frame lands. The raw frames are still kept
+ * in the rx buffer: lost frame detection scans it, and when frames come out of
+ * order or before the session key is ready, the auth thread falls back to
+ * decrypting the whole buffer.
+ */
+typedef enum {
+	RXD_IDLE = 0,
+	RXD_RUN,
+	RXD_DONE,
+	RXD_BROKEN
+} rxd_decrypt_stat_t;
+
+static struct {
+	mbedtls_ccm_context ccm;
+	mbedtls_ccm_stream  stream;
+	uint8_t            *p_out;
+	const uint8_t      *p_mic;
+	uint16_t       cipher_len;
+	uint16_t          next_sn;
+	rxd_decrypt_stat_t  state;
+	int                result;
+} rxd_decrypt;
+
+static mi_metrics_phase_t ccm_phase;
+
+static void rxd_decrypt_reset(void)
+{
+	rxd_decrypt.next_sn = 1;
+	rxd_decrypt.state   = RXD_IDLE;
+}
+
+static void rxd_decrypt_hook(uint16_t sn, const uint8_t *pdata, uint8_t len)
+{
+	uint16_t offset = (sn - 1) * 18;
+	uint16_t cipher_bytes;
+
+	if (rxd_decrypt.state != RXD_RUN || sn != rxd_decrypt.next_sn) {
+		if (rxd_decrypt.state != RXD_DONE)
+			rxd_decrypt.state = RXD_BROKEN;
+		mi_metrics_phase_end(&ccm_phase);
+		return;
+	}
+
+	if (offset < rxd_decrypt.cipher_len) {
+		cipher_bytes = rxd_decrypt.cipher_len - offset;
+		if (cipher_bytes > len)
+			cipher_bytes = len;
+		mbedtls_ccm_update(&rxd_decrypt.stream, pdata, cipher_bytes, rxd_decrypt.p_out + offset);
+	}
+	rxd_decrypt.next_sn++;
+
+	/* The MIC follows the cipher text and is already in the rx buffer. */
+	if (offset + len >= rxd_decrypt.cipher_len + 4) {
+		rxd_decrypt.result = mbedtls_ccm_finish(&rxd_decrypt.stream, (void*)rxd_decrypt.p_mic);
+		if (rxd_decrypt.result != 0)
+			memset(rxd_decrypt.p_out, 0, rxd_decrypt.cipher_len);
+		rxd_decrypt.state = RXD_DONE;
+		mi_metrics_phase_end(&ccm_phase);
+	}
+}
+
+static void rxd_decrypt_start(const uint8_t *key, void *p_out, const void *p_mic, uint16_t cipher_len)
+{
+	if (rxd_decrypt.state != RXD_IDLE || rxd_decrypt.next_sn != 1) {
+		rxd_decrypt.state = RXD_BROKEN;
+		return;
+	}
+
+	mbedtls_ccm_setkey(&rxd_decrypt.ccm, key);
+	mbedtls_ccm_starts(&rxd_decrypt.stream, &rxd_decrypt.ccm, MBEDTLS_CCM_DECRYPT,
+	                   nonce, sizeof(nonce), 0, cipher_len, 4);
+	rxd_decrypt.p_out      = p_out;
+	rxd_decrypt.p_mic      = p_mic;
+	rxd_decrypt.cipher_len = cipher_len;
+	rxd_decrypt.state      = RXD_RUN;
+	/* runs along with the transfer, arg 1 */
+	mi_metrics_phase_begin(&ccm_phase, MI_PHASE_CCM, 1);
+}
+
+static void reg_data_encrypt(void)
+{
+	mbedtls_ccm_context ccm;
+	mbedtls_ccm_fixed   tmpl;
+
+	mi_metrics_phase_begin(&ccm_phase, MI_PHASE_CCM, 0);
+	mbedtls_ccm_init(&ccm);
+	mbedtls_ccm_setkey(&ccm, session_key.dev_key);
+	reg_ccm_template(&tmpl, nonce);
+	reg_ccm_encrypt(&ccm, &tmpl, NULL, dev_sign, encrypt_reg_data.cipher, encrypt_reg_data.mic);
+	mbedtls_ccm_free(&ccm);
+	mi_metrics_phase_end(&ccm_phase);
+}
+
+/*** Crypto jobs ***/
+/*
+ * The key derivations run in mi_crypto_engine from the main loop instead of in
+ * the scheduler. A thread starts the key schedule, then waits for each
+ * field of the output before its first use:
+ *
+ *	PT_WAIT_UNTIL(pt, keysched_start(...) == MI_SUCCESS);
+ *	PT_WAIT_UNTIL(pt, mi_keysched_ready(&key_sched, MI_KEYSCHED_FIELD(session_ctx_t, dev_key)));
+ *
+ * Only the 32 byte HKDF blocks holding a field that is used are computed. The
+ * start waits out a job left over from an aborted procedure. On completion the
+ * threads are run once right away rather than at the next tick.
+ */
+
+static mi_metrics_phase_t hkdf_phase;
+
+static void crypto_job_handler(mi_crypto_job_t *p_job)
+{
+	mi_metrics_phase_end(&hkdf_phase);
+	mi_scheduler_wake(MI_SCHD_WAKE_CRYPTO);
+}
+
+/* The salts are constants, their HMAC midstates come from mi_hkdf_salts.c. */
+static int keysched_start(const uint8_t *ikm,  uint16_t ikm_len,
+                          const sha256_hmac_state *salt_hmac,
+                          const uint8_t *info, uint16_t info_len,
+                          void *out, uint16_t out_len)
+{
+	int errno = mi_keysched_start_salt(&key_sched, ikm, ikm_len, salt_hmac,
+	                                   info, info_len, out, out_len, crypto_job_handler);
+	if (errno == MI_SUCCESS)
+		mi_metrics_phase_begin(&hkdf_phase, MI_PHASE_HKDF, MI_CRYPTO_JOB_HKDF_EXTRACT);
+
+	return errno;
+}
+
+/* mi_keysched_ready(), timing the expansion it submits. */
+static int key_ready(uint16_t offset, uint16_t len)
+{
+	int busy = mi_crypto_job_busy(&key_sched.job);
+
+	if (mi_keysched_ready(&key_sched, offset, len))
+		return 1;
+
+	if (!busy && mi_crypto_job_busy(&key_sched.job))
+		mi_metrics_phase_begin(&hkdf_phase, MI_PHASE_HKDF, MI_CRYPTO_JOB_HKDF_EXPAND);
+
+	return 0;
+}
+
+#define KEY_READY(type, field)      key_ready(MI_KEYSCHED_FIELD(type, field))
 
-static pt_t pt_r_rx_thd;
 static int rxfer_rx_thd(pt_t *pt, reliable_xfer_t *pxfer, uint8_t data_type)
 {
 	static uint8_t retries_num;
 	static timer_t timeout_timer;
 
 	PT_BEGIN(pt);
+	mi_metrics_phase_begin(&rxfer_rx_phase, MI_PHASE_RXFER_RX, data_type);
 
 	/* Recive data */
 	PT_WAIT_UNTIL(pt, pxfer->rx_num != 0 && pxfer->cmd == data_type);
@@ -559,14 +912,16 @@ static int rxfer_rx_thd(pt_t *pt, reliable_xfer_t *pxfer, uint8_t data_type)
 	pxfer->state = RXFER_WAIT_CMD;
 	pxfer->rx_num = 0;
 	pxfer->pdata  = 0;
+	pxfer->rx_hook = NULL;
+	mi_metrics_phase_end(&rxfer_rx_phase);
 
 	PT_END(pt);
 }
 
-static pt_t pt_r_tx_thd;
 static int rxfer_tx_thd(pt_t *pt, reliable_xfer_t *pxfer, uint8_t data_type)
 {
 	PT_BEGIN(pt);
+	mi_metrics_phase_begin(&rxfer_tx_phase, MI_PHASE_RXFER_TX, data_type);
 
 	/* Send data. */
 	PT_WAIT_UNTIL(pt, reliable_xfer_cmd(data_type, pxfer->tx_num) == NRF_SUCCESS);
@@ -582,6 +937,7 @@ static int rxfer_tx_thd(pt_t *pt, reliable_xfer_t *pxfer, uint8_t data_type)
 
 	pxfer->state = RXFER_WAIT_CMD;
 	pxfer->tx_num = 0;
+	mi_metrics_phase_end(&rxfer_tx_phase);
 	PT_END(pt);
 }
 
@@ -626,12 +982,45 @@ typedef struct {
 #define MSC_ADDR   0x2A
 #define MSC_SCL    28
 
+#define MSC_PARA_MAX       64       /* ECDHE, the longest command */
+#define MSC_RETRY_MAX      5
+#define MSC_ST_CANCELLED   0xFE     /* dropped by mi_scheduler_stop() */
+
+/* Commands a handshake is waiting on go first. */
+typedef enum {
+	MSC_PRIO_READ = 0,          /* MSC cache */
+	MSC_PRIO_KEY,               /* MKPK */
+	MSC_PRIO_HANDSHAKE          /* ECDHE, SIGN */
+} msc_prio_t;
+
+typedef struct msc_op_s msc_op_t;
+
+typedef void (*msc_op_handler_t)(msc_op_t *p_op);
+
+/* One MSC command, for msc_submit(). */
+struct msc_op_s {
+	msc_xfer_control_block_t xfer;      /* status is 0 once done, else the MSC error */
+	msc_prio_t         prio;
+	msc_op_handler_t   handler;         /* called on completion, may be NULL */
+	uint8_t            pending;
+	uint8_t            retries;
+	uint32_t           queued;          /* RTC ticks from msc_submit() to the bus */
+	uint32_t           service;         /* RTC ticks from the bus to the answer */
+	mi_metrics_phase_t phase;
+	msc_op_t          *p_next;
+};
+
 extern volatile bool m_twi0_xfer_done;
 extern const nrf_drv_twi_t TWI0;
 
 static nrf_drv_twi_xfer_desc_t twi0_xfer;
-static uint8_t twi_buf[515];
-msc_xfer_control_block_t msc_control_block;
+static uint8_t twi_buf[515];                        /* the answer */
+static uint8_t msc_tx_buf[MSC_PARA_MAX + 4];        /* the next command */
+
+static msc_op_t *msc_queue;             /* by priority, then submission */
+static msc_op_t *msc_staged;            /* encoded in msc_tx_buf */
+static msc_op_t *msc_op;                /* on the MSC */
+static msc_op_t *msc_done;              /* its answer, still in twi_buf */
 
 static uint8_t calc_data_xor(uint8_t *pdata, uint16_t len)
 {
@@ -646,22 +1035,23 @@ static int msc_encode_twi_buf(msc_xfer_control_block_t *p_cb)
 	uint16_t para_len = p_cb->p_para == NULL ? 0 : p_cb->para_len;
 	uint16_t cmd_len  = para_len + 1;
 
-	if (cmd_len > 512) {
+	if (para_len > MSC_PARA_MAX) {
 		NRF_LOG_ERROR("MSC para len error.\n");
 		return 1;
 	}
 	
-	twi_buf[0] = cmd_len >> 8;
-	twi_buf[1] = cmd_len & 0xFF;
-	twi_buf[2] = p_cb->cmd;
+	msc_tx_buf[0] = cmd_len >> 8;
+	msc_tx_buf[1] = cmd_len & 0xFF;
+	msc_tx_buf[2] = p_cb->cmd;
 
-	memcpy(twi_buf+3, p_cb->p_para, para_len);
+	memcpy(msc_tx_buf+3, p_cb->p_para, para_len);
 	
-	twi_buf[3+para_len] = calc_data_xor(twi_buf, para_len + 3);
+	msc_tx_buf[3+para_len] = calc_data_xor(msc_tx_buf, para_len + 3);
 	
 	return 0;
 } 
 
+/* Checks the answer in twi_buf, it is copied out by msc_complete(). */
 static int msc_decode_twi_buf(msc_xfer_control_block_t *p_cb)
 {
 	uint16_t len = (twi_buf[0]<<8) | twi_buf[1];        // contain data + status
@@ -670,6 +1060,7 @@ static int msc_decode_twi_buf(msc_xfer_control_block_t *p_cb)
 		
 	if(data_len != p_cb->data_len) {
 		NRF_LOG_ERROR("MSC return data len error.\n");
+		p_cb->status = 255;
 		return 1;
 	}
 
@@ -687,62 +1078,182 @@ static int msc_decode_twi_buf(msc_xfer_control_block_t *p_cb)
 
 	p_cb->status = twi_buf[2+data_len];
 
-	if (p_cb->p_data != NULL)
-		memcpy(p_cb->p_data, twi_buf+2, data_len);
-	
 	return 0;
 }
 
-static pt_t pt_msc_thd;
-int msc_thread(pt_t *pt, msc_xfer_control_block_t *p_cb)
+/*
+ * The MSC lets go of SCL when the command is done. Nothing signals that (the
+ * pin belongs to the TWI), so it is polled after 1, 2, 4 and 8 ms, then
+ * every MSC_POLL_MAX_MS.
+ */
+static uint8_t msc_poll_ms;
+static int msc_ready(void)
 {
-	uint32_t err_code;
+	if (nrf_gpio_pin_read(MSC_SCL))
+		return 1;
 
-	PT_BEGIN(pt);
+	msc_poll_ms = msc_poll_ms == 0 ? 1 : msc_poll_ms * 2;
+	if (msc_poll_ms > MSC_POLL_MAX_MS)
+		msc_poll_ms = MSC_POLL_MAX_MS;
+	mi_scheduler_poll(msc_poll_ms);
 
-	static uint8_t  retry_times = 0;
-	msc_encode_twi_buf(p_cb);
-	NRF_LOG_INFO("Start MSC cmd 0x%02X @ schd_time %d\n", p_cb->cmd, schd_time);
-	/* 4 = 2bytes lengh + 1byte cmd + 1byte chk  */
-	twi0_xfer = (nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_TX(MSC_ADDR, twi_buf, p_cb->para_len+4);
-	m_twi0_xfer_done = false;
-	err_code = nrf_drv_twi_xfer(&TWI0, &twi0_xfer, 0);
-	APP_ERROR_CHECK(err_code);
-	PT_WAIT_UNTIL(pt, m_twi0_xfer_done);
+	return 0;
+}
 
-	NRF_LOG_INFO("Waiting...  @ schd_time %d\n", schd_time);
-	PT_WAIT_UNTIL(pt, nrf_gpio_pin_read(MSC_SCL));
-	NRF_LOG_INFO("Ready now.  @ schd_time %d\n", schd_time);
-	
-	/* 4 = 2bytes lengh + 1byte status + 1byte chk  */
-	twi0_xfer = (nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_RX(MSC_ADDR, twi_buf, p_cb->data_len+4);
+/*
+ * Queues a command. The op and the buffers of xfer must stay untouched until
+ * it is no longer pending. Returns 0, 1 if the parameters are too long, 2 if
+ * the op is still pending.
+ */
+static int msc_submit(msc_op_t *p_op, msc_xfer_control_block_t xfer, msc_prio_t prio,
+                      msc_op_handler_t handler)
+{
+	msc_op_t **pp;
+
+	if (p_op->pending)
+		return 2;
+	if (xfer.p_para != NULL && xfer.para_len > MSC_PARA_MAX)
+		return 1;
+
+	p_op->xfer    = xfer;
+	p_op->prio    = prio;
+	p_op->handler = handler;
+	p_op->retries = 0;
+	p_op->queued  = app_timer_cnt_get();
+	p_op->pending = 1;
+
+	for (pp = &msc_queue; *pp != NULL && (*pp)->prio >= prio; pp = &(*pp)->p_next)
+		;
+	p_op->p_next = *pp;
+	*pp = p_op;
+
+	return 0;
+}
+
+/* Drops the commands not sent yet, the one on the MSC runs to its end. */
+static void msc_flush(void)
+{
+	msc_op_t *p_op;
+
+	msc_staged = NULL;
+	while (msc_queue != NULL) {
+		p_op = msc_queue;
+		msc_queue = p_op->p_next;
+		p_op->xfer.status = MSC_ST_CANCELLED;
+		p_op->pending = 0;
+		if (p_op->handler != NULL)
+			p_op->handler(p_op);
+	}
+}
+
+static void msc_complete(msc_op_t *p_op)
+{
+	msc_xfer_control_block_t *p_cb = &p_op->xfer;
+
+	if (p_cb->status == 0) {
+		if (p_cb->p_data != NULL)
+			memcpy(p_cb->p_data, twi_buf+2, p_cb->data_len);
+		NRF_LOG_INFO("MSC cmd 0x%02X: %d ms queued, %d ms served, %d retries\n",
+		             p_cb->cmd, schd_ticks_ms(p_op->queued), schd_ticks_ms(p_op->service), p_op->retries);
+	} else {
+		NRF_LOG_ERROR("Cann't run MSC CMD 0x%02X\n", p_cb->cmd);
+	}
+
+	p_op->pending = 0;
+	if (p_op->handler != NULL)
+		p_op->handler(p_op);
+}
+
+static void msc_twi_xfer(nrf_drv_twi_xfer_desc_t desc)
+{
+	uint32_t err_code;
+
+	twi0_xfer = desc;
 	m_twi0_xfer_done = false;
 	err_code = nrf_drv_twi_xfer(&TWI0, &twi0_xfer, 0);
 	APP_ERROR_CHECK(err_code);
-	PT_WAIT_UNTIL(pt, m_twi0_xfer_done);
-	
-	msc_decode_twi_buf(p_cb);
-	if (p_cb->status != 0 ) {
-		if (retry_times < 5) {
-			retry_times++;
-			NRF_LOG_ERROR("CMD 0x%02X Error 0x%02X\n RETRY...\n", p_cb->cmd, p_cb->status);
-			PT_RESTART(pt);
-		} else {
-			retry_times = 0;
-			NRF_LOG_ERROR("Cann't run MSC CMD 0x%02X\n", p_cb->cmd);
-			/* Blocking here, 
-			   TODO: add error status handler    */
-			PT_WAIT_UNTIL(pt, 0);
+}
+
+/*
+ * Runs the queued commands one at a time. While the MSC computes a command the
+ * next one is encoded, and the answer of a command is copied out while the
+ * next one goes out on the bus.
+ */
+static int msc_exec_thread(pt_t *pt)
+{
+	uint32_t now;
+
+	PT_BEGIN(pt);
+
+	while (1) {
+		if (msc_done != NULL && msc_queue == NULL) {
+			msc_complete(msc_done);
+			msc_done = NULL;
 		}
-		
-	}
+		PT_WAIT_UNTIL(pt, msc_queue != NULL);
+
+		msc_op    = msc_queue;
+		msc_queue = msc_op->p_next;
+		now = app_timer_cnt_get();
+		app_timer_cnt_diff_compute(now, msc_op->queued, &msc_op->queued);
+		msc_op->service = now;
+		mi_metrics_phase_begin(&msc_op->phase, MI_PHASE_MSC, msc_op->xfer.cmd);
 
-	NRF_LOG_INFO("Finish MSC cmd 0x%02X @ schd_time %d\n\n", p_cb->cmd, schd_time);
-	p_cb->cmd = NULL;
+		do {
+			if (msc_op != msc_staged)
+				msc_encode_twi_buf(&msc_op->xfer);
+			msc_staged = NULL;
+
+			NRF_LOG_INFO("Start MSC cmd 0x%02X @ schd_time %d\n", msc_op->xfer.cmd, schd_time);
+			/* 4 = 2bytes lengh + 1byte cmd + 1byte chk  */
+			msc_twi_xfer((nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_TX(MSC_ADDR, msc_tx_buf,
+			             (msc_op->xfer.p_para == NULL ? 0 : msc_op->xfer.para_len) + 4));
+			if (msc_done != NULL) {
+				msc_complete(msc_done);
+				msc_done = NULL;
+			}
+			PT_WAIT_UNTIL(pt, m_twi0_xfer_done);
+
+			if (msc_queue != NULL) {
+				msc_staged = msc_queue;
+				msc_encode_twi_buf(&msc_staged->xfer);
+			}
+
+			msc_poll_ms = 0;
+			PT_WAIT_UNTIL(pt, msc_ready());
+			NRF_LOG_INFO("Ready now.  @ schd_time %d\n", schd_time);
+
+			/* 4 = 2bytes lengh + 1byte status + 1byte chk  */
+			msc_twi_xfer((nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_RX(MSC_ADDR, twi_buf, msc_op->xfer.data_len+4));
+			PT_WAIT_UNTIL(pt, m_twi0_xfer_done);
+
+			msc_decode_twi_buf(&msc_op->xfer);
+			if (msc_op->xfer.status != 0 && msc_op->retries < MSC_RETRY_MAX) {
+				msc_op->retries++;
+				mi_metrics_phase_retry(&msc_op->phase);
+				NRF_LOG_ERROR("CMD 0x%02X Error 0x%02X\n RETRY...\n", msc_op->xfer.cmd, msc_op->xfer.status);
+			} else {
+				break;
+			}
+		} while (1);
+
+		app_timer_cnt_diff_compute(app_timer_cnt_get(), msc_op->service, &msc_op->service);
+		mi_metrics_phase_end(&msc_op->phase);
+		msc_done = msc_op;
+		msc_op   = NULL;
+	}
 
 	PT_END(pt);
 }
 
+/* Queues a command for the thread pt, waiting while the op is still in use. */
+#define MSC_SUBMIT(pt, p_op, XFER, PRIO)                                        \
+	PT_WAIT_UNTIL(pt, msc_submit(p_op, XFER, PRIO, NULL) == 0)
+
+/* A thread stays here if the MSC gave up on the command. */
+#define MSC_WAIT(pt, p_op)                                                      \
+	PT_WAIT_UNTIL(pt, (p_op)->pending == 0 && (p_op)->xfer.status == 0)
+
 static void schd_evt_handler(schd_evt_t evt_id)
 {
 	switch (evt_id) {
@@ -758,8 +1269,8 @@ static void schd_evt_handler(schd_evt_t evt_id)
 	case SCHD_EVT_KEY_FOUND:
 	case SCHD_EVT_KEY_DEL_FAIL:
 	case SCHD_EVT_KEY_DEL_SUCC:
+		mi_scheduler_stop(evt_id);
 		schd_stat = 0;
-		mi_scheduler_stop(0);
 		break;
 	}
 
@@ -799,15 +1310,323 @@ static int monitor(pt_t *pt)
 	PT_END(pt);
 }
 
+/*** MSC cache ***/
+/*
+ * At boot the cache is loaded from flash. It is used if its CRC checks out and
+ * the MSC_ID of the chip is the cached one, otherwise it is read from the MSC
+ * and saved again. A handshake then only runs ECDHE and SIGN on the TWI,
+ * unless the boot could not get the cache.
+ */
+#define MSC_CACHE_VERSION  1
+#define MSC_CACHE_REC(key) (1 << ((key) - REC_MSC_CACHE))
+#define MSC_CACHE_RECS     (MSC_CACHE_REC(REC_MSC_CACHE) | MSC_CACHE_REC(REC_MSC_DEV_CERT) | MSC_CACHE_REC(REC_MSC_MANU_CERT))
+
+static uint8_t msc_cache_valid;
+static uint8_t msc_cache_fetching;
+static uint8_t msc_cache_unsaved;   /* records not yet queued, by MSC_CACHE_REC() */
+#if MI_SHARED_PRESIGN
+static uint8_t shared_presign_valid;
+
+/*
+ * A shared login signs the hash of dev_pub, the same on every login, so the
+ * signature is made once, at boot or by the first shared login. It stays
+ * valid until the MSC cache is read again, which is when dev_pub may change.
+ */
+static __ALIGN(4) struct {
+	uint8_t  sha[32];           /* of the dev_pub it was made for */
+	uint8_t  sign[64];
+	uint32_t crc;               /* of the above */
+} shared_presign;
+#endif
+
+/* PUBKEY, INFO, ID, CERTS_LEN, DEV_CERT and MANU_CERT */
+static msc_op_t msc_cache_ops[6];
+static msc_op_t msc_id_op;
+
+static uint32_t msc_cache_crc(void)
+{
+	soft_crc32_ctx_t ctx;
+
+	soft_crc32_init(&ctx);
+	soft_crc32_update(&ctx, &msc_cache, (uint8_t *)&msc_cache.crc - (uint8_t *)&msc_cache);
+	soft_crc32_update(&ctx, dev_cert,  msc_cache.certs_len.dev);
+	soft_crc32_update(&ctx, manu_cert, msc_cache.certs_len.manu);
+
+	return soft_crc32_final(&ctx);
+}
+
+static int msc_cache_check(void)
+{
+	return msc_cache.version        == MSC_CACHE_VERSION &&
+	       msc_cache.protocol_ver   == PROTOCOL_VERSION  &&
+	       msc_cache.certs_len.dev  <= sizeof(dev_cert)  &&
+	       msc_cache.certs_len.manu <= sizeof(manu_cert) &&
+	       msc_cache.crc            == msc_cache_crc();
+}
+
+static void msc_cache_flags_set(void)
+{
+	SET_DATA_VAILD(flags.msc_info);
+	SET_DATA_VAILD(flags.dev_pub);
+	SET_DATA_VAILD(flags.dev_cert);
+	SET_DATA_VAILD(flags.manu_cert);
+}
+
+/* Returns 1 if the record could not be queued and is given up. */
+static int msc_cache_write(uint16_t rec_key, void *p_data, uint16_t len)
+{
+	int errno;
+
+	if (!(msc_cache_unsaved & MSC_CACHE_REC(rec_key)))
+		return 0;
+
+	errno = mi_psm_record_write(rec_key, p_data, len);
+	if (errno == MI_ERROR_BUSY || errno == MI_ERROR_RESOURCES)
+		return 0;
+
+	msc_cache_unsaved &= ~MSC_CACHE_REC(rec_key);
+	if (errno != MI_SUCCESS) {
+		NRF_LOG_ERROR("MSC cache record %X not saved: %d\n", rec_key, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queues the records left to write. The FDS queue or a garbage collection may
+ * hold some back; the scheduler passes call this again until all are in. The
+ * cache is valid once its records are queued. If one cannot be, the rest is
+ * dropped and the MSC is read again next time.
+ */
+static void msc_cache_flush(void)
+{
+	uint8_t was_unsaved = msc_cache_unsaved & MSC_CACHE_RECS;
+	int failed;
+
+	failed  = msc_cache_write(REC_MSC_DEV_CERT,  dev_cert,  msc_cache.certs_len.dev);
+	failed |= msc_cache_write(REC_MSC_MANU_CERT, manu_cert, msc_cache.certs_len.manu);
+	failed |= msc_cache_write(REC_MSC_CACHE,     (uint8_t*)&msc_cache, sizeof(msc_cache));
+#if MI_SHARED_PRESIGN == 2
+	msc_cache_write(REC_MSC_SHARED_SIGN, (uint8_t*)&shared_presign, sizeof(shared_presign));
+#endif
+
+	if (failed) {
+		msc_cache_unsaved &= ~MSC_CACHE_RECS;
+	} else if (was_unsaved && !(msc_cache_unsaved & MSC_CACHE_RECS)) {
+		msc_cache_valid = 1;
+		NRF_LOG_RAW_INFO("MSC cache saved.\n");
+	}
+}
+
+/* The certificates of 0 bytes are not written, FDS cannot keep them. */
+static void msc_cache_save(void)
+{
+	msc_cache.version      = MSC_CACHE_VERSION;
+	msc_cache.protocol_ver = PROTOCOL_VERSION;
+	msc_cache.crc          = msc_cache_crc();
+	msc_cache_valid = 0;
+#if MI_SHARED_PRESIGN
+	shared_presign_valid = 0;
+#endif
+	msc_cache_flags_set();
+
+	msc_cache_unsaved = MSC_CACHE_REC(REC_MSC_CACHE);
+	if (msc_cache.certs_len.dev)
+		msc_cache_unsaved |= MSC_CACHE_REC(REC_MSC_DEV_CERT);
+	if (msc_cache.certs_len.manu)
+		msc_cache_unsaved |= MSC_CACHE_REC(REC_MSC_MANU_CERT);
+	msc_cache_flush();
+}
+
+/* The reads run in the MSC queue; the certificates once their lengths are in. */
+static void msc_cache_op_handler(msc_op_t *p_op)
+{
+	if (!msc_cache_fetching)
+		return;
+
+	if (p_op->xfer.status != 0) {
+		msc_cache_fetching = 0;
+		return;
+	}
+
+	switch (p_op->xfer.cmd) {
+	case MSC_INFO:
+		tmp_info.protocol_ver = PROTOCOL_VERSION;
+		memcpy(msc_cache.msc_info+8, (uint8_t*)&tmp_info.sw_ver, 4);
+		break;
+
+	case MSC_CERTS_LEN:
+		msc_cache.certs_len.dev  = __REV16(msc_cache.certs_len.dev);
+		msc_cache.certs_len.manu = __REV16(msc_cache.certs_len.manu);
+		if (msc_cache.certs_len.dev > sizeof(dev_cert) || msc_cache.certs_len.manu > sizeof(manu_cert)) {
+			NRF_LOG_ERROR("MSC certs len error.\n");
+			msc_cache_fetching = 0;
+			break;
+		}
+		msc_submit(&msc_cache_ops[4], MSC_XFER(MSC_DEV_CERT, NULL, 0, dev_cert, msc_cache.certs_len.dev),
+		           MSC_PRIO_READ, msc_cache_op_handler);
+		msc_submit(&msc_cache_ops[5], MSC_XFER(MSC_MANU_CERT, NULL, 0, manu_cert, msc_cache.certs_len.manu),
+		           MSC_PRIO_READ, msc_cache_op_handler);
+		break;
+
+	case MSC_MANU_CERT:
+		msc_cache_fetching = 0;
+		msc_cache_save();
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Sets the cache flags if the cache is valid, else starts reading it from the
+ * MSC unless that is running; the flags are set when it is done. Returns 0
+ * while a read cancelled by mi_scheduler_stop() is still on the MSC.
+ */
+static int msc_cache_get(void)
+{
+	uint8_t i;
+
+	if (msc_cache_valid) {
+		msc_cache_flags_set();
+		return 1;
+	}
+
+	if (msc_cache_fetching)
+		return 1;
+
+	/* read already, but not all in flash yet */
+	if (msc_cache_unsaved & MSC_CACHE_RECS) {
+		msc_cache_flags_set();
+		msc_cache_flush();
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(msc_cache_ops) / sizeof(msc_cache_ops[0]); i++)
+		if (msc_cache_ops[i].pending)
+			return 0;
+
+	msc_cache_fetching = 1;
+	msc_submit(&msc_cache_ops[0], MSC_XFER(MSC_PUBKEY, NULL, 0, msc_cache.dev_pub, 64),
+	           MSC_PRIO_READ, msc_cache_op_handler);
+	msc_submit(&msc_cache_ops[1], MSC_XFER(MSC_INFO, NULL, 0, (void*)&tmp_info, 26),
+	           MSC_PRIO_READ, msc_cache_op_handler);
+	msc_submit(&msc_cache_ops[2], MSC_XFER(MSC_ID, NULL, 0, msc_cache.msc_info, 8),
+	           MSC_PRIO_READ, msc_cache_op_handler);
+	msc_submit(&msc_cache_ops[3], MSC_XFER(MSC_CERTS_LEN, NULL, 0, (void*)&msc_cache.certs_len, sizeof(msc_cache.certs_len)),
+	           MSC_PRIO_READ, msc_cache_op_handler);
+
+	return 1;
+}
+
+static int msc_cache_cert_load(uint16_t rec_key, uint8_t *p_cert, uint16_t len)
+{
+	return len == 0 || mi_psm_record_read(rec_key, p_cert, len) == MI_SUCCESS;
+}
+
+static int msc_cache_load(pt_t *pt)
+{
+	static uint8_t id[8];
+
+	PT_BEGIN(pt);
+
+	if (mi_psm_record_read(REC_MSC_CACHE, (uint8_t*)&msc_cache, sizeof(msc_cache)) == MI_SUCCESS &&
+	    msc_cache.certs_len.dev  <= sizeof(dev_cert)  &&
+	    msc_cache.certs_len.manu <= sizeof(manu_cert) &&
+	    msc_cache_cert_load(REC_MSC_DEV_CERT,  dev_cert,  msc_cache.certs_len.dev)  &&
+	    msc_cache_cert_load(REC_MSC_MANU_CERT, manu_cert, msc_cache.certs_len.manu) &&
+	    msc_cache_check()) {
+		MSC_SUBMIT(pt, &msc_id_op, MSC_XFER(MSC_ID, NULL, 0, id, 8), MSC_PRIO_READ);
+		MSC_WAIT(pt, &msc_id_op);
+		msc_cache_valid = memcmp(id, msc_cache.msc_info, 8) == 0;
+	}
+
+	if (msc_cache_valid) {
+		NRF_LOG_RAW_INFO("MSC cache loaded.\n");
+	} else {
+		NRF_LOG_RAW_INFO("MSC cache missing or stale, reading the MSC.\n");
+		PT_WAIT_UNTIL(pt, msc_cache_get());
+		PT_WAIT_UNTIL(pt, !msc_cache_fetching);
+	}
+
+	PT_END(pt);
+}
+
+/* What a shared login signs. */
+static void shared_sha(uint8_t *p_sha)
+{
+	mbedtls_sha256_context sha256_ctx;
+
+	mbedtls_sha256_init(&sha256_ctx);
+	mbedtls_sha256_starts(&sha256_ctx, 0 );
+	mbedtls_sha256_update(&sha256_ctx, msc_cache.dev_pub, 64);
+	mbedtls_sha256_finish(&sha256_ctx, p_sha);
+}
+
+#if MI_SHARED_PRESIGN
+static msc_op_t msc_presign_op;
+
+static uint32_t shared_presign_crc(void)
+{
+	return soft_crc32(&shared_presign, (uint8_t *)&shared_presign.crc - (uint8_t *)&shared_presign, 0);
+}
+
+static void shared_presign_keep(void)
+{
+	shared_presign.crc   = shared_presign_crc();
+	shared_presign_valid = 1;
+#if MI_SHARED_PRESIGN == 2
+	msc_cache_unsaved |= MSC_CACHE_REC(REC_MSC_SHARED_SIGN);
+	msc_cache_flush();
+#endif
+}
+
+/* Loads the signature kept in flash or has the MSC make one. */
+static int shared_presign_load(pt_t *pt)
+{
+	PT_BEGIN(pt);
+
+	if (shared_presign_valid || !msc_cache_valid)
+		PT_EXIT(pt);
+
+#if MI_SHARED_PRESIGN == 2
+	if (mi_psm_record_read(REC_MSC_SHARED_SIGN, (uint8_t*)&shared_presign, sizeof(shared_presign)) == MI_SUCCESS &&
+	    shared_presign.crc == shared_presign_crc()) {
+		shared_sha(dev_sha);
+		shared_presign_valid = memcmp(dev_sha, shared_presign.sha, 32) == 0;
+	}
+	if (shared_presign_valid)
+		PT_EXIT(pt);
+#endif
+
+	shared_sha(shared_presign.sha);
+	MSC_SUBMIT(pt, &msc_presign_op, MSC_XFER(MSC_SIGN, shared_presign.sha, 32, shared_presign.sign, 64), MSC_PRIO_READ);
+	PT_WAIT_UNTIL(pt, msc_presign_op.pending == 0);
+	if (msc_presign_op.xfer.status == 0)
+		shared_presign_keep();
+	NRF_LOG_RAW_INFO("Shared login signature %s.\n", (uint32_t)(shared_presign_valid ? "made" : "failed"));
+
+	PT_END(pt);
+}
+#endif
+
+/* MKPK, ECDHE and SIGN of the running procedure */
+static msc_op_t msc_key_op;
+static msc_op_t msc_ecdhe_op;
+static msc_op_t msc_sign_op;
+
 static int psm_restore(pt_t *pt)
 {
 	uint8_t errno;
 
 	PT_BEGIN(pt);
-	
+
 	errno = mi_psm_record_read(0xBEEF, (uint8_t*)&mi_sysinfo, sizeof(mi_sysinfo));
 	if (errno == MI_ERROR_NOT_FOUND) {
 		set_mi_reg_stat(false);
+		PT_SPAWN(pt, &pt_cache_thd, msc_cache_load(&pt_cache_thd));
 		PT_YIELD(pt);
 		enqueue(&schd_evt_queue, SCHD_EVT_KEY_NOT_FOUND);
 		PT_EXIT(pt);
@@ -817,19 +1636,29 @@ static int psm_restore(pt_t *pt)
 	}
 	
 	set_beacon_key(mi_sysinfo.beacon_key);
+	mbedtls_ccm_setkey(&cloud_ccm, mi_sysinfo.cloud_key);
 
+	/* ahead of the MSC_ID check of the cache */
 #if ENC_LTMK
 	MKPK.id = 0;
-	msc_control_block = MSC_XFER(MSC_RD_MKPK, &MKPK.id, 1, (uint8_t*)MKPK.cipher, 32+4);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.MKPK);
+	MSC_SUBMIT(pt, &msc_key_op, MSC_XFER(MSC_RD_MKPK, &MKPK.id, 1, (uint8_t*)MKPK.cipher, 32+4), MSC_PRIO_KEY);
 #else
 	MKPK.id = 1;
-	msc_control_block = MSC_XFER(MSC_RD_MKPK, &MKPK.id, 1, (uint8_t*)LTMK, 32);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_key_op, MSC_XFER(MSC_RD_MKPK, &MKPK.id, 1, (uint8_t*)LTMK, 32), MSC_PRIO_KEY);
+#endif
+	PT_SPAWN(pt, &pt_cache_thd, msc_cache_load(&pt_cache_thd));
+
+	MSC_WAIT(pt, &msc_key_op);
+#if ENC_LTMK
+	SET_DATA_VAILD(flags.MKPK);
+#else
 	SET_DATA_VAILD(flags.LTMK);
 #endif
 
+#if MI_SHARED_PRESIGN
+	PT_SPAWN(pt, &pt_cache_thd, shared_presign_load(&pt_cache_thd));
+#endif
+
 	enqueue(&schd_evt_queue, SCHD_EVT_KEY_FOUND);
 	PT_END(pt);
 }
@@ -885,40 +1714,17 @@ static int reg_msc(pt_t *pt)
 {
 	PT_BEGIN(pt);
 
-	msc_control_block = MSC_XFER(MSC_PUBKEY, NULL, 0, dev_pub, 64);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-
-	msc_control_block = MSC_XFER(MSC_INFO, NULL, 0, (void*)&tmp_info, 26);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	tmp_info.protocol_ver = PROTOCOL_VERSION;
-	memcpy(msc_info+8, (uint8_t*)&tmp_info.sw_ver, 4);
-
-	msc_control_block = MSC_XFER(MSC_ID, NULL, 0, msc_info, 8);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.msc_info);
-
-	msc_control_block = MSC_XFER(MSC_CERTS_LEN, NULL, 0, (void*)&m_certs_len, sizeof(m_certs_len));
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-
-	m_certs_len.dev  = __REV16(m_certs_len.dev);
-	m_certs_len.manu = __REV16(m_certs_len.manu);
-	
-	msc_control_block = MSC_XFER(MSC_DEV_CERT, NULL, 0, dev_cert, m_certs_len.dev);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.dev_cert);
-
-	msc_control_block = MSC_XFER(MSC_MANU_CERT, NULL, 0, manu_cert, m_certs_len.manu);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.manu_cert);
+	/* a read of the cache is queued behind the ECDHE */
+	PT_WAIT_UNTIL(pt, msc_cache_get());
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.app_pub));
-	msc_control_block = MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_ecdhe_op, MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32), MSC_PRIO_HANDSHAKE);
+	MSC_WAIT(pt, &msc_ecdhe_op);
 	SET_DATA_VAILD(flags.eph_key);
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_sha));
-	msc_control_block = MSC_XFER(MSC_SIGN, dev_sha, 32, dev_sign, 64);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_sign_op, MSC_XFER(MSC_SIGN, dev_sha, 32, dev_sign, 64), MSC_PRIO_HANDSHAKE);
+	MSC_WAIT(pt, &msc_sign_op);
 	SET_DATA_VAILD(flags.dev_sign);
 
 #if (PRINT_SIGN == 1)
@@ -939,17 +1745,17 @@ static int reg_ble(pt_t *pt)
 	
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.msc_info));
 
-	format_tx_cb(&rxfer_control_block, msc_info, sizeof(msc_info) + sizeof(dev_pub));
+	format_tx_cb(&rxfer_control_block, msc_cache.msc_info, sizeof(msc_cache.msc_info) + sizeof(msc_cache.dev_pub));
 	PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_PUBKEY));
 	NRF_LOG_INFO("dev_pub send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_cert));
-	format_tx_cb(&rxfer_control_block, dev_cert, m_certs_len.dev);
+	format_tx_cb(&rxfer_control_block, dev_cert, msc_cache.certs_len.dev);
 	PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_CERT));
 	NRF_LOG_INFO("dev_cert send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 	
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.manu_cert));
-	format_tx_cb(&rxfer_control_block, manu_cert, m_certs_len.manu);
+	format_tx_cb(&rxfer_control_block, manu_cert, msc_cache.certs_len.manu);
 	PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_MANU_CERT));
 	NRF_LOG_INFO("manu_cert send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 	
@@ -982,14 +1788,14 @@ static int reg_auth(pt_t *pt)
 	mbedtls_sha256_context sha256_ctx;
 	mbedtls_sha256_init(&sha256_ctx);
 	mbedtls_sha256_starts(&sha256_ctx, 0 );
-	mbedtls_sha256_update(&sha256_ctx, msc_info,    sizeof(msc_info));
-	mbedtls_sha256_update(&sha256_ctx, dev_mac_be,  sizeof(dev_mac_be));
-	mbedtls_sha256_update(&sha256_ctx, dev_pub,     64);
+	mbedtls_sha256_update(&sha256_ctx, msc_cache.msc_info, sizeof(msc_cache.msc_info));
+	mbedtls_sha256_update(&sha256_ctx, dev_mac_be,         sizeof(dev_mac_be));
+	mbedtls_sha256_update(&sha256_ctx, msc_cache.dev_pub,  64);
 	mbedtls_sha256_finish(&sha256_ctx, dev_sha);
 	SET_DATA_VAILD(flags.dev_sha);
 #if (PRINT_MSC_INFO   == 1)
 	NRF_LOG_RAW_INFO("MSC info\t");
-	NRF_LOG_HEXDUMP_INFO(msc_info, 12);
+	NRF_LOG_HEXDUMP_INFO(msc_cache.msc_info, 12);
 #endif
 #if (PRINT_MAC        == 1)
 	NRF_LOG_RAW_INFO("MAC\t");
@@ -997,7 +1803,7 @@ static int reg_auth(pt_t *pt)
 #endif
 #if (PRINT_DEV_PUBKEY == 1)
 	NRF_LOG_RAW_INFO("DEV_PUBKEY\t");
-	NRF_LOG_HEXDUMP_INFO(dev_pub, 16);
+	NRF_LOG_HEXDUMP_INFO(msc_cache.dev_pub, 16);
 #endif
 #if (PRINT_SHA256     == 1)
 	NRF_LOG_RAW_INFO("SHA256\t");
@@ -1005,16 +1811,18 @@ static int reg_auth(pt_t *pt)
 #endif
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.eph_key));
-	sha256_hkdf(     eph_key,         sizeof(eph_key),
-	        (void *)reg_salt,         sizeof(reg_salt)-1,
+	PT_WAIT_UNTIL(pt, keysched_start(
+	                 eph_key,         sizeof(eph_key),
+	          &reg_salt_hmac,
 	        (void *)reg_info,         sizeof(reg_info)-1,
-	    (void *)&session_key,         sizeof(session_key));
+	    (void *)&session_key,         sizeof(session_key)) == MI_SUCCESS);
+	PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, dev_key));
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_sign));
 
-	aes_ccm_encrypt_and_tag(session_key.dev_key, nonce, sizeof(nonce), NULL, 0,
-	                        dev_sign, 64, encrypt_reg_data.cipher, encrypt_reg_data.mic, 4);
+	reg_data_encrypt();
 	SET_DATA_VAILD(flags.encrypt_reg_data);
+	mi_keysched_clear(&key_sched);
 
 	PT_WAIT_UNTIL(pt, auth_recv() != REG_START);
 	if (auth_recv() == REG_VERIFY_FAIL) {
@@ -1030,10 +1838,13 @@ static int reg_auth(pt_t *pt)
 	}
 	sd_rand_application_vector_get(rand_key, 16);
 
-	sha256_hkdf(     eph_key,         sizeof(eph_key),
-	        (void *) mk_salt,         sizeof(mk_salt)-1,
+	PT_WAIT_UNTIL(pt, keysched_start(
+	                 eph_key,         sizeof(eph_key),
+	           &mk_salt_hmac,
 	        (void *) mk_info,         sizeof(mk_info)-1,
-	                    LTMK,         sizeof(LTMK));
+	                    LTMK,         sizeof(LTMK)) == MI_SUCCESS);
+	PT_WAIT_UNTIL(pt, key_ready(0, sizeof(LTMK)));
+	mi_keysched_clear(&key_sched);
 	SET_DATA_VAILD(flags.LTMK);
 #if PRINT_LTMK
 	NRF_LOG_RAW_HEXDUMP_INFO(LTMK, 32);
@@ -1048,31 +1859,39 @@ static int reg_auth(pt_t *pt)
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.MKPK));
 	
 	MKPK.id = 0;
-	msc_control_block = MSC_XFER(MSC_WR_MKPK, (void*)&MKPK, 1+32+4, NULL, 0);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_key_op, MSC_XFER(MSC_WR_MKPK, (void*)&MKPK, 1+32+4, NULL, 0), MSC_PRIO_KEY);
+	MSC_WAIT(pt, &msc_key_op);
 #else
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.LTMK));
 	
 	MKPK.id = 1;
 	memcpy(MKPK.cipher, LTMK, 32);
-	msc_control_block = MSC_XFER(MSC_WR_MKPK, (void*)&MKPK, 1+32, NULL, 0);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_key_op, MSC_XFER(MSC_WR_MKPK, (void*)&MKPK, 1+32, NULL, 0), MSC_PRIO_KEY);
+	MSC_WAIT(pt, &msc_key_op);
 
 #endif
 
-	sha256_hkdf(        LTMK,         sizeof(LTMK),
-		  (void *)cloud_salt,         sizeof(cloud_salt)-1,
-		  (void *)cloud_info,         sizeof(cloud_info)-1,
-		  (void *)&cloud_key,         sizeof(cloud_key));
+	PT_WAIT_UNTIL(pt, keysched_start(
+	                    LTMK,         sizeof(LTMK),
+	        &cloud_salt_hmac,
+	      (void *)cloud_info,         sizeof(cloud_info)-1,
+	      (void *)&cloud_key,         sizeof(cloud_key)) == MI_SUCCESS);
+	PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, dev_key));
+	PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, app_key));
+	mi_keysched_clear(&key_sched);
 	
-	memcpy(mi_sysinfo.did,        msc_info, 8);
+	memcpy(mi_sysinfo.did,        msc_cache.msc_info, 8);
 	memcpy(mi_sysinfo.beacon_key, cloud_key.app_key, 16);
 	memcpy(mi_sysinfo.cloud_key,  cloud_key.dev_key, 16);
+	mbedtls_ccm_setkey(&cloud_ccm, mi_sysinfo.cloud_key);
 	
-	uint8_t errno = mi_psm_record_write(0xBEEF, (uint8_t*)&mi_sysinfo, sizeof(mi_sysinfo));
+	/* a write held back for a garbage collection is busy until it is in flash */
+	uint8_t errno;
+	PT_WAIT_UNTIL(pt, (errno = mi_psm_record_write(0xBEEF, (uint8_t*)&mi_sysinfo, sizeof(mi_sysinfo))) != MI_ERROR_RESOURCES &&
+	                  errno != MI_ERROR_BUSY);
 	if (errno != MI_SUCCESS) {
-		PT_WAIT_UNTIL(pt, auth_send(REG_FAILED) == NRF_SUCCESS);
 		NRF_LOG_RAW_INFO("KEYINFO STORE FAILED: %d\n", errno);
+		PT_WAIT_UNTIL(pt, auth_send(REG_FAILED) == NRF_SUCCESS);
 		enqueue(&schd_evt_queue, SCHD_EVT_REG_FAILED);
 		
 	 } else {
@@ -1112,14 +1931,12 @@ static int admin_msc(pt_t *pt)
 {
 	PT_BEGIN(pt);
 
-	msc_control_block = MSC_XFER(MSC_PUBKEY, NULL, 0, dev_pub, 64);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.dev_pub);
+	PT_WAIT_UNTIL(pt, msc_cache_get());
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.app_pub));
 
-	msc_control_block = MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_ecdhe_op, MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32), MSC_PRIO_HANDSHAKE);
+	MSC_WAIT(pt, &msc_ecdhe_op);
 	SET_DATA_VAILD(flags.eph_key);
 
 	PT_END(pt);
@@ -1129,15 +1946,17 @@ static int admin_ble(pt_t *pt)
 {
 	PT_BEGIN(pt);
 	
+	rxd_decrypt_reset();
 	format_rx_cb(&rxfer_control_block, app_pub, sizeof(app_pub));
 	PT_SPAWN(pt, &pt_r_rx_thd, rxfer_rx_thd(&pt_r_rx_thd, &rxfer_control_block, DEV_PUBKEY));
 	SET_DATA_VAILD(flags.app_pub);
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_pub));
-	format_tx_cb(&rxfer_control_block, dev_pub, sizeof(dev_pub));
+	format_tx_cb(&rxfer_control_block, msc_cache.dev_pub, sizeof(msc_cache.dev_pub));
 	PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_PUBKEY));
 
 	format_rx_cb(&rxfer_control_block, &encrypt_login_data, sizeof(encrypt_login_data));
+	rxfer_control_block.rx_hook = rxd_decrypt_hook;
 	PT_SPAWN(pt, &pt_r_rx_thd, rxfer_rx_thd(&pt_r_rx_thd, &rxfer_control_block, DEV_LOGIN_INFO));
 	SET_DATA_VAILD(flags.encrypt_login_data);
 
@@ -1156,31 +1975,47 @@ static int admin_auth(pt_t *pt)
 #endif
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.eph_key));
 
-	sha256_hkdf(     eph_key,         sizeof(eph_key) + sizeof(LTMK),
-	        (void *)log_salt,         sizeof(log_salt)-1,
+	PT_WAIT_UNTIL(pt, keysched_start(
+	                 eph_key,         sizeof(eph_key) + sizeof(LTMK),
+	          &log_salt_hmac,
 	        (void *)log_info,         sizeof(log_info)-1,
-	    (void *)&session_key,         sizeof(session_key));
+	    (void *)&session_key,         sizeof(session_key)) == MI_SUCCESS);
+	PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, app_key));
+
+	rxd_decrypt_start(session_key.app_key, &encrypt_login_data.crc32,
+	                  encrypt_login_data.mic, sizeof(encrypt_login_data.cipher));
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.encrypt_login_data));
 
-	errno = 
-	aes_ccm_auth_decrypt(session_key.app_key,
-	                               nonce,  sizeof(nonce),
-	                                NULL,  0,
-	           encrypt_login_data.cipher,  sizeof(encrypt_login_data.cipher),
-	    (void*)&encrypt_login_data.crc32,
-	              encrypt_login_data.mic,  4);
+	if (rxd_decrypt.state == RXD_DONE)
+		errno = rxd_decrypt.result;
+	else {
+		mbedtls_ccm_fixed tmpl;
+
+		mi_metrics_phase_begin(&ccm_phase, MI_PHASE_CCM, 0);
+		mbedtls_ccm_setkey(&rxd_decrypt.ccm, session_key.app_key);
+		login_ccm_template(&tmpl, nonce);
+		errno = login_ccm_auth_decrypt(&rxd_decrypt.ccm, &tmpl, NULL,
+		                               encrypt_login_data.cipher,
+		                               (void*)&encrypt_login_data.crc32,
+		                               encrypt_login_data.mic);
+		mi_metrics_phase_end(&ccm_phase);
+	}
 
-	crc32 = soft_crc32(dev_pub, sizeof(dev_pub), 0);
+	crc32 = soft_crc32(msc_cache.dev_pub, sizeof(msc_cache.dev_pub), 0);
 
   	if (crc32 == encrypt_login_data.crc32) {
 		NRF_LOG_INFO("ADMIN LOG SUCCESS: %d\n", schd_time);
 		key_id = 0;
 		set_mi_authorization(OWNER_AUTHORIZATION);
-		mi_crypto_init(&session_key);
+		PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, dev_iv));
+		PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, app_iv));
+		mi_keysched_clear(&key_sched);
+		mi_crypto_init(ble_mi_conn_handle(), &session_key);
 		PT_WAIT_UNTIL(pt, auth_send(LOG_SUCCESS) == NRF_SUCCESS);
 		enqueue(&schd_evt_queue, SCHD_EVT_ADMIN_LOGIN_SUCCESS);
 	} else {
+		mi_keysched_clear(&key_sched);
 		NRF_LOG_ERROR("ADMIN LOG FAILED. %d\n", errno);
 		PT_WAIT_UNTIL(pt, auth_send(LOG_FAILED) == NRF_SUCCESS);
 		enqueue(&schd_evt_queue, SCHD_EVT_ADMIN_LOGIN_FAILED);
@@ -1225,7 +2060,7 @@ static int verify_share_info(void * pinfo, uint8_t * p_LTMK)
 	memcpy(adata, mi_sysinfo.did, 8);
 	adata[8] = 0x01;
 
-	errno = aes_ccm_auth_decrypt(mi_sysinfo.cloud_key,
+	errno = mbedtls_ccm_auth_decrypt(&cloud_ccm,
 	                 virtual_key.nonce, 12,
 	                             adata,  9,
 	           (void*)&virtual_key.key, 16,
@@ -1253,39 +2088,35 @@ static int shared_msc(pt_t *pt)
 {
 	PT_BEGIN(pt);
 
-	msc_control_block = MSC_XFER(MSC_PUBKEY, NULL, 0, dev_pub, 64);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.dev_pub);
-
-	if (schd_stat == SHARED_LOG_START_W_CERT) {
-		msc_control_block = MSC_XFER(MSC_CERTS_LEN, NULL, 0, (void*)&m_certs_len, sizeof(m_certs_len));
-		PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-
-		m_certs_len.dev  = __REV16(m_certs_len.dev);
-		m_certs_len.manu = __REV16(m_certs_len.manu);
-		
-		msc_control_block = MSC_XFER(MSC_DEV_CERT, NULL, 0, dev_cert, m_certs_len.dev);
-		PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-		SET_DATA_VAILD(flags.dev_cert);
+	PT_WAIT_UNTIL(pt, msc_cache_get());
+	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_pub));
 
-		msc_control_block = MSC_XFER(MSC_MANU_CERT, NULL, 0, manu_cert, m_certs_len.manu);
-		PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-		SET_DATA_VAILD(flags.manu_cert);
+#if MI_SHARED_PRESIGN
+	if (shared_presign_valid) {
+		memcpy(dev_sign, shared_presign.sign, 64);
+		SET_DATA_VAILD(flags.dev_sign);
 	}
+#endif
 
-	mbedtls_sha256_context sha256_ctx;
-	mbedtls_sha256_init(&sha256_ctx);
-	mbedtls_sha256_starts(&sha256_ctx, 0 );
-	mbedtls_sha256_update(&sha256_ctx, dev_pub, 64);
-	mbedtls_sha256_finish(&sha256_ctx, dev_sha);
-
-	msc_control_block = MSC_XFER(MSC_SIGN, dev_sha, 32, dev_sign, 64);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
-	SET_DATA_VAILD(flags.dev_sign);
+	/* the ECDHE is queued while the MSC signs */
+	if (DATA_IS_INVAILD_P(flags.dev_sign)) {
+		shared_sha(dev_sha);
+		MSC_SUBMIT(pt, &msc_sign_op, MSC_XFER(MSC_SIGN, dev_sha, 32, dev_sign, 64), MSC_PRIO_HANDSHAKE);
+	}
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.app_pub));
-	msc_control_block = MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32);
-	PT_SPAWN(pt, &pt_msc_thd, msc_thread(&pt_msc_thd, &msc_control_block));
+	MSC_SUBMIT(pt, &msc_ecdhe_op, MSC_XFER(MSC_ECDHE, app_pub, 64, eph_key, 32), MSC_PRIO_HANDSHAKE);
+
+	if (DATA_IS_INVAILD_P(flags.dev_sign)) {
+		MSC_WAIT(pt, &msc_sign_op);
+		SET_DATA_VAILD(flags.dev_sign);
+#if MI_SHARED_PRESIGN
+		memcpy(shared_presign.sha,  dev_sha,  32);
+		memcpy(shared_presign.sign, dev_sign, 64);
+		shared_presign_keep();
+#endif
+	}
+	MSC_WAIT(pt, &msc_ecdhe_op);
 	SET_DATA_VAILD(flags.eph_key);
 
 	PT_END(pt);
@@ -1295,22 +2126,23 @@ static int shared_ble(pt_t *pt)
 {
 	PT_BEGIN(pt);
 	
+	rxd_decrypt_reset();
 	format_rx_cb(&rxfer_control_block, app_pub, sizeof(app_pub));
 	PT_SPAWN(pt, &pt_r_rx_thd, rxfer_rx_thd(&pt_r_rx_thd, &rxfer_control_block, DEV_PUBKEY));
 	SET_DATA_VAILD(flags.app_pub);
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_pub));
-	format_tx_cb(&rxfer_control_block, dev_pub, sizeof(dev_pub));
+	format_tx_cb(&rxfer_control_block, msc_cache.dev_pub, sizeof(msc_cache.dev_pub));
 	PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_PUBKEY));
 
 	if (schd_stat == SHARED_LOG_START_W_CERT) {
 		PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.dev_cert));
-		format_tx_cb(&rxfer_control_block, dev_cert, m_certs_len.dev);
+		format_tx_cb(&rxfer_control_block, dev_cert, msc_cache.certs_len.dev);
 		PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_CERT));
 		NRF_LOG_INFO("dev_cert send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 		
 		PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.manu_cert));
-		format_tx_cb(&rxfer_control_block, manu_cert, m_certs_len.manu);
+		format_tx_cb(&rxfer_control_block, manu_cert, msc_cache.certs_len.manu);
 		PT_SPAWN(pt, &pt_r_tx_thd, rxfer_tx_thd(&pt_r_tx_thd, &rxfer_control_block, DEV_MANU_CERT));
 		NRF_LOG_INFO("manu_cert send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 	}
@@ -1321,6 +2153,7 @@ static int shared_ble(pt_t *pt)
 	NRF_LOG_INFO("dev_sign send "NRF_LOG_COLOR_CODE_BLUE"@ schd_time %d\n", schd_time);
 
 	format_rx_cb(&rxfer_control_block, &encrypt_share_data, sizeof(encrypt_share_data));
+	rxfer_control_block.rx_hook = rxd_decrypt_hook;
 	PT_SPAWN(pt, &pt_r_rx_thd, rxfer_rx_thd(&pt_r_rx_thd, &rxfer_control_block, DEV_SHARE_INFO));
 	SET_DATA_VAILD(flags.encrypt_share_data);
 	PT_END(pt);
@@ -1332,20 +2165,34 @@ static int shared_auth(pt_t *pt)
 	uint32_t errno;
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.eph_key));
-	sha256_hkdf(     eph_key,         sizeof(eph_key),
-	      (void *)share_salt,         sizeof(share_salt)-1,
+	PT_WAIT_UNTIL(pt, keysched_start(
+	                 eph_key,         sizeof(eph_key),
+	        &share_salt_hmac,
 	      (void *)share_info,         sizeof(share_info)-1,
-	    (void *)&session_key,         sizeof(session_key));
+	    (void *)&session_key,         sizeof(session_key)) == MI_SUCCESS);
+	PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, app_key));
+
+	rxd_decrypt_start(session_key.app_key, &shared_info,
+	                  encrypt_share_data.mic, sizeof(encrypt_share_data.cipher));
 
 	PT_WAIT_UNTIL(pt, DATA_IS_VAILD_P(flags.encrypt_share_data));
-	errno = aes_ccm_auth_decrypt(session_key.app_key,
-	                               nonce,  sizeof(nonce),
-	                                NULL,  0,
-	           encrypt_share_data.cipher,  sizeof(encrypt_share_data.cipher),
-	                 (void*)&shared_info,
-	              encrypt_share_data.mic,  sizeof(encrypt_share_data.mic));
+	if (rxd_decrypt.state == RXD_DONE)
+		errno = rxd_decrypt.result;
+	else {
+		mbedtls_ccm_fixed tmpl;
+
+		mi_metrics_phase_begin(&ccm_phase, MI_PHASE_CCM, 0);
+		mbedtls_ccm_setkey(&rxd_decrypt.ccm, session_key.app_key);
+		share_ccm_template(&tmpl, nonce);
+		errno = share_ccm_auth_decrypt(&rxd_decrypt.ccm, &tmpl, NULL,
+		                               encrypt_share_data.cipher,
+		                               (void*)&shared_info,
+		                               encrypt_share_data.mic);
+		mi_metrics_phase_end(&ccm_phase);
+	}
 
 	if (errno != 0 ) {
+		mi_keysched_clear(&key_sched);
 		NRF_LOG_ERROR("Invaild encrypt share info.\n");
 		PT_EXIT(pt);
 	}
@@ -1355,13 +2202,17 @@ static int shared_auth(pt_t *pt)
 // verify the virtual key
 
 	if (verify_share_info(&shared_info, LTMK) != 0) {
+		mi_keysched_clear(&key_sched);
 		NRF_LOG_ERROR("SHARED LOG FAILED: %d\n", schd_time);
 		PT_WAIT_UNTIL(pt, auth_send(SHARED_LOG_FAILED) == NRF_SUCCESS);
 		enqueue(&schd_evt_queue, SCHD_EVT_SHARE_LOGIN_FAILED);
 	} else {
 		NRF_LOG_INFO("SHARED LOG SUCCESS: %d\n", schd_time);
 		set_mi_authorization(SHARE_AUTHORIZATION);
-		mi_crypto_init(&session_key);
+		PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, dev_iv));
+		PT_WAIT_UNTIL(pt, KEY_READY(session_ctx_t, app_iv));
+		mi_keysched_clear(&key_sched);
+		mi_crypto_init(ble_mi_conn_handle(), &session_key);
 
 		PT_WAIT_UNTIL(pt, auth_send(SHARED_LOG_SUCCESS) == NRF_SUCCESS);
 		enqueue(&schd_evt_queue, SCHD_EVT_SHARE_LOGIN_SUCCESS);
@@ -75,12 +75,28 @@ typedef enum {
 
 typedef void (*mi_schd_event_handler_t)(schd_evt_t evt_id);
 
+/* Sources for mi_scheduler_wake(). */
+#define MI_SCHD_WAKE_TWI               (1UL << 0)
+#define MI_SCHD_WAKE_RX                (1UL << 1)
+#define MI_SCHD_WAKE_TX                (1UL << 2)
+#define MI_SCHD_WAKE_CRYPTO            (1UL << 3)
+
 void set_mi_authorization(mi_author_stat_t status);
 uint32_t get_mi_authorization(void);
 uint32_t get_mi_key_id(void);
-uint32_t mi_scheduler_init(uint32_t interval, mi_schd_event_handler_t handler);
+uint32_t mi_scheduler_init(uint32_t interval, uint32_t prescaler, mi_schd_event_handler_t handler);
 uint32_t mi_scheduler_start(uint32_t status);
 
+/**@brief Function for running the handshake threads as soon as possible.
+ *
+ * @details Call it when something a thread may wait on happened, from any
+ * context. The interval given to mi_scheduler_init() is only the fallback for
+ * the timeouts. Does nothing when no procedure is running.
+ *
+ * @param[in] sources  MI_SCHD_WAKE_ bits of what happened.
+ */
+void mi_scheduler_wake(uint32_t sources);
+
 #ifdef __cplusplus
 }
 #endif
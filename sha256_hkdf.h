@@ -54,6 +54,35 @@ typedef struct
 }
 mbedtls_sha256_context;
 
+/**
+ * \brief          CRC-32 of a message fed in pieces
+ */
+typedef struct
+{
+    uint32_t crc;               /*!< running CRC, inverted      */
+}
+soft_crc32_ctx_t;
+
+/**
+ * \brief          Start a CRC-32
+ */
+void soft_crc32_init( soft_crc32_ctx_t *ctx );
+
+/**
+ * \brief          Feed the next piece of the message
+ */
+void soft_crc32_update( soft_crc32_ctx_t *ctx, const void *buf, size_t size );
+
+/**
+ * \brief          CRC-32 of everything fed so far
+ *
+ *                 ctx is left unchanged, more can be fed after.
+ */
+uint32_t soft_crc32_final( const soft_crc32_ctx_t *ctx );
+
+/**
+ * \brief          CRC-32 of buf, continuing from crc (0 to start)
+ */
 uint32_t soft_crc32(const void *buf, size_t size, uint32_t crc);
 /**
  * \brief          Initialize SHA-256 context
@@ -107,6 +136,216 @@ void mbedtls_sha256_finish( mbedtls_sha256_context *ctx, unsigned char output[32
 /* Internal use */
 void mbedtls_sha256_process( mbedtls_sha256_context *ctx, const unsigned char data[64] );
 
+/**
+ * \brief          Output = HMAC-SHA-256( key, input buffer )
+ *
+ * \param key      HMAC secret key
+ * \param keylen   length of the HMAC key in bytes
+ * \param input    buffer holding the  data
+ * \param ilen     length of the input data
+ * \param output   HMAC-SHA-256 result (32 bytes)
+ *
+ * \return         0
+ */
+int mbedtls_md_hmac( const unsigned char *key, size_t keylen, const unsigned char *input, size_t ilen,
+                unsigned char *output );
+
+/**
+ * \brief          HMAC-SHA-256 state after keying
+ *
+ *                 Holds the SHA-256 states after the key ^ ipad and
+ *                 key ^ opad blocks, so each MAC under the key saves those
+ *                 two compressions.
+ */
+typedef struct
+{
+    mbedtls_sha256_context inner;   /*!< after key ^ ipad           */
+    mbedtls_sha256_context outer;   /*!< after key ^ opad           */
+}
+sha256_hmac_midstate;
+
+/**
+ * \brief          Key a midstate context
+ *
+ * \param ms       context to be set up
+ * \param key      HMAC secret key
+ * \param keylen   length of the HMAC key in bytes
+ */
+void sha256_hmac_midstate_init( sha256_hmac_midstate *ms,
+                                const unsigned char *key, size_t keylen );
+
+/**
+ * \brief          Output = HMAC-SHA-256( key of ms, input buffer )
+ *
+ *                 ms is left unchanged and can be used again.
+ *
+ * \param ms       context keyed by sha256_hmac_midstate_init()
+ * \param input    buffer holding the  data
+ * \param ilen     length of the input data
+ * \param output   HMAC-SHA-256 result
+ */
+void sha256_hmac_midstate_mac( const sha256_hmac_midstate *ms,
+                               const unsigned char *input, size_t ilen,
+                               unsigned char output[32] );
+
+/**
+ * \brief          Clear a midstate context
+ */
+void sha256_hmac_midstate_free( sha256_hmac_midstate *ms );
+
+/**
+ * \brief          The two midstates alone, small enough to keep in flash
+ *
+ *                 For a constant key, sha256_hmac_state_gen() runs at build
+ *                 time and sha256_hmac_midstate_load() at run time, which
+ *                 saves the two keying compressions.
+ */
+typedef struct
+{
+    uint32_t inner[8];              /*!< state after key ^ ipad     */
+    uint32_t outer[8];              /*!< state after key ^ opad     */
+}
+sha256_hmac_state;
+
+/**
+ * \brief          Compute the midstates of a key, for a generator
+ *
+ * \param st       midstates of key
+ * \param key      HMAC secret key
+ * \param keylen   length of the HMAC key in bytes
+ */
+void sha256_hmac_state_gen( sha256_hmac_state *st,
+                            const unsigned char *key, size_t keylen );
+
+/**
+ * \brief          Set up a midstate context from stored midstates
+ *
+ * \param ms       context to be set up
+ * \param st       midstates from sha256_hmac_state_gen()
+ */
+void sha256_hmac_midstate_load( sha256_hmac_midstate *ms,
+                                const sha256_hmac_state *st );
+
+/**
+ * \brief          HMAC-SHA-256 context for messages fed in pieces
+ *
+ *                 Keyed once; sha256_hmac_reset() starts the next message
+ *                 from the keyed state, so a MAC per record costs no
+ *                 keying compressions.
+ */
+typedef struct
+{
+    sha256_hmac_midstate key;       /*!< keyed states, kept         */
+    mbedtls_sha256_context msg;     /*!< message in progress        */
+}
+sha256_hmac_context;
+
+/**
+ * \brief          Key an HMAC context and start the first message
+ *
+ * \param ctx      context to be set up
+ * \param key      HMAC secret key
+ * \param keylen   length of the HMAC key in bytes
+ */
+void sha256_hmac_init( sha256_hmac_context *ctx,
+                       const unsigned char *key, size_t keylen );
+
+/**
+ * \brief          Key an HMAC context from stored midstates
+ *
+ * \param ctx      context to be set up
+ * \param st       midstates from sha256_hmac_state_gen()
+ */
+void sha256_hmac_init_state( sha256_hmac_context *ctx,
+                             const sha256_hmac_state *st );
+
+/**
+ * \brief          Feed the next piece of the message
+ *
+ * \param ctx      HMAC context
+ * \param input    buffer holding the  data
+ * \param ilen     length of the input data
+ */
+void sha256_hmac_update( sha256_hmac_context *ctx,
+                         const unsigned char *input, size_t ilen );
+
+/**
+ * \brief          HMAC of the message; sha256_hmac_reset() before the next
+ *
+ * \param ctx      HMAC context
+ * \param output   HMAC-SHA-256 result
+ */
+void sha256_hmac_finish( sha256_hmac_context *ctx, unsigned char output[32] );
+
+/**
+ * \brief          Drop the message in progress and start a new one under
+ *                 the same key
+ */
+void sha256_hmac_reset( sha256_hmac_context *ctx );
+
+/**
+ * \brief          Clear an HMAC context, key included
+ */
+void sha256_hmac_free( sha256_hmac_context *ctx );
+
+/**
+ * \brief          HKDF-SHA-256 context for expanding one block at a time
+ */
+typedef struct
+{
+    sha256_hmac_midstate prk;       /*!< HMAC keyed with the PRK    */
+    unsigned char t[32];            /*!< T(i)                       */
+    unsigned char i;                /*!< blocks expanded so far     */
+}
+sha256_hkdf_context;
+
+/**
+ * \brief          HKDF extract: PRK = HMAC-SHA-256( salt, IKM )
+ *
+ * \param ctx      context to be set up
+ * \param salt     salt
+ * \param salt_len length of the salt in bytes
+ * \param ikm      input keying material
+ * \param ikm_len  length of the input keying material in bytes
+ */
+void sha256_hkdf_extract( sha256_hkdf_context *ctx,
+                          const unsigned char *salt, size_t salt_len,
+                          const unsigned char *ikm, size_t ikm_len );
+
+/**
+ * \brief          HKDF extract with the salt given as stored midstates
+ *
+ *                 The same as sha256_hkdf_extract() with the salt st was
+ *                 generated from, two compressions cheaper.
+ *
+ * \param ctx      context to be set up
+ * \param st       midstates of the salt
+ * \param ikm      input keying material
+ * \param ikm_len  length of the input keying material in bytes
+ */
+void sha256_hkdf_extract_state( sha256_hkdf_context *ctx,
+                                const sha256_hmac_state *st,
+                                const unsigned char *ikm, size_t ikm_len );
+
+/**
+ * \brief          HKDF expand: the next 32 bytes of output keying material
+ *
+ * \param ctx      context set up by sha256_hkdf_extract()
+ * \param info     info string, the same for every block
+ * \param info_len length of the info string in bytes
+ * \param output   T(i)
+ *
+ * \return         0, or -1 after 255 blocks
+ */
+int sha256_hkdf_expand_next( sha256_hkdf_context *ctx,
+                             const unsigned char *info, size_t info_len,
+                             unsigned char output[32] );
+
+/**
+ * \brief          Clear an HKDF context
+ */
+void sha256_hkdf_free( sha256_hkdf_context *ctx );
+
 unsigned int sha256_hkdf(unsigned char *key, unsigned int key_len,unsigned char *salt, unsigned int salt_len,
 						unsigned char *info, unsigned int info_len, unsigned char *out, unsigned int out_len);
 